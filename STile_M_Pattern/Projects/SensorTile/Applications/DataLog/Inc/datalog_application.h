@@ -42,6 +42,8 @@ void DATALOG_SD_Init(void);
 uint8_t DATALOG_SD_Log_Enable(void);
 void DATALOG_SD_Log_Disable(void);
 void DATALOG_SD_NewLine(void);
+uint8_t DATALOG_SD_Save_Model(const void *model, uint32_t size);
+uint32_t DATALOG_SD_Load_Model(void *model, uint32_t size);
 void RTC_Handler( RTC_HandleTypeDef *RtcHandle );
 void Accelero_Sensor_Handler( void *handle );
 void Gyro_Sensor_Handler( void *handle );
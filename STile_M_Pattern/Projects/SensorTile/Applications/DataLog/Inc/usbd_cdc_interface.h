@@ -75,6 +75,8 @@ extern USBD_CDC_ItfTypeDef  USBD_CDC_fops;
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 uint8_t CDC_Fill_Buffer(uint8_t* Buf, uint32_t TotalLen);
+uint8_t CDC_Read_Char(uint8_t *c);
+void CDC_Clear_Char(void);
 
 #endif /* __USBD_CDC_IF_H */
 
@@ -47,6 +47,7 @@ volatile uint8_t SD_Log_Enabled = 0;
 static uint8_t verbose = 0;  /* Verbose output to UART terminal ON/OFF. */
 
 static char dataOut[256];
+#define MODEL_FILE_NAME "EMLMODEL.BIN"  /* Trained ANN, see DATALOG_SD_Save_Model */
 char newLine[] = "\r\n";
 
 // global variables for displacement
@@ -134,6 +135,63 @@ void DATALOG_SD_Log_Disable(void)
   SD_IO_CS_DeInit();
 }
 
+/**
+  * @brief  Write a trained model blob to the SDCard, replacing the previous one
+  * @param  model Model blob as written by ann_save_to_buffer
+  * @param  size  Blob size in bytes
+  * @retval 1 on success, 0 otherwise
+  */
+uint8_t DATALOG_SD_Save_Model(const void *model, uint32_t size)
+{
+  FIL ModelFile;
+  uint32_t byteswritten; /* written byte count */
+  uint8_t ok = 0;
+
+  /* SD SPI CS Config */
+  SD_IO_CS_Init();
+
+  if(f_open(&ModelFile, MODEL_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK)
+  {
+    ok = (f_write(&ModelFile, model, size, (void *)&byteswritten) == FR_OK && byteswritten == size);
+    if(f_close(&ModelFile) != FR_OK)
+    {
+      ok = 0;
+    }
+  }
+
+  /* SD SPI Config */
+  SD_IO_CS_DeInit();
+  return ok;
+}
+
+/**
+  * @brief  Read the model blob saved by DATALOG_SD_Save_Model in a single read
+  * @param  model Destination buffer, 4-byte aligned for ann_load_from_buffer
+  * @param  size  Buffer size in bytes
+  * @retval Bytes read, 0 if there is no saved model or it does not fit
+  */
+uint32_t DATALOG_SD_Load_Model(void *model, uint32_t size)
+{
+  FIL ModelFile;
+  uint32_t bytesread = 0; /* read byte count */
+
+  /* SD SPI CS Config */
+  SD_IO_CS_Init();
+
+  if(f_open(&ModelFile, MODEL_FILE_NAME, FA_OPEN_EXISTING | FA_READ) == FR_OK)
+  {
+    if(f_size(&ModelFile) > size || f_read(&ModelFile, model, f_size(&ModelFile), (void *)&bytesread) != FR_OK)
+    {
+      bytesread = 0;
+    }
+    f_close(&ModelFile);
+  }
+
+  /* SD SPI Config */
+  SD_IO_CS_DeInit();
+  return bytesread;
+}
+
 /**
   * @brief  Write New Line to file
   * @param  None
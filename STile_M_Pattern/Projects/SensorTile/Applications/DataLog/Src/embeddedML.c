@@ -20,150 +20,1682 @@
     along with EmbeddedML.  If not, see <https://www.gnu.org/licenses/>
 */
 
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
 #include "embeddedML.h"
 
-//-----ANN-----
-void BP_ANN(ANN *net, float *input, float *output, float *weights, float *velocity, float *bias, float *delta, int depth){
-    unsigned int i,j;
-    unsigned int DIM[2] = {net->topology[net->n_layers - depth], net->topology[net->n_layers - depth - 1]};
+//-----Profiling-----
+#ifdef ANN_PROFILE
+#if defined(__ARM_ARCH) && !defined(__linux__)
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
 
-    if(depth == 1){
-        for(i = 0; i < DIM[0]; i++){
-            net->output[i] = 0.0;
-            for(j = 0; j < DIM[1]; j++){
-                net->output[i] += weights[(DIM[1]*i)+j]*input[j];
+static inline uint32_t profile_ticks(void){
+    return DWT_CYCCNT;
+}
+#else
+#include <time.h>
+
+static inline uint32_t profile_ticks(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint32_t)(t.tv_sec*1000000000ull + t.tv_nsec);
+}
+#endif
+
+ANN_PROFILE_DATA ann_profile;
+
+//Clears the counters; on Cortex-M also starts the DWT cycle counter
+void ann_profile_reset(void){
+    memset(&ann_profile, 0, sizeof(ann_profile));
+#if defined(__ARM_ARCH) && !defined(__linux__)
+    DEMCR |= (1u << 24);    //TRCENA
+    DWT_CTRL |= 1u;         //CYCCNTENA
+#endif
+}
+
+static inline void profile_add(ANN_LAYER_PROFILE *p, uint32_t start, uint32_t macs, uint32_t bytes){
+    p->ticks += (uint32_t)(profile_ticks() - start);
+    p->macs += macs;
+    p->bytes += bytes;
+}
+
+//Bytes read and written per updated parameter: the value, its gradient source and the optimizer state
+static inline uint32_t profile_update_bytes(uint8_t mode){
+    switch(mode){
+        case OPT_ACCUMULATE: return 3*sizeof(float);
+        case OPT_ADAM:       return 6*sizeof(float);
+        default:             return 4*sizeof(float);
+    }
+}
+
+#define PROFILE_START(t) uint32_t t = profile_ticks()
+#define PROFILE_LAYER(dir, l, t, macs, bytes) profile_add(&ann_profile.dir[(l)-1], t, macs, bytes)
+#define PROFILE_CALL(counter) ann_profile.counter++
+#else
+#define PROFILE_START(t)
+#define PROFILE_LAYER(dir, l, t, macs, bytes)
+#define PROFILE_CALL(counter)
+#endif
+
+//-----Lookup Tables-----
+//tanh(i/TANH_LUT_SCALE) for i in [0, TANH_LUT_SIZE), kept in flash; sigmoid reuses it via 0.5+0.5*tanh(x/2)
+#define TANH_LUT_SIZE 257
+#define TANH_LUT_SCALE 32.0f
+
+static const float tanh_lut[TANH_LUT_SIZE] = {
+    0.0, 0.031239832, 0.062418748, 0.0934763, 0.124353, 0.15499073, 0.1853332, 0.21532634,
+    0.24491866, 0.2740616, 0.30270973, 0.33082113, 0.3583574, 0.38528398, 0.41157004, 0.43718877,
+    0.46211717, 0.48633602, 0.50983, 0.5325873, 0.5545997, 0.5758624, 0.59637356, 0.6161344,
+    0.63514894, 0.6534236, 0.6709671, 0.6877902, 0.7039056, 0.7193275, 0.7340715, 0.74815446,
+    0.7615942, 0.7744092, 0.7866188, 0.79824275, 0.8093011, 0.819814, 0.8298019, 0.8392851,
+    0.84828365, 0.8568176, 0.8649066, 0.87257004, 0.8798267, 0.88669515, 0.89319336, 0.8993387,
+    0.90514827, 0.9106383, 0.91582453, 0.9207223, 0.9253462, 0.9297103, 0.93382806, 0.9377123,
+    0.94137555, 0.94482946, 0.9480853, 0.9511538, 0.95404524, 0.95676935, 0.95933527, 0.96175194,
+    0.9640276, 0.9661702, 0.9681872, 0.9700858, 0.97187275, 0.9735544, 0.9751367, 0.9766255,
+    0.9780261, 0.9793437, 0.9805831, 0.9817487, 0.982845, 0.983876, 0.9848455, 0.9857572,
+    0.9866143, 0.9874202, 0.98817784, 0.9888902, 0.98955977, 0.9901892, 0.99078083, 0.991337,
+    0.99185973, 0.99235106, 0.9928128, 0.9932468, 0.9936546, 0.9940379, 0.9943981, 0.9947367,
+    0.9950548, 0.9953537, 0.99563456, 0.9958985, 0.99614656, 0.99637955, 0.99659854, 0.9968043,
+    0.99699765, 0.99717927, 0.99735, 0.9975103, 0.997661, 0.99780256, 0.99793553, 0.9980605,
+    0.9981779, 0.9982882, 0.9983918, 0.9984892, 0.99858063, 0.9986666, 0.99874735, 0.99882317,
+    0.99889445, 0.9989614, 0.9990243, 0.9990834, 0.9991389, 0.99919105, 0.99924004, 0.99928606,
+    0.9993293, 0.9993699, 0.99940807, 0.99944395, 0.9994776, 0.9995093, 0.99953896, 0.9995669,
+    0.99959314, 0.9996178, 0.99964094, 0.9996627, 0.99968314, 0.99970233, 0.99972034, 0.9997373,
+    0.99975324, 0.99976814, 0.9997822, 0.9997954, 0.9998078, 0.99981946, 0.99983037, 0.9998407,
+    0.99985033, 0.9998594, 0.9998679, 0.9998759, 0.9998834, 0.9998905, 0.9998971, 0.9999033,
+    0.9999092, 0.9999147, 0.9999199, 0.9999247, 0.9999293, 0.9999336, 0.9999376, 0.99994135,
+    0.9999449, 0.99994826, 0.9999514, 0.99995434, 0.9999571, 0.9999597, 0.99996215, 0.9999644,
+    0.9999666, 0.99996865, 0.9999705, 0.9999723, 0.999974, 0.99997556, 0.99997705, 0.9999784,
+    0.99997973, 0.999981, 0.9999821, 0.9999832, 0.9999842, 0.99998516, 0.99998605, 0.99998695,
+    0.9999877, 0.99998844, 0.99998915, 0.9999898, 0.9999904, 0.999991, 0.99999154, 0.9999921,
+    0.99999255, 0.999993, 0.99999344, 0.9999938, 0.9999942, 0.9999946, 0.9999949, 0.9999952,
+    0.99999547, 0.99999577, 0.999996, 0.99999624, 0.9999965, 0.9999967, 0.9999969, 0.9999971,
+    0.99999726, 0.99999744, 0.99999756, 0.99999774, 0.99999785, 0.999998, 0.9999981, 0.9999982,
+    0.99999833, 0.99999845, 0.9999985, 0.9999986, 0.9999987, 0.9999988, 0.99999887, 0.9999989,
+    0.999999, 0.99999905, 0.9999991, 0.99999917, 0.9999992, 0.9999993, 0.9999993, 0.99999934,
+    0.9999994, 0.9999994, 0.99999946, 0.99999946, 0.9999995, 0.9999995, 0.9999996, 0.9999996,
+    0.99999964, 0.99999964, 0.9999997, 0.9999997, 0.9999997, 0.9999997, 0.99999976, 0.99999976,
+    0.99999976
+};
+
+static inline float tanh_lut_eval(float x){
+    float ax = (x < 0.0f) ? -x : x;
+    float pos = ax*TANH_LUT_SCALE;
+    unsigned int idx;
+    float y;
+
+    if(pos >= (float)(TANH_LUT_SIZE - 1)) y = tanh_lut[TANH_LUT_SIZE - 1];
+    else{
+        idx = (unsigned int)pos;
+        y = tanh_lut[idx] + (pos - (float)idx)*(tanh_lut[idx+1] - tanh_lut[idx]);
+    }
+    return (x < 0.0f) ? -y : y;
+}
+
+//-----Optimizers-----
+//Updates n parameters p[k] whose ascent gradient is g*x[k]. idx is the position of p[0] in the
+//weights-then-biases parameter space shared by net->grad and net->opt_state. Momentum applies to
+//weights only (velocity lives in net->dedw); biases take a plain step as before.
+static void optimize(ANN *net, unsigned int mode, float *p, unsigned int idx, float g, float *x, unsigned int n, float lr){
+    unsigned int k;
+    unsigned int n_params = net->n_weights + net->n_bias;
+    float *m, *s;
+    float grad, v, c1, c2;
+
+    switch(mode){
+        case OPT_ACCUMULATE:
+            for(k = 0; k < n; k++){
+                net->grad[idx+k] += g*x[k];
+            }
+            break;
+        case OPT_RMSPROP:
+            s = &net->opt_state[idx];
+            for(k = 0; k < n; k++){
+                grad = g*x[k];
+                s[k] = net->decay1*s[k] + (1.0f - net->decay1)*grad*grad;
+                p[k] = p[k] + lr*grad/(sqrtf(s[k]) + net->epsilon);
+            }
+            break;
+        case OPT_ADAM:
+            m = &net->opt_state[idx];
+            s = &net->opt_state[n_params + idx];
+            c1 = net->corr1;
+            c2 = net->corr2;
+            for(k = 0; k < n; k++){
+                grad = g*x[k];
+                m[k] = net->decay1*m[k] + (1.0f - net->decay1)*grad;
+                s[k] = net->decay2*s[k] + (1.0f - net->decay2)*grad*grad;
+                p[k] = p[k] + lr*(m[k]*c1)/(sqrtf(s[k]*c2) + net->epsilon);
+            }
+            break;
+        case OPT_MOMENTUM:
+        default:
+            if(idx >= net->n_weights){
+                for(k = 0; k < n; k++){
+                    p[k] = p[k] + (g*x[k])*lr;
+                }
+                break;
             }
-            net->output[i] = net->output[i] + bias[i];
-            delta[i] = (output[i]-net->output_activation_function(net->output[i])) * net->output_activation_derivative(net->output[i]);
-            net->output[i] = net->output_activation_function(net->output[i]);
-            bias[i] = bias[i] + delta[i]*net->beta;
+            for(k = 0; k < n; k++){
+                v = (g*x[k])*lr - net->dedw[idx+k]*net->alpha;
+                net->dedw[idx+k] = v;
+                p[k] = p[k] + v;
+            }
+            break;
+    }
+}
+
+//Advances the step counter and refreshes Adam's bias corrections once per step
+static void begin_step(ANN *net){
+    net->step++;
+    if(net->optimizer == OPT_ADAM){
+        net->corr1 = 1.0f/(1.0f - powf(net->decay1, (float)net->step));
+        net->corr2 = 1.0f/(1.0f - powf(net->decay2, (float)net->step));
+    }
+}
+
+static unsigned int opt_state_size(ANN *net){
+    switch(net->optimizer){
+        case OPT_RMSPROP: return net->n_weights + net->n_bias;
+        case OPT_ADAM:    return 2*(net->n_weights + net->n_bias);
+        default:          return 0;
+    }
+}
+
+//-----Kernels-----
+//Dense layer kernels shared by the forward and backward passes. The default path works on blocks of
+//ANN_BLOCK_ROWS weight rows with ANN_LANES independent accumulators per row, so every input load is
+//reused across the block and the lane loops vectorize without reassociation. Building with
+//ANN_SCALAR_KERNELS selects the plain row-by-row reference loops instead.
+#define ANN_BLOCK_ROWS 4    //Unrolled in dot_block and matvec_t
+#define ANN_LANES 4         //Unrolled in the lane reductions
+
+//Lane-split dot product of a length n row with x
+static inline float dot_lanes(const float *w, const float *x, unsigned int n){
+    float acc[ANN_LANES] = {0.0f};
+    unsigned int j,k;
+    float sum;
+
+    for(k = 0; k + ANN_LANES <= n; k += ANN_LANES){
+        for(j = 0; j < ANN_LANES; j++) acc[j] += w[k+j]*x[k+j];
+    }
+    sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for(; k < n; k++) sum += w[k]*x[k];
+    return sum;
+}
+
+//Four rows at once, every x load feeds four rows of ANN_LANES accumulators
+static inline void dot_block(const float *W, const float *x, float *y, unsigned int n){
+    float a0[ANN_LANES] = {0.0f}, a1[ANN_LANES] = {0.0f}, a2[ANN_LANES] = {0.0f}, a3[ANN_LANES] = {0.0f};
+    const float *w0 = W, *w1 = &W[n], *w2 = &W[2*n], *w3 = &W[3*n];
+    unsigned int j,k;
+
+    for(k = 0; k + ANN_LANES <= n; k += ANN_LANES){
+        for(j = 0; j < ANN_LANES; j++){
+            a0[j] += w0[k+j]*x[k+j];
+            a1[j] += w1[k+j]*x[k+j];
+            a2[j] += w2[k+j]*x[k+j];
+            a3[j] += w3[k+j]*x[k+j];
         }
+    }
+    y[0] = (a0[0] + a0[1]) + (a0[2] + a0[3]);
+    y[1] = (a1[0] + a1[1]) + (a1[2] + a1[3]);
+    y[2] = (a2[0] + a2[1]) + (a2[2] + a2[3]);
+    y[3] = (a3[0] + a3[1]) + (a3[2] + a3[3]);
+    for(; k < n; k++){
+        y[0] += w0[k]*x[k];
+        y[1] += w1[k]*x[k];
+        y[2] += w2[k]*x[k];
+        y[3] += w3[k]*x[k];
+    }
+}
 
-        float dEdW[DIM[0]*DIM[1]];
-        for(i = 0; i < DIM[0]; i++){
-            for(j = 0; j < DIM[1]; j++){
-                dEdW[(DIM[1]*i)+j] = delta[i]*input[j];
+//dot_block for two inputs at once, every weight load feeds both. Each row and input keeps the
+//accumulators and reduction order of dot_block, so the sums are the same bit for bit.
+static inline void dot_block2(const float *W, const float *x, const float *z, float *y, float *u, unsigned int n){
+    float a0[ANN_LANES] = {0.0f}, a1[ANN_LANES] = {0.0f}, a2[ANN_LANES] = {0.0f}, a3[ANN_LANES] = {0.0f};
+    float c0[ANN_LANES] = {0.0f}, c1[ANN_LANES] = {0.0f}, c2[ANN_LANES] = {0.0f}, c3[ANN_LANES] = {0.0f};
+    const float *w0 = W, *w1 = &W[n], *w2 = &W[2*n], *w3 = &W[3*n];
+    unsigned int j,k;
+
+    for(k = 0; k + ANN_LANES <= n; k += ANN_LANES){
+        for(j = 0; j < ANN_LANES; j++){
+            a0[j] += w0[k+j]*x[k+j];
+            a1[j] += w1[k+j]*x[k+j];
+            a2[j] += w2[k+j]*x[k+j];
+            a3[j] += w3[k+j]*x[k+j];
+            c0[j] += w0[k+j]*z[k+j];
+            c1[j] += w1[k+j]*z[k+j];
+            c2[j] += w2[k+j]*z[k+j];
+            c3[j] += w3[k+j]*z[k+j];
+        }
+    }
+    y[0] = (a0[0] + a0[1]) + (a0[2] + a0[3]);
+    y[1] = (a1[0] + a1[1]) + (a1[2] + a1[3]);
+    y[2] = (a2[0] + a2[1]) + (a2[2] + a2[3]);
+    y[3] = (a3[0] + a3[1]) + (a3[2] + a3[3]);
+    u[0] = (c0[0] + c0[1]) + (c0[2] + c0[3]);
+    u[1] = (c1[0] + c1[1]) + (c1[2] + c1[3]);
+    u[2] = (c2[0] + c2[1]) + (c2[2] + c2[3]);
+    u[3] = (c3[0] + c3[1]) + (c3[2] + c3[3]);
+    for(; k < n; k++){
+        y[0] += w0[k]*x[k];
+        y[1] += w1[k]*x[k];
+        y[2] += w2[k]*x[k];
+        y[3] += w3[k]*x[k];
+        u[0] += w0[k]*z[k];
+        u[1] += w1[k]*z[k];
+        u[2] += w2[k]*z[k];
+        u[3] += w3[k]*z[k];
+    }
+}
+
+//y = W·x + b for an m x n row-major W
+static void matvec(const float *W, const float *x, const float *b, float *y, unsigned int m, unsigned int n){
+    unsigned int i;
+#ifdef ANN_SCALAR_KERNELS
+    unsigned int k;
+    float sum;
+    for(i = 0; i < m; i++){
+        sum = 0.0;
+        for(k = 0; k < n; k++){
+            sum += W[(n*i)+k]*x[k];
+        }
+        y[i] = sum + b[i];
+    }
+#else
+    for(i = 0; i + ANN_BLOCK_ROWS <= m; i += ANN_BLOCK_ROWS){
+        dot_block(&W[n*i], x, &y[i], n);
+        y[i] += b[i];
+        y[i+1] += b[i+1];
+        y[i+2] += b[i+2];
+        y[i+3] += b[i+3];
+    }
+    for(; i < m; i++){
+        y[i] = dot_lanes(&W[n*i], x, n) + b[i];
+    }
+#endif
+}
+
+//matvec over samples inputs of n floats, one output row of m floats each. Every block of rows is
+//applied to all of them while it sits in cache, two inputs per pass, and every output is summed
+//in matvec's order so a sample gets the same result in a batch as on its own.
+static void matvec_batch(const float *W, const float *X, const float *b, float *Y, unsigned int m, unsigned int n,
+                         unsigned int samples){
+    unsigned int s;
+#ifdef ANN_SCALAR_KERNELS
+    for(s = 0; s < samples; s++){
+        matvec(W, &X[n*s], b, &Y[m*s], m, n);
+    }
+#else
+    unsigned int i,j;
+    float *y, *u;
+    for(i = 0; i + ANN_BLOCK_ROWS <= m; i += ANN_BLOCK_ROWS){
+        for(s = 0; s + 2 <= samples; s += 2){
+            y = &Y[(m*s)+i];
+            u = &Y[(m*(s+1))+i];
+            dot_block2(&W[n*i], &X[n*s], &X[n*(s+1)], y, u, n);
+            for(j = 0; j < ANN_BLOCK_ROWS; j++){
+                y[j] += b[i+j];
+                u[j] += b[i+j];
             }
         }
-        for(i = 0; i < DIM[0]*DIM[1]; i++){
-            velocity[i] = dEdW[i]*net->eta - velocity[i]*net->alpha;
-            weights[i] = weights[i] + velocity[i];
+        if(s < samples){
+            y = &Y[(m*s)+i];
+            dot_block(&W[n*i], &X[n*s], y, n);
+            for(j = 0; j < ANN_BLOCK_ROWS; j++) y[j] += b[i+j];
+        }
+    }
+    for(; i < m; i++){
+        for(s = 0; s < samples; s++){
+            Y[(m*s)+i] = dot_lanes(&W[n*i], &X[n*s], n) + b[i];
+        }
+    }
+#endif
+}
+
+//y += W^T·d for the m rows of W (m <= ANN_BLOCK_ROWS in the blocked path). Rows are added in order,
+//so the result matches the reference loop exactly while y is loaded and stored once per block.
+static void matvec_t(const float *W, const float *d, float *y, unsigned int m, unsigned int n){
+    unsigned int i,k;
+#ifdef ANN_SCALAR_KERNELS
+    for(i = 0; i < m; i++){
+        for(k = 0; k < n; k++){
+            y[k] += W[(n*i)+k]*d[i];
+        }
+    }
+#else
+    if(m == ANN_BLOCK_ROWS){
+        for(k = 0; k < n; k++){
+            y[k] = (((y[k] + W[k]*d[0]) + W[n+k]*d[1]) + W[(2*n)+k]*d[2]) + W[(3*n)+k]*d[3];
         }
         return;
     }
-    else{
-        float a[DIM[0]];
-        float d[DIM[0]];
+    for(i = 0; i < m; i++){
+        for(k = 0; k < n; k++){
+            y[k] += W[(n*i)+k]*d[i];
+        }
+    }
+#endif
+}
 
-        for(i = 0; i < DIM[0]; i++){
-            a[i] = 0.0;
-            for(j = 0; j < DIM[1]; j++){
-                a[i] += weights[(DIM[1]*i)+j]*input[j];
+//-----ANN-----
+//Applies the layer activation to x in place and writes its derivative to d (d may be NULL).
+//Dispatched once per layer; every case is a straight select with no calls in the loop.
+void activate_layer(uint8_t activation, float *x, float *d, unsigned int n){
+    unsigned int i;
+    unsigned int ds = d ? 1 : 0;
+    float sink;
+    float v, a, g;
+
+    if(!d) d = &sink;
+
+    switch(activation){
+        case ACT_RELU2:
+            for(i = 0; i < n; i++){
+                v = x[i];
+                a = (v < -1.0) ? 0.1*v-0.93 : v;
+                a = (v > 1.0) ? 0.1*v+0.93 : a;
+                g = (v < -1.0 || v > 1.0) ? 0.1 : 1.0;
+                x[i] = a;
+                d[ds*i] = g;
             }
-            a[i] += bias[i];
-            d[i] = net->hidden_activation_derivative(a[i]);
-            a[i] = net->hidden_activation_function(a[i]);
-        }
+            break;
+        case ACT_SIGMOID:
+            for(i = 0; i < n; i++){
+                a = 1.0f/(1.0f + expf(-x[i]));
+                x[i] = a;
+                d[ds*i] = a*(1.0f - a);
+            }
+            break;
+        case ACT_TANH:
+            for(i = 0; i < n; i++){
+                a = tanhf(x[i]);
+                x[i] = a;
+                d[ds*i] = 1.0f - a*a;
+            }
+            break;
+        case ACT_SIGMOID_LUT:
+            for(i = 0; i < n; i++){
+                a = 0.5f + 0.5f*tanh_lut_eval(0.5f*x[i]);
+                x[i] = a;
+                d[ds*i] = a*(1.0f - a);
+            }
+            break;
+        case ACT_TANH_LUT:
+            for(i = 0; i < n; i++){
+                a = tanh_lut_eval(x[i]);
+                x[i] = a;
+                d[ds*i] = 1.0f - a*a;
+            }
+            break;
+        case ACT_SOFTMAX:
+            //Output layer only. d is set to 1 so BP_ANN's (target - output)*d is the
+            //combined softmax + cross-entropy gradient
+            a = x[0];
+            for(i = 1; i < n; i++) a = (x[i] > a) ? x[i] : a;
+            g = 0.0f;
+            for(i = 0; i < n; i++){
+                x[i] = expf(x[i] - a);
+                g += x[i];
+            }
+            g = 1.0f/g;
+            for(i = 0; i < n; i++){
+                x[i] = x[i]*g;
+                d[ds*i] = 1.0;
+            }
+            break;
+        case ACT_LINEAR:
+            for(i = 0; i < n; i++){
+                d[ds*i] = 1.0;
+            }
+            break;
+        case ACT_LEAKY_RELU:
+            for(i = 0; i < n; i++){
+                v = x[i];
+                x[i] = (v < 0.0) ? 0.01*v : v;
+                d[ds*i] = (v < 0.0) ? 0.01 : 1.0;
+            }
+            break;
+        case ACT_RELU:
+        default:
+            for(i = 0; i < n; i++){
+                v = x[i];
+                a = (v < 0.0) ? 0.0 : v;
+                a = (v > 1.0) ? 0.1*v+0.93 : a;
+                g = (v < 0.0) ? 0.0 : 1.0;
+                g = (v > 1.0) ? 0.1 : g;
+                x[i] = a;
+                d[ds*i] = g;
+            }
+            break;
+    }
+}
 
-        unsigned int DIM1 = net->topology[net->n_layers - depth + 1];
+//Iterative backprop over net->bp_scratch (ann_bp_scratch_size() floats). The forward sweep keeps every
+//hidden activation and derivative; the backward sweep then makes one fused pass per weight matrix that
+//propagates delta through the old weights in place and applies the momentum update (or sums into net->grad)
+void BP_ANN(ANN *net, float *input, float *output, unsigned int accumulate){
+    unsigned int DIM[2];
+    unsigned int i,j,l;
+    unsigned int L = net->n_layers - 1;
+    unsigned int hidden = 0, width = 0;
+    unsigned int w_off = 0, b_off = 0;
+    unsigned int mode = accumulate ? OPT_ACCUMULATE : net->optimizer;
+    unsigned int rows;
+    float *weights, *bias;
+    float *act = net->bp_scratch;
+    float *der, *delta, *prev_delta, *tmp;
+    float *src = input;
 
-        float prev_delta[DIM1];
-        unsigned int weight_iter = DIM[0] * DIM[1];
+    if(!accumulate) begin_step(net);
+    PROFILE_CALL(backward_calls);
 
-        float next_weights_T[DIM[0]*DIM1];
-        unsigned int iter = 0;
-        for(i = 0; i < DIM[0]; i++){
-            for(j = 0; j < DIM1; j++){
-                next_weights_T[iter] = weights[(DIM[0]*j)+i+weight_iter];
-                iter++;
+    for(l = 1; l <= L; l++){
+        if(l < L) hidden += net->topology[l];
+        if(net->topology[l] > width) width = net->topology[l];
+    }
+    der = &act[hidden];
+    delta = &act[2*hidden];
+    prev_delta = &delta[width];
+
+    //Forward
+    for(l = 1; l <= L; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        weights = &net->weights[w_off];
+        bias = &net->bias[b_off];
+        tmp = (l < L) ? act : net->output;
+
+        PROFILE_START(t0);
+        matvec(weights, src, bias, tmp, DIM[0], DIM[1]);
+
+        if(l < L){
+            activate_layer(net->activation[l-1], act, der, DIM[0]);
+            src = act;
+            act += DIM[0];
+            der += DIM[0];
+            w_off += DIM[0]*DIM[1];
+            b_off += DIM[0];
+        }
+        else{
+            activate_layer(net->activation[l-1], net->output, delta, DIM[0]);
+            for(i = 0; i < DIM[0]; i++){
+                delta[i] = (output[i]-net->output[i]) * delta[i];
             }
+            optimize(net, mode, bias, net->n_weights + b_off, 1.0, delta, DIM[0], net->beta);
         }
+        PROFILE_LAYER(forward, l, t0, DIM[0]*DIM[1], sizeof(float)*(DIM[0]*DIM[1] + DIM[1] + 3*DIM[0]));
+    }
 
-        BP_ANN(net, a, output, &weights[weight_iter], &velocity[weight_iter], &bias[DIM[0]], prev_delta, depth-1);
+    //Backward
+    for(l = L; l > 0; l--){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        weights = &net->weights[w_off];
 
-        for(i = 0; i < DIM[0]; i++){
-            delta[i] = 0;
-            for(j = 0; j < DIM1; j++){
-                delta[i] += next_weights_T[(DIM1*i)+j]*prev_delta[j];
+        if(l > 1){
+            act -= DIM[1];
+            der -= DIM[1];
+            src = act;
+            for(j = 0; j < DIM[1]; j++) prev_delta[j] = 0.0;
+        }
+        else src = input;
+
+        PROFILE_START(t1);
+        //Each block of rows propagates delta through its old weights and is then updated while still in cache
+        for(i = 0; i < DIM[0]; i += rows){
+            rows = (DIM[0] - i < ANN_BLOCK_ROWS) ? DIM[0] - i : ANN_BLOCK_ROWS;
+            if(l > 1) matvec_t(&weights[DIM[1]*i], &delta[i], prev_delta, rows, DIM[1]);
+            for(j = i; j < i + rows; j++){
+                optimize(net, mode, &weights[DIM[1]*j], w_off + (DIM[1]*j), delta[j], src, DIM[1], net->eta);
             }
-            delta[i] = delta[i]*d[i];
-            bias[i] = bias[i] + delta[i]*net->beta;
         }
-        float dEdW[DIM[0]*DIM[1]];
-        for(i = 0; i < DIM[0]; i++){
+
+        if(l > 1){
+            w_off -= DIM[1]*net->topology[l-2];
+            b_off -= DIM[1];
+            bias = &net->bias[b_off];
             for(j = 0; j < DIM[1]; j++){
-                dEdW[(DIM[1]*i)+j] = delta[i]*input[j];
+                prev_delta[j] = prev_delta[j]*der[j];
             }
+            optimize(net, mode, bias, net->n_weights + b_off, 1.0, prev_delta, DIM[1], net->beta);
+            tmp = delta;
+            delta = prev_delta;
+            prev_delta = tmp;
         }
-        for(i = 0; i < DIM[0]*DIM[1]; i++){
-            velocity[i] = dEdW[i]*net->eta - velocity[i]*net->alpha;
-            weights[i] = weights[i] + velocity[i];
+        //Propagation reads each weight once more; the update traffic depends on the optimizer state
+        PROFILE_LAYER(backward, l, t1, DIM[0]*DIM[1]*((l > 1) ? 2 : 1),
+                      profile_update_bytes(mode)*(DIM[0]*DIM[1] + DIM[1]) + sizeof(float)*(DIM[0] + 2*DIM[1]));
+    }
+}
+
+void train_ann(ANN *net, float *input, float *output){
+    BP_ANN(net, input, output, 0);
+}
+
+void accumulate_ann(ANN *net, float *input, float *output){
+    BP_ANN(net, input, output, 1);
+}
+
+//One optimizer step from the summed mini-batch gradient, then clears the accumulator
+void update_ann(ANN *net){
+    begin_step(net);
+    optimize(net, net->optimizer, net->weights, 0, 1.0, net->grad, net->n_weights, net->eta);
+    optimize(net, net->optimizer, net->bias, net->n_weights, 1.0, &net->grad[net->n_weights], net->n_bias, net->beta);
+    fill_zeros(net->grad, net->n_weights + net->n_bias);
+}
+
+void train_ann_batch(ANN *net, float *inputs, float *outputs, int n){
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    int s;
+
+    for(s = 0; s < n; s++){
+        accumulate_ann(net, &inputs[n_in*s], &outputs[n_out*s]);
+    }
+    update_ann(net);
+}
+
+//Iterative forward pass, activations ping-pong between a and b (each sized to the widest hidden layer)
+void FP_ANN(ANN *net, float *input, float *a, float *b){
+    unsigned int DIM[2];
+    unsigned int l;
+    float *weights = net->weights;
+    float *bias = net->bias;
+    float *src = input;
+    float *dst = a;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        if(l == net->n_layers - 1) dst = net->output;
+
+        PROFILE_START(t0);
+        matvec(weights, src, bias, dst, DIM[0], DIM[1]);
+        activate_layer(net->activation[l-1], dst, 0, DIM[0]);
+        PROFILE_LAYER(forward, l, t0, DIM[0]*DIM[1], sizeof(float)*(DIM[0]*DIM[1] + DIM[1] + 2*DIM[0]));
+
+        weights += DIM[0]*DIM[1];
+        bias += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
+}
+
+void run_ann(ANN *net, float *input){
+    unsigned int width = ann_scratch_size(net)/2;
+    PROFILE_CALL(forward_calls);
+    FP_ANN(net, input, net->scratch, &net->scratch[width]);
+}
+
+//Batched forward pass over m samples, each block of weights is loaded once and applied to the whole
+//batch; the outputs match run_ann on every sample exactly
+void FP_ANN_batch(ANN *net, const float *input, unsigned int m, float *output, float *a, float *b){
+    unsigned int DIM[2];
+    unsigned int l,s;
+    float *weights = net->weights;
+    float *bias = net->bias;
+    const float *src = input;
+    float *dst = a;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        if(l == net->n_layers - 1) dst = output;
+
+        PROFILE_START(t0);
+        matvec_batch(weights, src, bias, dst, DIM[0], DIM[1], m);
+        if(net->activation[l-1] == ACT_SOFTMAX){
+            for(s = 0; s < m; s++) activate_layer(ACT_SOFTMAX, &dst[DIM[0]*s], 0, DIM[0]);
         }
+        else activate_layer(net->activation[l-1], dst, 0, DIM[0]*m);
+        PROFILE_LAYER(forward, l, t0, m*DIM[0]*DIM[1], sizeof(float)*(DIM[0]*DIM[1] + m*(DIM[1] + 2*DIM[0])));
+
+        weights += DIM[0]*DIM[1];
+        bias += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
+}
+
+//outputs receives n rows of topology[n_layers-1], scratch must hold batch_size*ann_scratch_size() floats
+void run_ann_batch(ANN *net, const float *inputs, int n, float *outputs){
+    unsigned int width = ann_scratch_size(net)/2;
+    unsigned int tile = (net->batch_size > 0) ? net->batch_size : 1;
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    unsigned int s, m;
+
+    for(s = 0; n > 0 && s < (unsigned int)n; s += m){
+        m = ((unsigned int)n - s < tile) ? (unsigned int)n - s : tile;
+        PROFILE_CALL(forward_calls);
+        FP_ANN_batch(net, &inputs[n_in*s], m, &outputs[n_out*s], net->scratch, &net->scratch[width*tile]);
+    }
+}
+
+void init_ann(ANN *net){
+    fill_number(net->bias, net->n_bias, 0.1);
+    if(net->dedw) fill_zeros(net->dedw, net->n_weights);
+    if(net->grad) fill_zeros(net->grad, net->n_weights + net->n_bias);
+    if(net->opt_state) fill_zeros(net->opt_state, opt_state_size(net));
+    net->step = 0;
+}
+
+void init_pretrained_ann(ANN *net){
+    if(net->dedw) fill_zeros(net->dedw, net->n_weights);
+    if(net->grad) fill_zeros(net->grad, net->n_weights + net->n_bias);
+    if(net->opt_state) fill_zeros(net->opt_state, opt_state_size(net));
+    net->step = 0;
+}
+
+//-----Input Normalization-----
+//Scales every group of net->input_group inputs to unit L2 norm, one pass to sum the squares and
+//one to scale, with no branches inside the group; an all-zero group stays zero. input may equal
+//normalized. Without groups the inputs are copied unchanged.
+void ann_normalize_input(ANN *net, const float *input, float *normalized){
+    unsigned int n = net->topology[0], group = net->input_group;
+    unsigned int g, j;
+    float sum, scale;
+
+    if(group == 0){
+        memmove(normalized, input, n*sizeof(float));
         return;
     }
+    for(g = 0; g < n; g += group){
+        sum = 0.0f;
+        for(j = 0; j < group; j++) sum += input[g+j]*input[g+j];
+        scale = (sum > 0.0f) ? 1.0f/sqrtf(sum) : 0.0f;
+        for(j = 0; j < group; j++) normalized[g+j] = input[g+j]*scale;
+    }
 }
 
-void train_ann(ANN *net, float *input, float *output){
-    float delta[net->topology[1]];
-    BP_ANN(net, input, output, net->weights, net->dedw, net->bias, delta, net->n_layers-1);
+//Rewrites the first layer so it gives on x what it gave on (x - mean)/std, per input feature.
+//Momentum in dedw is rescaled with the weights, and gradients, whose input is now std times
+//larger, with their moments, so training can carry on from the folded model.
+void ann_fold_standardization(ANN *net, const float *mean, const float *std){
+    unsigned int i, k, idx, n_in = net->topology[0], n_out = net->topology[1];
+    unsigned int n_params = net->n_weights + net->n_bias;
+    float *w;
+
+    for(i = 0; i < n_out; i++){
+        w = &net->weights[n_in*i];
+        for(k = 0; k < n_in; k++){
+            idx = n_in*i + k;
+            w[k] = w[k]/std[k];
+            net->bias[i] -= w[k]*mean[k];
+            if(net->dedw) net->dedw[idx] /= std[k];
+            if(net->grad) net->grad[idx] *= std[k];
+            if(net->opt_state && net->optimizer == OPT_RMSPROP) net->opt_state[idx] *= std[k]*std[k];
+            if(net->opt_state && net->optimizer == OPT_ADAM){
+                net->opt_state[idx] *= std[k];
+                net->opt_state[n_params + idx] *= std[k]*std[k];
+            }
+        }
+    }
 }
 
-void FP_ANN(ANN *net, float *input, unsigned int depth, float *weights){
-    unsigned int DIM[2] = {net->topology[net->n_layers - depth], net->topology[net->n_layers - depth - 1]};
-    unsigned int i,k;
+//-----Cascade-----
+//Largest output over the second largest, as printOutput_ANN's point/next_max. Meant for
+//non-negative outputs such as softmax: no positive output gives 1, a single one HUGE_VALF.
+float ann_top2_ratio(float *output, unsigned int n){
+    float first = 0.0, second = 0.0;
+    unsigned int i;
+
+    for(i = 0; i < n; i++){
+        if(output[i] > first){
+            second = first;
+            first = output[i];
+        }
+        else if(output[i] > second) second = output[i];
+    }
+    if(first <= 0.0) return 1.0;
+    if(second <= 0.0) return HUGE_VALF;
+    return first/second;
+}
+
+//Runs the stages in order until one is confident enough and returns its index;
+//cascade->output then points at that stage's outputs
+unsigned int run_ann_cascade(ANN_CASCADE *cascade, float *input){
+    unsigned int i, last = cascade->n_stages - 1;
+    ANN *net;
+
+    for(i = 0; i <= last; i++){
+        net = cascade->stage[i];
+        run_ann(net, input);
+        if(i == last || ann_top2_ratio(net->output, net->topology[net->n_layers - 1]) >= cascade->threshold[i]) break;
+    }
+    cascade->hits[i]++;
+    cascade->output = net->output;
+    return i;
+}
+
+//-----Incremental Trainer-----
+void ann_trainer_init(ANN_TRAINER *trainer, ANN *net, float *inputs, float *targets, unsigned int n_samples,
+                      unsigned int batch, unsigned int total, uint32_t (*clock_us)(void)){
+    trainer->net = net;
+    trainer->inputs = inputs;
+    trainer->targets = targets;
+    trainer->n_samples = n_samples;
+    trainer->batch = batch ? batch : 1;
+    trainer->total = total;
+    trainer->done = 0;
+    trainer->checkpoint = 0;
+    trainer->clock_us = clock_us;
+}
+
+//Trains until budget_us has elapsed, the next checkpoint or the end, at least one sample per call
+//while any remain, and returns trainer->done. A partial last mini-batch is applied at the end.
+unsigned int ann_trainer_step(ANN_TRAINER *trainer, uint32_t budget_us){
+    ANN *net = trainer->net;
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    uint32_t start = trainer->clock_us();
+    unsigned int s;
+
+    while(trainer->done < trainer->total){
+        s = trainer->done % trainer->n_samples;
+        if(trainer->batch == 1) train_ann(net, &trainer->inputs[n_in*s], &trainer->targets[n_out*s]);
+        else{
+            accumulate_ann(net, &trainer->inputs[n_in*s], &trainer->targets[n_out*s]);
+            if((trainer->done + 1) % trainer->batch == 0 || trainer->done + 1 == trainer->total) update_ann(net);
+        }
+        trainer->done++;
+
+        if(trainer->checkpoint && trainer->done % trainer->checkpoint == 0) break;
+        if((uint32_t)(trainer->clock_us() - start) >= budget_us) break;
+    }
+    return trainer->done;
+}
+
+//-----Double Buffered Model-----
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#define swap_load(x) atomic_load(&(x))
+#define swap_store(x, v) atomic_store(&(x), (v))
+#else
+#define swap_load(x) (x)
+#define swap_store(x, v) ((x) = (v))
+#endif
+
+//Copies the active slot into the shadow, keeping the shadow's own inference buffers
+static void swap_sync(ANN *shadow, ANN *live){
+    float *weights = shadow->weights, *bias = shadow->bias;
+    float *scratch = shadow->scratch, *output = shadow->output;
+
+    *shadow = *live;
+    shadow->weights = weights;
+    shadow->bias = bias;
+    shadow->scratch = scratch;
+    shadow->output = output;
+    memcpy(weights, live->weights, live->n_weights*sizeof(float));
+    memcpy(bias, live->bias, live->n_bias*sizeof(float));
+}
+
+//net becomes the active slot; the shadow gets its own weights, bias, scratch and output with
+//the sizes of net's (scratch holding net->batch_size*ann_scratch_size() floats)
+void ann_swap_init(ANN_SWAP *swap, ANN *net, float *weights, float *bias, float *scratch, float *output){
+    swap->slot[0] = *net;
+    swap->slot[1].weights = weights;
+    swap->slot[1].bias = bias;
+    swap->slot[1].scratch = scratch;
+    swap->slot[1].output = output;
+    swap_sync(&swap->slot[1], &swap->slot[0]);
+    swap_store(swap->active, 0);
+    swap_store(swap->reading, 0);
+    swap->stale = 0;
+}
+
+//Pins the active slot for inference until ann_swap_release
+ANN *ann_swap_acquire(ANN_SWAP *swap){
+    unsigned int i;
+
+    //Announce the slot, then make sure it was not replaced in between
+    do{
+        i = swap_load(swap->active);
+        swap_store(swap->reading, i + 1);
+    } while(swap_load(swap->active) != i);
+    return &swap->slot[i];
+}
+
+void ann_swap_release(ANN_SWAP *swap){
+    swap_store(swap->reading, 0);
+}
+
+//The slot the trainer may modify, or 0 while inference still holds it after a publish
+ANN *ann_swap_shadow(ANN_SWAP *swap){
+    unsigned int i = swap_load(swap->active);
+    ANN *shadow = &swap->slot[1 - i];
+
+    if(swap_load(swap->reading) == 2 - i) return 0;
+    if(swap->stale){
+        swap_sync(shadow, &swap->slot[i]);
+        swap->stale = 0;
+    }
+    return shadow;
+}
+
+//Makes the shadow the active slot; later inference sees its weights in full
+void ann_swap_publish(ANN_SWAP *swap){
+    swap_store(swap->active, 1 - swap_load(swap->active));
+    swap->stale = 1;
+}
+
+//-----Online Learning-----
+void ann_replay_init(ANN_REPLAY *replay, float *inputs, float *targets, unsigned int n_in, unsigned int n_out,
+                     unsigned int capacity){
+    replay->inputs = inputs;
+    replay->targets = targets;
+    replay->n_in = n_in;
+    replay->n_out = n_out;
+    replay->capacity = capacity;
+    replay->count = 0;
+    replay->next = 0;
+    replay->seed = 2463534242u;
+}
+
+//Stores a copy of the sample, overwriting the oldest once the buffer is full
+void ann_replay_add(ANN_REPLAY *replay, float *input, float *target){
+    memcpy(&replay->inputs[replay->n_in*replay->next], input, replay->n_in*sizeof(float));
+    memcpy(&replay->targets[replay->n_out*replay->next], target, replay->n_out*sizeof(float));
+    replay->next = (replay->next + 1) % replay->capacity;
+    if(replay->count < replay->capacity) replay->count++;
+}
+
+//Runs steps rounds of one train_ann on the new sample followed by n_replay on stored samples drawn
+//at random, then keeps the new sample for later replay
+void ann_learn_online(ANN *net, ANN_REPLAY *replay, float *input, float *target, unsigned int steps,
+                      unsigned int n_replay){
+    unsigned int i, j, r;
+
+    for(i = 0; i < steps; i++){
+        train_ann(net, input, target);
+        for(j = 0; j < n_replay && replay->count; j++){
+            //xorshift32
+            replay->seed ^= replay->seed << 13;
+            replay->seed ^= replay->seed >> 17;
+            replay->seed ^= replay->seed << 5;
+            r = replay->seed % replay->count;
+            train_ann(net, &replay->inputs[replay->n_in*r], &replay->targets[replay->n_out*r]);
+        }
+    }
+    ann_replay_add(replay, input, target);
+}
+
+//-----Quantized ANN-----
+static int32_t requantize(int32_t x, ANN_Q_SCALE scale){
+    int total = 31 + scale.shift;
+    int64_t p = (int64_t)x * scale.mult;
+    if(total <= 0) return (int32_t)(p << -total);
+    p += (int64_t)1 << (total - 1);
+    return (int32_t)(p >> total);
+}
+
+static int32_t round_to_int(float x){
+    return (int32_t)(x >= 0.0 ? x + 0.5 : x - 0.5);
+}
+
+static int8_t saturate_int8(int32_t x){
+    if(x < -128) return -128;
+    else if(x > 127) return 127;
+    return (int8_t)x;
+}
+
+//Q16 activation of a hidden layer, the integer counterpart of activate_layer's case
+static int32_t activate_q(uint8_t activation, int32_t x){
+    switch(activation){
+        case ACT_RELU2:      return relu2_q(x);
+        case ACT_LINEAR:     return x;
+        case ACT_LEAKY_RELU: return (x < 0) ? x/100 : x;
+        case ACT_RELU:
+        default:             return relu_q(x);
+    }
+}
+
+//Nonzero if every hidden layer of the table has an integer activation
+static unsigned int q_activations_ok(const uint8_t *activation, unsigned int n_layers){
+    unsigned int l;
+    for(l = 1; l < n_layers - 1; l++){
+        switch(activation[l-1]){
+            case ACT_RELU: case ACT_RELU2: case ACT_LINEAR: case ACT_LEAKY_RELU: break;
+            default: return 0;
+        }
+    }
+    return 1;
+}
+
+//Integer forward pass, int8 activations ping-pong between a and b
+void FP_ANN_Q(ANN_Q *net, int8_t *input, int8_t *a, int8_t *b){
+    unsigned int DIM[2];
+    unsigned int i,k,l;
+    unsigned int b_off = 0;
+    int8_t *weights = net->weights;
+    int8_t *src = input;
+    int8_t *dst = a;
+    int32_t acc, v;
+    ANN_Q_SCALE scale;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
 
-    if(depth == 1){
         for(i = 0; i < DIM[0]; i++){
-            net->output[i] = 0.0;
+            acc = net->bias[b_off + i];
             for(k = 0; k < DIM[1]; k++){
-                net->output[i] += weights[(DIM[1]*i)+k]*input[k];
+                acc += (int32_t)weights[(DIM[1]*i)+k]*src[k];
+            }
+            scale = net->per_channel ? net->acc_scale[b_off + i] : net->acc_scale[l-1];
+            v = requantize(acc, scale);
+
+            if(l == net->n_layers - 1){
+                net->output[i] = (float)v / ANN_Q_ONE;
+            }
+            else{
+                v = activate_q(net->activation[l-1], v);
+                dst[i] = saturate_int8(requantize(v, net->act_requant[l]) + net->act_zero_point[l]);
             }
-            net->output[i] = net->output_activation_function(net->output[i] + net->bias[i]);
         }
+        //The output activation runs on the dequantized layer, softmax included
+        if(l == net->n_layers - 1) activate_layer(net->activation[l-1], net->output, 0, DIM[0]);
+        weights += DIM[0]*DIM[1];
+        b_off += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
+}
+
+void run_ann_q(ANN_Q *net, float *input){
+    unsigned int i;
+    unsigned int width = ann_q_scratch_size(net)/3;
+    int8_t *x = &net->scratch[2*width];
+
+    for(i = 0; i < net->topology[0]; i++){
+        x[i] = saturate_int8(round_to_int(input[i] / net->act_scale[0]) + net->act_zero_point[0]);
+    }
+    FP_ANN_Q(net, x, net->scratch, &net->scratch[width]);
+}
+
+//Splits a positive real multiplier into a Q31 mantissa and a shift
+void quantize_multiplier(float real, ANN_Q_SCALE *scale){
+    int shift = 0;
+    int64_t mult;
+
+    if(real <= 0.0){
+        scale->mult = 0;
+        scale->shift = 0;
         return;
     }
+    while(real >= 1.0){ real *= 0.5; shift--; }
+    while(real < 0.5){ real *= 2.0; shift++; }
+
+    mult = (int64_t)(real * 2147483648.0 + 0.5);
+    if(mult == ((int64_t)1 << 31)){
+        mult /= 2;
+        shift--;
+    }
+    scale->mult = (int32_t)mult;
+    scale->shift = shift;
+}
+
+//Quantizes a trained ANN given the float range seen at the input (index 0) and at every hidden layer.
+//Weights are symmetric int8 with one scale per layer, or per output neuron when qnet->per_channel is set.
+//qnet takes net's activation table; returns ANN_Q_ERR_ACTIVATION, leaving qnet alone, if a hidden
+//layer's activation has no integer form.
+int quantize_ann(ANN *net, ANN_Q *qnet, float *act_min, float *act_max){
+    unsigned int DIM[2];
+    unsigned int i,k,l,c;
+    unsigned int w_off = 0, b_off = 0;
+    float lo, hi, w_max, w_scale;
+    float *weights;
+    int32_t w_sum;
+
+    if(!q_activations_ok(net->activation, net->n_layers)) return ANN_Q_ERR_ACTIVATION;
+    memcpy(qnet->activation, net->activation, sizeof(qnet->activation));
+
+    for(l = 0; l < net->n_layers - 1; l++){
+        lo = act_min[l] < 0.0 ? act_min[l] : 0.0;
+        hi = act_max[l] > 0.0 ? act_max[l] : 0.0;
+        qnet->act_scale[l] = (hi > lo) ? (hi - lo) / 255.0 : 1.0;
+        qnet->act_zero_point[l] = saturate_int8(round_to_int(-128.0 - lo / qnet->act_scale[l]));
+        quantize_multiplier(1.0 / (qnet->act_scale[l] * ANN_Q_ONE), &qnet->act_requant[l]);
+    }
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        weights = &net->weights[w_off];
+
+        w_scale = 1.0;
+        for(c = 0; c < (qnet->per_channel ? DIM[0] : 1); c++){
+            w_max = 0.0;
+            for(i = (qnet->per_channel ? c : 0); i < (qnet->per_channel ? c+1 : DIM[0]); i++){
+                for(k = 0; k < DIM[1]; k++){
+                    if(weights[(DIM[1]*i)+k] > w_max) w_max = weights[(DIM[1]*i)+k];
+                    else if(-weights[(DIM[1]*i)+k] > w_max) w_max = -weights[(DIM[1]*i)+k];
+                }
+            }
+            w_scale = (w_max > 0.0) ? w_max / 127.0 : 1.0;
+
+            for(i = (qnet->per_channel ? c : 0); i < (qnet->per_channel ? c+1 : DIM[0]); i++){
+                w_sum = 0;
+                for(k = 0; k < DIM[1]; k++){
+                    qnet->weights[w_off + (DIM[1]*i)+k] = saturate_int8(round_to_int(weights[(DIM[1]*i)+k] / w_scale));
+                    w_sum += qnet->weights[w_off + (DIM[1]*i)+k];
+                }
+                qnet->bias[b_off + i] = round_to_int(net->bias[b_off + i] / (qnet->act_scale[l-1] * w_scale)) - qnet->act_zero_point[l-1]*w_sum;
+            }
+            quantize_multiplier(qnet->act_scale[l-1] * w_scale * ANN_Q_ONE,
+                                qnet->per_channel ? &qnet->acc_scale[b_off + c] : &qnet->acc_scale[l-1]);
+        }
+        w_off += DIM[0]*DIM[1];
+        b_off += DIM[0];
+    }
+    return 0;
+}
+
+//-----Half Precision ANN-----
+typedef union {
+    uint32_t u;
+    float f;
+} FLOAT_BITS;
+
+//IEEE binary16 -> float, exact for every input including subnormals, Inf and NaN. Without hardware
+//conversion (-mfp16-format=ieee), rescaling the shifted bits by 2^112 rebiases normals and
+//subnormals alike and Inf/NaN take a select, so the inner loop stays branch free.
+static inline float half_bits_to_float(uint16_t h){
+#ifdef __ARM_FP16_FORMAT_IEEE
+    __fp16 v;
+    memcpy(&v, &h, sizeof(v));
+    return (float)v;    //Single VCVTB on the Cortex-M4F
+#else
+    const FLOAT_BITS magic = { (254u - 15u) << 23 };    //2^112
+    const FLOAT_BITS was_inf_nan = { (127u + 16u) << 23 };
+    FLOAT_BITS o;
+
+    o.u = (uint32_t)(h & 0x7FFF) << 13;
+    o.f *= magic.f;
+    if(o.f >= was_inf_nan.f) o.u |= 255u << 23;
+    o.u |= (uint32_t)(h & 0x8000) << 16;
+    return o.f;
+#endif
+}
+
+float half_to_float(uint16_t h){
+    return half_bits_to_float(h);
+}
+
+//float -> IEEE binary16, round to nearest even, overflow to Inf
+uint16_t float_to_half(float x){
+    const FLOAT_BITS f32_inf = { 255u << 23 };
+    const FLOAT_BITS f16_max = { (127u + 16u) << 23 };
+    const FLOAT_BITS denorm_magic = { ((127u - 15u) + (23u - 10u) + 1u) << 23 };
+    FLOAT_BITS f;
+    uint32_t sign, odd;
+    uint16_t o;
+
+    f.f = x;
+    sign = f.u & 0x80000000u;
+    f.u ^= sign;
+    if(f.u >= f16_max.u) o = (f.u > f32_inf.u) ? 0x7E00 : 0x7C00;
+    else if(f.u < (113u << 23)){
+        f.f += denorm_magic.f;
+        o = (uint16_t)(f.u - denorm_magic.u);
+    }
     else{
-        float a[DIM[0]];
+        odd = (f.u >> 13) & 1;
+        f.u += ((uint32_t)(15 - 127) << 23) + 0xFFF + odd;
+        o = (uint16_t)(f.u >> 13);
+    }
+    return o | (uint16_t)(sign >> 16);
+}
+
+//y = W·x + b with binary16 W and b widened in the inner loop, accumulated in float
+static void matvec_h(const uint16_t *W, const float *x, const uint16_t *b, float *y, unsigned int m, unsigned int n){
+    unsigned int i,k;
+#ifdef ANN_SCALAR_KERNELS
+    float sum;
+    for(i = 0; i < m; i++){
+        sum = 0.0;
+        for(k = 0; k < n; k++){
+            sum += half_bits_to_float(W[(n*i)+k])*x[k];
+        }
+        y[i] = sum + half_bits_to_float(b[i]);
+    }
+#else
+    float acc[ANN_LANES];
+    unsigned int j;
+    const uint16_t *w;
+    for(i = 0; i < m; i++){
+        w = &W[n*i];
+        for(j = 0; j < ANN_LANES; j++) acc[j] = 0.0f;
+        for(k = 0; k + ANN_LANES <= n; k += ANN_LANES){
+            for(j = 0; j < ANN_LANES; j++) acc[j] += half_bits_to_float(w[k+j])*x[k+j];
+        }
+        y[i] = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+        for(; k < n; k++) y[i] += half_bits_to_float(w[k])*x[k];
+        y[i] += half_bits_to_float(b[i]);
+    }
+#endif
+}
+
+void FP_ANN_H(ANN_H *net, float *input, float *a, float *b){
+    unsigned int DIM[2];
+    unsigned int l;
+    uint16_t *weights = net->weights;
+    uint16_t *bias = net->bias;
+    float *src = input;
+    float *dst = a;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        if(l == net->n_layers - 1) dst = net->output;
+
+        matvec_h(weights, src, bias, dst, DIM[0], DIM[1]);
+        activate_layer(net->activation[l-1], dst, 0, DIM[0]);
+
+        weights += DIM[0]*DIM[1];
+        bias += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
+}
+
+void run_ann_h(ANN_H *net, float *input){
+    unsigned int width = ann_h_scratch_size(net)/2;
+    FP_ANN_H(net, input, net->scratch, &net->scratch[width]);
+}
+
+//Refreshes the binary16 copy from the float master weights, e.g. after training.
+//hnet->weights and hnet->bias must hold n_weights and n_bias values.
+void convert_ann_h(ANN *net, ANN_H *hnet){
+    unsigned int i;
+
+    hnet->topology = net->topology;
+    hnet->n_layers = net->n_layers;
+    hnet->n_weights = net->n_weights;
+    hnet->n_bias = net->n_bias;
+    memcpy(hnet->activation, net->activation, sizeof(hnet->activation));
+
+    for(i = 0; i < net->n_weights; i++){
+        hnet->weights[i] = float_to_half(net->weights[i]);
+    }
+    for(i = 0; i < net->n_bias; i++){
+        hnet->bias[i] = float_to_half(net->bias[i]);
+    }
+}
+
+//-----Sparse ANN-----
+//Zeroes the smallest-magnitude fraction of every layer's weights in place and returns how many
+//weights are zero afterwards. The per layer threshold is found by bisection, so no extra memory.
+unsigned int prune_ann(ANN *net, float sparsity){
+    unsigned int DIM[2];
+    unsigned int i,l,it,count,target;
+    unsigned int zeros = 0;
+    float *weights = net->weights;
+    float lo, hi, mid, w_max;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        target = (unsigned int)(sparsity*(DIM[0]*DIM[1]) + 0.5f);
+
+        w_max = 0.0;
+        for(i = 0; i < DIM[0]*DIM[1]; i++){
+            if(fabsf(weights[i]) > w_max) w_max = fabsf(weights[i]);
+        }
+        //Smallest threshold t with at least target weights |w| <= t
+        lo = 0.0;
+        hi = w_max;
+        for(it = 0; it < 32 && target > 0; it++){
+            mid = 0.5f*(lo + hi);
+            count = 0;
+            for(i = 0; i < DIM[0]*DIM[1]; i++){
+                if(fabsf(weights[i]) <= mid) count++;
+            }
+            if(count >= target) hi = mid;
+            else lo = mid;
+        }
+        for(i = 0; i < DIM[0]*DIM[1] && target > 0; i++){
+            if(fabsf(weights[i]) <= hi) weights[i] = 0.0;
+        }
+        for(i = 0; i < DIM[0]*DIM[1]; i++){
+            if(weights[i] == 0.0) zeros++;
+        }
+        weights += DIM[0]*DIM[1];
+    }
+    return zeros;
+}
+
+//Nonzero weights, the number of values sparsify_ann stores
+unsigned int ann_nnz(ANN *net){
+    unsigned int i, nnz = 0;
+    for(i = 0; i < net->n_weights; i++){
+        if(net->weights[i] != 0.0) nnz++;
+    }
+    return nnz;
+}
+
+//Builds the CSR copy of a (pruned) net. snet->values and snet->col_index must hold ann_nnz()
+//entries and snet->row_start n_bias+1; bias stays shared with the float net.
+void sparsify_ann(ANN *net, ANN_S *snet){
+    unsigned int DIM[2];
+    unsigned int i,k,l;
+    unsigned int row = 0, nnz = 0;
+    float *weights = net->weights;
+
+    snet->topology = net->topology;
+    snet->n_layers = net->n_layers;
+    snet->n_bias = net->n_bias;
+    snet->bias = net->bias;
+    memcpy(snet->activation, net->activation, sizeof(snet->activation));
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
         for(i = 0; i < DIM[0]; i++){
-            a[i] = 0.0;
+            snet->row_start[row++] = nnz;
             for(k = 0; k < DIM[1]; k++){
-                a[i] += weights[(DIM[1]*i)+k]*input[k];
+                if(weights[(DIM[1]*i)+k] != 0.0){
+                    snet->values[nnz] = weights[(DIM[1]*i)+k];
+                    snet->col_index[nnz] = (uint16_t)k;
+                    nnz++;
+                }
             }
-            a[i] = net->hidden_activation_function(a[i] + net->bias[i]);
-            //if(depth == 2) printf("%f,", a[i]);
         }
-        //if(depth == 2) printf("0\n");
-        FP_ANN(net, a, depth-1, &weights[DIM[0]*DIM[1]]);
+        weights += DIM[0]*DIM[1];
     }
-    return;
+    snet->row_start[row] = nnz;
+    snet->nnz = nnz;
 }
 
-void run_ann(ANN *net, float *input){
-    FP_ANN(net, input, net->n_layers-1, net->weights);
+//Sparse forward pass, only stored weights are multiplied
+void FP_ANN_S(ANN_S *net, float *input, float *a, float *b){
+    unsigned int DIM[2];
+    unsigned int i,l,p,end;
+    unsigned int *row_start = net->row_start;
+    float *bias = net->bias;
+    float *src = input;
+    float *dst = a;
+    float s0, s1;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        if(l == net->n_layers - 1) dst = net->output;
+
+        for(i = 0; i < DIM[0]; i++){
+            //Two accumulators so consecutive MACs do not wait on each other
+            s0 = 0.0;
+            s1 = 0.0;
+            end = row_start[i+1];
+            for(p = row_start[i]; p + 1 < end; p += 2){
+                s0 += net->values[p]*src[net->col_index[p]];
+                s1 += net->values[p+1]*src[net->col_index[p+1]];
+            }
+            if(p < end) s0 += net->values[p]*src[net->col_index[p]];
+            dst[i] = (s0 + s1) + bias[i];
+        }
+        activate_layer(net->activation[l-1], dst, 0, DIM[0]);
+
+        row_start += DIM[0];
+        bias += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
 }
 
-void init_ann(ANN *net){
-    fill_number(net->bias, net->n_bias, 0.1);
-    fill_zeros(net->dedw, net->n_weights);
+void run_ann_s(ANN_S *net, float *input){
+    unsigned int width = ann_s_scratch_size(net)/2;
+    FP_ANN_S(net, input, net->scratch, &net->scratch[width]);
+}
+
+//-----Model Format-----
+//CRC-32 as computed by zlib's crc32(), four bits per step from a 16 entry table
+static const uint32_t crc_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
 
-    if(net->output_activation_function == &relu) net->output_activation_derivative = &relu_derivative;
-    else if(net->output_activation_function == &relu2) net->output_activation_derivative = &relu2_derivative;
+uint32_t ann_crc32(uint32_t crc, const void *data, unsigned int n){
+    const uint8_t *p = data;
+    unsigned int i;
+    crc = ~crc;
+    for(i = 0; i < n; i++){
+        crc ^= p[i];
+        crc = (crc >> 4) ^ crc_nibble[crc & 0xF];
+        crc = (crc >> 4) ^ crc_nibble[crc & 0xF];
+    }
+    return ~crc;
+}
+
+enum {
+    SEC_TOPOLOGY,
+    SEC_WEIGHTS,
+    SEC_BIAS,
+    SEC_TRAIN,
+    SEC_DEDW,
+    SEC_Q_ACT_SCALE,
+    SEC_Q_ZERO_POINT,
+    SEC_Q_REQUANT,
+    SEC_Q_ACC_SCALE,
+    SEC_Q_BIAS,
+    SEC_Q_WEIGHTS,
+    SEC_NORM,
+    SEC_END
+};
+
+//Byte offset of every section described by the header; absent sections are empty
+static void model_layout(const ANN_MODEL_HEADER *h, unsigned int *off){
+    unsigned int n_acc = (h->flags & ANN_MODEL_PER_CHANNEL) ? h->n_bias : h->n_layers - 1;
+    unsigned int f = (h->flags & ANN_MODEL_FLOAT) ? 1 : 0;
+    unsigned int t = (h->flags & ANN_MODEL_TRAIN) ? 1 : 0;
+    unsigned int q = (h->flags & ANN_MODEL_QUANT) ? 1 : 0;
+    unsigned int g = (h->flags & ANN_MODEL_NORM) ? 1 : 0;
 
-    if(net->hidden_activation_function == &relu) net->hidden_activation_derivative = &relu_derivative;
-    else if(net->hidden_activation_function == &relu2) net->hidden_activation_derivative = &relu2_derivative;
+    off[SEC_TOPOLOGY] = sizeof(ANN_MODEL_HEADER);
+    off[SEC_WEIGHTS] = off[SEC_TOPOLOGY] + h->n_layers*sizeof(uint32_t);
+    off[SEC_BIAS] = off[SEC_WEIGHTS] + f*h->n_weights*sizeof(float);
+    off[SEC_TRAIN] = off[SEC_BIAS] + f*h->n_bias*sizeof(float);
+    off[SEC_DEDW] = off[SEC_TRAIN] + t*3*sizeof(float);
+    off[SEC_Q_ACT_SCALE] = off[SEC_DEDW] + t*h->n_weights*sizeof(float);
+    off[SEC_Q_ZERO_POINT] = off[SEC_Q_ACT_SCALE] + q*h->n_layers*sizeof(float);
+    off[SEC_Q_REQUANT] = off[SEC_Q_ZERO_POINT] + q*h->n_layers*sizeof(int32_t);
+    off[SEC_Q_ACC_SCALE] = off[SEC_Q_REQUANT] + q*h->n_layers*sizeof(ANN_Q_SCALE);
+    off[SEC_Q_BIAS] = off[SEC_Q_ACC_SCALE] + q*n_acc*sizeof(ANN_Q_SCALE);
+    off[SEC_Q_WEIGHTS] = off[SEC_Q_BIAS] + q*h->n_bias*sizeof(int32_t);
+    off[SEC_NORM] = off[SEC_Q_WEIGHTS] + ((q*h->n_weights + 3) & ~3u);
+    off[SEC_END] = off[SEC_NORM] + g*sizeof(uint32_t);
 }
 
-void init_pretrained_ann(ANN *net){
-    fill_zeros(net->dedw, net->n_weights);
+static uint32_t model_crc(const uint8_t *buf, unsigned int size){
+    uint32_t crc = ann_crc32(0, buf, offsetof(ANN_MODEL_HEADER, crc));
+    return ann_crc32(crc, buf + sizeof(ANN_MODEL_HEADER), size - sizeof(ANN_MODEL_HEADER));
+}
+
+//Validates a model blob in place and returns its section offsets
+static int check_model(const void *buf, unsigned int size, unsigned int *off){
+    const ANN_MODEL_HEADER *h = buf;
+    const uint32_t *topology;
+    uint64_t n_weights = 0, n_bias = 0;
+    unsigned int i, group;
 
-    if(net->output_activation_function == &relu) net->output_activation_derivative = &relu_derivative;
-    else if(net->output_activation_function == &relu2) net->output_activation_derivative = &relu2_derivative;
+    if(((uintptr_t)buf & 3) != 0) return ANN_MODEL_ERR_ALIGN;
+    if(size < sizeof(ANN_MODEL_HEADER)) return ANN_MODEL_ERR_SIZE;
+    if(h->magic != ANN_MODEL_MAGIC) return ANN_MODEL_ERR_MAGIC;
+    if(h->version != ANN_MODEL_VERSION) return ANN_MODEL_ERR_VERSION;
+    if((h->flags & ANN_MODEL_TRAIN) && !(h->flags & ANN_MODEL_FLOAT)) return ANN_MODEL_ERR_SECTION;
+    if(h->n_layers < 2 || h->n_layers > ANN_MAX_LAYERS || h->size > size ||
+       h->n_weights > h->size || h->n_bias > h->size) return ANN_MODEL_ERR_SIZE;
 
-    if(net->hidden_activation_function == &relu) net->hidden_activation_derivative = &relu_derivative;
-    else if(net->hidden_activation_function == &relu2) net->hidden_activation_derivative = &relu2_derivative;
+    model_layout(h, off);
+    if(off[SEC_END] != h->size) return ANN_MODEL_ERR_SIZE;
+
+    topology = (const uint32_t *)((const uint8_t *)buf + off[SEC_TOPOLOGY]);
+    for(i = 0; i < h->n_layers; i++){
+        if(topology[i] == 0) return ANN_MODEL_ERR_SIZE;
+    }
+    for(i = 1; i < h->n_layers; i++){
+        n_weights += (uint64_t)topology[i]*topology[i-1];
+        n_bias += topology[i];
+    }
+    if(n_weights != h->n_weights || n_bias != h->n_bias) return ANN_MODEL_ERR_SIZE;
+    if(h->flags & ANN_MODEL_NORM){
+        group = ((const uint32_t *)((const uint8_t *)buf + off[SEC_NORM]))[0];
+        if(group == 0 || topology[0] % group != 0) return ANN_MODEL_ERR_SIZE;
+    }
+
+    if(model_crc(buf, h->size) != h->crc) return ANN_MODEL_ERR_CRC;
+    return ANN_MODEL_OK;
+}
+
+//Bytes ann_save_to_buffer needs for a float model, a quantized model, or both (either may be NULL).
+//A float model with dedw set also carries the momentum and learning rates so training can resume.
+unsigned int ann_model_size(ANN *net, ANN_Q *qnet){
+    ANN_MODEL_HEADER h;
+    unsigned int off[SEC_END + 1];
+
+    h.flags = (net ? ANN_MODEL_FLOAT : 0) | ((net && net->dedw) ? ANN_MODEL_TRAIN : 0) | (qnet ? ANN_MODEL_QUANT : 0) |
+              ((qnet && qnet->per_channel) ? ANN_MODEL_PER_CHANNEL : 0) | ((net && net->input_group) ? ANN_MODEL_NORM : 0);
+    h.n_layers = net ? net->n_layers : qnet->n_layers;
+    h.n_weights = net ? net->n_weights : qnet->n_weights;
+    h.n_bias = net ? net->n_bias : qnet->n_bias;
+    model_layout(&h, off);
+    return off[SEC_END];
+}
+
+//Serializes the model into buf and returns the bytes written, 0 if buf is too small.
+//net and qnet must share a topology; either may be NULL. Saving a net that was loaded from
+//the same buffer only refreshes the header and CRC.
+unsigned int ann_save_to_buffer(ANN *net, ANN_Q *qnet, void *buf, unsigned int size){
+    ANN_MODEL_HEADER h;
+    unsigned int off[SEC_END + 1];
+    unsigned int i, n_acc;
+    uint8_t *p = buf;
+
+    if(!net && !qnet) return 0;
+    memset(&h, 0, sizeof(h));
+    h.magic = ANN_MODEL_MAGIC;
+    h.version = ANN_MODEL_VERSION;
+    h.flags = (net ? ANN_MODEL_FLOAT : 0) | ((net && net->dedw) ? ANN_MODEL_TRAIN : 0) | (qnet ? ANN_MODEL_QUANT : 0) |
+              ((qnet && qnet->per_channel) ? ANN_MODEL_PER_CHANNEL : 0) | ((net && net->input_group) ? ANN_MODEL_NORM : 0);
+    h.n_layers = net ? net->n_layers : qnet->n_layers;
+    h.n_weights = net ? net->n_weights : qnet->n_weights;
+    h.n_bias = net ? net->n_bias : qnet->n_bias;
+    model_layout(&h, off);
+    h.size = off[SEC_END];
+    if(size < h.size || ((uintptr_t)buf & 3) != 0) return 0;
+
+    for(i = 0; i < h.n_layers; i++){
+        ((uint32_t *)(p + off[SEC_TOPOLOGY]))[i] = net ? net->topology[i] : qnet->topology[i];
+    }
+    memcpy(h.activation, net ? net->activation : qnet->activation, sizeof(h.activation));
+    if(net){
+        memmove(p + off[SEC_WEIGHTS], net->weights, net->n_weights*sizeof(float));
+        memmove(p + off[SEC_BIAS], net->bias, net->n_bias*sizeof(float));
+    }
+    if(net && net->dedw){
+        ((float *)(p + off[SEC_TRAIN]))[0] = net->eta;
+        ((float *)(p + off[SEC_TRAIN]))[1] = net->beta;
+        ((float *)(p + off[SEC_TRAIN]))[2] = net->alpha;
+        memmove(p + off[SEC_DEDW], net->dedw, net->n_weights*sizeof(float));
+    }
+    if(qnet){
+        n_acc = qnet->per_channel ? qnet->n_bias : qnet->n_layers - 1;
+        memmove(p + off[SEC_Q_ACT_SCALE], qnet->act_scale, qnet->n_layers*sizeof(float));
+        memmove(p + off[SEC_Q_ZERO_POINT], qnet->act_zero_point, qnet->n_layers*sizeof(int32_t));
+        memmove(p + off[SEC_Q_REQUANT], qnet->act_requant, qnet->n_layers*sizeof(ANN_Q_SCALE));
+        memmove(p + off[SEC_Q_ACC_SCALE], qnet->acc_scale, n_acc*sizeof(ANN_Q_SCALE));
+        memmove(p + off[SEC_Q_BIAS], qnet->bias, qnet->n_bias*sizeof(int32_t));
+        memmove(p + off[SEC_Q_WEIGHTS], qnet->weights, qnet->n_weights);
+        memset(p + off[SEC_Q_WEIGHTS] + qnet->n_weights, 0, off[SEC_NORM] - off[SEC_Q_WEIGHTS] - qnet->n_weights);
+    }
+    if(net && net->input_group){
+        ((uint32_t *)(p + off[SEC_NORM]))[0] = net->input_group;
+    }
+    memcpy(p, &h, sizeof(h));
+    ((ANN_MODEL_HEADER *)p)->crc = model_crc(p, h.size);
+    return h.size;
+}
+
+//Points topology, weights and bias of net into the blob without copying; buf must stay valid
+//and 4-byte aligned. A training section also restores eta/beta/alpha and points dedw into it,
+//without one dedw is NULL; input_group is 0 without a normalization section. Output, scratch
+//and optimizer buffers are left to the set_model_* calls.
+int ann_load_from_buffer(ANN *net, void *buf, unsigned int size){
+    ANN_MODEL_HEADER *h = buf;
+    unsigned int off[SEC_END + 1];
+    uint8_t *p = buf;
+    int err = check_model(buf, size, off);
+
+    if(err != ANN_MODEL_OK) return err;
+    if(!(h->flags & ANN_MODEL_FLOAT)) return ANN_MODEL_ERR_SECTION;
+
+    net->topology = (unsigned int *)(p + off[SEC_TOPOLOGY]);
+    net->n_layers = h->n_layers;
+    net->n_weights = h->n_weights;
+    net->n_bias = h->n_bias;
+    net->weights = (float *)(p + off[SEC_WEIGHTS]);
+    net->bias = (float *)(p + off[SEC_BIAS]);
+    memcpy(net->activation, h->activation, sizeof(net->activation));
+    if(h->flags & ANN_MODEL_TRAIN){
+        net->eta = ((float *)(p + off[SEC_TRAIN]))[0];
+        net->beta = ((float *)(p + off[SEC_TRAIN]))[1];
+        net->alpha = ((float *)(p + off[SEC_TRAIN]))[2];
+        net->dedw = (float *)(p + off[SEC_DEDW]);
+    }
+    else net->dedw = 0;
+    net->input_group = (h->flags & ANN_MODEL_NORM) ? ((uint32_t *)(p + off[SEC_NORM]))[0] : 0;
+    return ANN_MODEL_OK;
+}
+
+//Quantized counterpart of ann_load_from_buffer; scratch and output stay with set_model_q_memory
+int ann_q_load_from_buffer(ANN_Q *net, void *buf, unsigned int size){
+    ANN_MODEL_HEADER *h = buf;
+    unsigned int off[SEC_END + 1];
+    uint8_t *p = buf;
+    int err = check_model(buf, size, off);
+
+    if(err != ANN_MODEL_OK) return err;
+    if(!(h->flags & ANN_MODEL_QUANT)) return ANN_MODEL_ERR_SECTION;
+
+    if(!q_activations_ok(h->activation, h->n_layers)) return ANN_MODEL_ERR_SECTION;
+    set_model_q_parameters(net, (unsigned int *)(p + off[SEC_TOPOLOGY]), h->n_layers, 'r',
+                           (h->flags & ANN_MODEL_PER_CHANNEL) ? 1 : 0);
+    memcpy(net->activation, h->activation, sizeof(net->activation));
+    net->act_scale = (float *)(p + off[SEC_Q_ACT_SCALE]);
+    net->act_zero_point = (int32_t *)(p + off[SEC_Q_ZERO_POINT]);
+    net->act_requant = (ANN_Q_SCALE *)(p + off[SEC_Q_REQUANT]);
+    net->acc_scale = (ANN_Q_SCALE *)(p + off[SEC_Q_ACC_SCALE]);
+    net->bias = (int32_t *)(p + off[SEC_Q_BIAS]);
+    net->weights = (int8_t *)(p + off[SEC_Q_WEIGHTS]);
+    return ANN_MODEL_OK;
 }
 
 //-----Utility-----
+//Two ping-pong buffers sized to the widest hidden layer, shared by the float, fp16 and sparse forms
+static unsigned int pingpong_size(unsigned int *topology, unsigned int n_layers){
+    unsigned int i, width = 0;
+    for(i = 1; i < n_layers - 1; i++){
+        if(topology[i] > width) width = topology[i];
+    }
+    return 2*width;
+}
+
+unsigned int ann_scratch_size(ANN *net){
+    return pingpong_size(net->topology, net->n_layers);
+}
+
+//Hidden activations and derivatives of every layer plus two delta buffers sized to the widest layer
+unsigned int ann_bp_scratch_size(ANN *net){
+    unsigned int i, hidden = 0, width = 0;
+    for(i = 1; i < net->n_layers; i++){
+        if(i < net->n_layers - 1) hidden += net->topology[i];
+        if(net->topology[i] > width) width = net->topology[i];
+    }
+    return 2*hidden + 2*width;
+}
+
+//Two int8 ping-pong buffers plus the quantized input, each sized to the widest layer
+unsigned int ann_q_scratch_size(ANN_Q *net){
+    unsigned int i, width = 0;
+    for(i = 0; i < net->n_layers - 1; i++){
+        if(net->topology[i] > width) width = net->topology[i];
+    }
+    return 3*width;
+}
+
+unsigned int ann_h_scratch_size(ANN_H *net){
+    return pingpong_size(net->topology, net->n_layers);
+}
+
+unsigned int ann_s_scratch_size(ANN_S *net){
+    return pingpong_size(net->topology, net->n_layers);
+}
+
+//Floats of optimizer state beyond dedw: none for momentum, one per parameter for RMSprop, two for Adam
+unsigned int ann_optimizer_state_size(ANN *net, char optimizer){
+    switch(optimizer){
+        case 'r': return net->n_weights + net->n_bias;
+        case 'a': return 2*(net->n_weights + net->n_bias);
+        default:  return 0;
+    }
+}
+
+//-----Arena-----
+enum {
+    ARENA_WEIGHTS,
+    ARENA_BIAS,
+    ARENA_DEDW,
+    ARENA_GRAD,
+    ARENA_BP_SCRATCH,
+    ARENA_OPT_STATE,
+    ARENA_SCRATCH,
+    ARENA_OUTPUT,
+    ARENA_END
+};
+
+#define ARENA_BLOCK(n) (((n)*sizeof(float) + ANN_ARENA_ALIGN - 1) & ~(ANN_ARENA_ALIGN - 1))
+
+//Byte offset of every block in the order the forward and backward passes stream them; each
+//block starts on its own ANN_ARENA_ALIGN boundary so no two buffers share a cache line
+static void arena_layout(ANN *net, unsigned int flags, unsigned int *off){
+    unsigned int train = (flags & ANN_ARENA_TRAIN) ? 1 : 0;
+    unsigned int grad = (flags & ANN_ARENA_GRADIENT) ? 1 : 0;
+    unsigned int moments = (flags & ANN_ARENA_ADAM) ? 2 : ((flags & ANN_ARENA_RMSPROP) ? 1 : 0);
+    unsigned int batch = (flags >> 8) ? (flags >> 8) : 1;
+
+    off[ARENA_WEIGHTS] = 0;
+    off[ARENA_BIAS] = off[ARENA_WEIGHTS] + ARENA_BLOCK(net->n_weights);
+    off[ARENA_DEDW] = off[ARENA_BIAS] + ARENA_BLOCK(net->n_bias);
+    off[ARENA_GRAD] = off[ARENA_DEDW] + train*ARENA_BLOCK(net->n_weights);
+    off[ARENA_BP_SCRATCH] = off[ARENA_GRAD] + grad*ARENA_BLOCK(net->n_weights + net->n_bias);
+    off[ARENA_OPT_STATE] = off[ARENA_BP_SCRATCH] + train*ARENA_BLOCK(ann_bp_scratch_size(net));
+    off[ARENA_SCRATCH] = off[ARENA_OPT_STATE] + ARENA_BLOCK(moments*(net->n_weights + net->n_bias));
+    off[ARENA_OUTPUT] = off[ARENA_SCRATCH] + ARENA_BLOCK(batch*ann_scratch_size(net));
+    off[ARENA_END] = off[ARENA_OUTPUT] + ARENA_BLOCK(net->topology[net->n_layers - 1]);
+}
+
+//Bytes of arena ann_init_in_arena needs for this topology and ANN_ARENA_* flags,
+//including slack to align an arbitrary buffer
+unsigned int ann_required_bytes(unsigned int *topology, unsigned int nlayers, unsigned int flags){
+    ANN net;
+    unsigned int off[ARENA_END + 1];
+
+    set_model_parameters(&net, topology, nlayers, 'r');
+    arena_layout(&net, flags, off);
+    return off[ARENA_END] + ANN_ARENA_ALIGN - 1;
+}
+
+//Carves every buffer of net out of one zeroed block of ann_required_bytes(..., net->arena_flags)
+//bytes. Topology and activations come from set_model_parameters; the optimizer follows the flags.
+void ann_init_in_arena(ANN *net, void *arena){
+    unsigned int off[ARENA_END + 1];
+    uint8_t *base = (uint8_t *)(((uintptr_t)arena + ANN_ARENA_ALIGN - 1) & ~(uintptr_t)(ANN_ARENA_ALIGN - 1));
+    unsigned int flags = net->arena_flags;
+
+    arena_layout(net, flags, off);
+    memset(base, 0, off[ARENA_END]);
+
+    net->weights = (float *)(base + off[ARENA_WEIGHTS]);
+    net->bias = (float *)(base + off[ARENA_BIAS]);
+    net->dedw = (flags & ANN_ARENA_TRAIN) ? (float *)(base + off[ARENA_DEDW]) : 0;
+    net->grad = (flags & ANN_ARENA_GRADIENT) ? (float *)(base + off[ARENA_GRAD]) : 0;
+    net->bp_scratch = (flags & ANN_ARENA_TRAIN) ? (float *)(base + off[ARENA_BP_SCRATCH]) : 0;
+    net->scratch = (float *)(base + off[ARENA_SCRATCH]);
+    net->batch_size = (flags >> 8) ? (flags >> 8) : 1;
+    net->output = (float *)(base + off[ARENA_OUTPUT]);
+
+    if(flags & ANN_ARENA_ADAM) set_model_optimizer(net, 'a', (float *)(base + off[ARENA_OPT_STATE]));
+    else if(flags & ANN_ARENA_RMSPROP) set_model_optimizer(net, 'r', (float *)(base + off[ARENA_OPT_STATE]));
+}
+
+void set_model_arena_flags(ANN *model, unsigned int flags){
+    model->arena_flags = flags;
+}
+
 void fill_zeros(float *v, unsigned int size){
     int i;
     for(i = 0; i < size; i++){ v[i] = 0.0; }
@@ -187,6 +1719,28 @@ float relu2(float x){
     return x;
 }
 
+//Table driven, linear interpolation between entries
+float tanh_table(float x){
+    return tanh_lut_eval(x);
+}
+
+float sigmoid_table(float x){
+    return 0.5f + 0.5f*tanh_lut_eval(0.5f*x);
+}
+
+//Integer versions on Q16 pre-activations
+int32_t relu_q(int32_t x){
+    if(x < 0) return 0;
+    else if(x > ANN_Q_ONE) return x/10 + (93*ANN_Q_ONE)/100;
+    return x;
+}
+
+int32_t relu2_q(int32_t x){
+    if(x < -ANN_Q_ONE)     return x/10 - (93*ANN_Q_ONE)/100;
+    else if(x > ANN_Q_ONE) return x/10 + (93*ANN_Q_ONE)/100;
+    return x;
+}
+
 //-----Derivative Functions-----
 float relu_derivative(float x){
     if(x < 0.0) return 0.0;
@@ -208,6 +1762,24 @@ void set_model_memory(ANN *model, float *weights, float *dedw, float *bias, floa
     model->output = output;
 }
 
+void set_model_scratch(ANN *model, float *scratch){
+    model->scratch = scratch;
+    model->batch_size = 1;
+}
+
+void set_model_bp_scratch(ANN *model, float *bp_scratch){
+    model->bp_scratch = bp_scratch;
+}
+
+void set_model_gradient(ANN *model, float *grad){
+    model->grad = grad;
+}
+
+void set_model_batch_scratch(ANN *model, float *scratch, unsigned int batch_size){
+    model->scratch = scratch;
+    model->batch_size = batch_size;
+}
+
 void set_model_parameters(ANN *model, unsigned int *topology, unsigned int nlayers, char activation_function){
     model->topology = topology;
     model->n_layers = nlayers;
@@ -216,26 +1788,43 @@ void set_model_parameters(ANN *model, unsigned int *topology, unsigned int nlaye
     int nweights = 0, nbias = 0;
     for(i = 1; i < nlayers; i++){
         nweights += topology[i]*topology[i-1];
-        nbias += topology[i-1];
+        nbias += topology[i];
     }
 
     model->n_weights = nweights;
     model->n_bias = nbias;
+    model->input_group = 0;
 
-    switch(activation_function){
+    set_hidden_actfunc(model, activation_function);
+    set_output_actfunc(model, activation_function);
+    set_model_optimizer(model, 'm', 0);
+}
+
+//'m' momentum SGD, 'r' RMSprop, 'a' Adam; state holds ann_optimizer_state_size() floats (NULL for 'm')
+void set_model_optimizer(ANN *model, char optimizer, float *state){
+    switch(optimizer){
         case 'r':
-            model->output_activation_function = &relu;
-            model->hidden_activation_function = &relu;
+            model->optimizer = OPT_RMSPROP;
+            set_optimizer_parameters(model, 0.9, 0.0, 1e-7);
             break;
-        case 'R':
-            model->output_activation_function = &relu2;
-            model->hidden_activation_function = &relu2;
+        case 'a':
+            model->optimizer = OPT_ADAM;
+            set_optimizer_parameters(model, 0.9, 0.999, 1e-7);
             break;
+        case 'm':
         default:
-            model->output_activation_function = &relu;
-            model->hidden_activation_function = &relu;
+            model->optimizer = OPT_MOMENTUM;
             break;
     }
+    model->opt_state = state;
+    if(state) fill_zeros(state, opt_state_size(model));
+    model->step = 0;
+}
+
+void set_optimizer_parameters(ANN *model, float decay1, float decay2, float epsilon){
+    model->decay1 = decay1;
+    model->decay2 = decay2;
+    model->epsilon = epsilon;
 }
 
 void set_model_hyperparameters(ANN *model, float learning_rate, float bias_learning_rate, float momentum_factor){
@@ -256,36 +1845,89 @@ void set_momentum_factor(ANN *model, float alpha){
     model->alpha = alpha;
 }
 
-void set_output_actfunc(ANN *model, char func){
+//'r' relu, 'R' relu2, 's'/'S' sigmoid exact/table, 't'/'T' tanh exact/table, 'l' linear, 'L' leaky relu,
+//'x' softmax (output layer, trained with cross-entropy)
+static uint8_t activation_code(char func){
     switch(func){
+        case 'R': return ACT_RELU2;
+        case 's': return ACT_SIGMOID;
+        case 'S': return ACT_SIGMOID_LUT;
+        case 't': return ACT_TANH;
+        case 'T': return ACT_TANH_LUT;
+        case 'l': return ACT_LINEAR;
+        case 'x': return ACT_SOFTMAX;
+        case 'L': return ACT_LEAKY_RELU;
         case 'r':
-            model->output_activation_function = &relu;
-            model->output_activation_derivative = &relu_derivative;
-            break;
-        case 'R':
-            model->output_activation_function = &relu2;
-            model->output_activation_derivative = &relu2_derivative;
-            break;
-        default:
-            model->output_activation_function = &relu;
-            model->output_activation_derivative = &relu_derivative;
-            break;
+        default:  return ACT_RELU;
     }
 }
 
+//Layers are numbered from 1 (first hidden layer) to n_layers-1 (output)
+void set_layer_actfunc(ANN *model, unsigned int layer, char func){
+    model->activation[layer-1] = activation_code(func);
+}
+
+void set_output_actfunc(ANN *model, char func){
+    set_layer_actfunc(model, model->n_layers - 1, func);
+}
+
 void set_hidden_actfunc(ANN *model, char func){
-    switch(func){
-        case 'r':
-            model->hidden_activation_function = &relu;
-            model->hidden_activation_derivative = &relu_derivative;
-            break;
-        case 'R':
-            model->hidden_activation_function = &relu2;
-            model->hidden_activation_derivative = &relu2_derivative;
-            break;
-        default:
-            model->hidden_activation_function = &relu;
-            model->hidden_activation_derivative = &relu_derivative;
-            break;
+    unsigned int i;
+    for(i = 1; i < model->n_layers - 1; i++){
+        set_layer_actfunc(model, i, func);
+    }
+}
+
+//Adds or replaces a stage; the cascade spans up to the highest stage set
+void set_cascade_stage(ANN_CASCADE *cascade, unsigned int stage, ANN *net, float threshold){
+    cascade->stage[stage] = net;
+    cascade->threshold[stage] = threshold;
+    if(stage >= cascade->n_stages) cascade->n_stages = stage + 1;
+}
+
+void set_model_h_memory(ANN_H *model, uint16_t *weights, uint16_t *bias, float *scratch, float *output){
+    model->weights = weights;
+    model->bias = bias;
+    model->scratch = scratch;
+    model->output = output;
+}
+
+void set_model_s_memory(ANN_S *model, float *values, uint16_t *col_index, unsigned int *row_start, float *scratch, float *output){
+    model->values = values;
+    model->col_index = col_index;
+    model->row_start = row_start;
+    model->scratch = scratch;
+    model->output = output;
+}
+
+void set_model_q_memory(ANN_Q *model, int8_t *weights, int32_t *bias, ANN_Q_SCALE *acc_scale, ANN_Q_SCALE *act_requant,
+                        float *act_scale, int32_t *act_zero_point, int8_t *scratch, float *output){
+    model->weights = weights;
+    model->bias = bias;
+    model->acc_scale = acc_scale;
+    model->act_requant = act_requant;
+    model->act_scale = act_scale;
+    model->act_zero_point = act_zero_point;
+    model->scratch = scratch;
+    model->output = output;
+}
+
+void set_model_q_parameters(ANN_Q *model, unsigned int *topology, unsigned int nlayers, char activation_function, unsigned int per_channel){
+    model->topology = topology;
+    model->n_layers = nlayers;
+    model->per_channel = per_channel;
+
+    unsigned int i;
+    unsigned int nweights = 0, nbias = 0;
+    for(i = 1; i < nlayers; i++){
+        nweights += topology[i]*topology[i-1];
+        nbias += topology[i];
+    }
+
+    model->n_weights = nweights;
+    model->n_bias = nbias;
+
+    for(i = 0; i < nlayers - 1; i++){
+        model->activation[i] = activation_code(activation_function);
     }
 }
@@ -23,52 +23,361 @@
 #ifndef EMBEDDED_ML_METAL
 #define EMBEDDED_ML_METAL
 
+#include <stdint.h>
+
 //-----ANN Structure-----
+#define ANN_MAX_LAYERS 8
+
+//-----Profiling-----
+//Define ANN_PROFILE (here or with -DANN_PROFILE) to record per-layer ticks, MACs and bytes
+//touched in run_ann, run_ann_batch and train_ann/accumulate_ann. Ticks are DWT cycles on
+//Cortex-M and nanoseconds on the host. Without it the hooks compile to nothing.
+//#define ANN_PROFILE
+
+#ifdef ANN_PROFILE
+typedef struct {
+    uint64_t ticks;
+    uint64_t macs;
+    uint64_t bytes;     //Estimated traffic over weights, state and activations
+} ANN_LAYER_PROFILE;
+
+typedef struct {
+    ANN_LAYER_PROFILE forward[ANN_MAX_LAYERS - 1];     //[0] is the first hidden layer
+    ANN_LAYER_PROFILE backward[ANN_MAX_LAYERS - 1];
+    uint32_t forward_calls;
+    uint32_t backward_calls;
+} ANN_PROFILE_DATA;
+
+extern ANN_PROFILE_DATA ann_profile;
+void ann_profile_reset(void);
+#endif
+
+enum {
+    ACT_RELU,
+    ACT_RELU2,
+    ACT_SIGMOID,
+    ACT_TANH,
+    ACT_LINEAR,
+    ACT_LEAKY_RELU,
+    ACT_SIGMOID_LUT,
+    ACT_TANH_LUT,
+    ACT_SOFTMAX     //Output layer only, BP_ANN then minimizes cross-entropy
+};
+
+enum {
+    OPT_MOMENTUM,
+    OPT_RMSPROP,
+    OPT_ADAM,
+    OPT_ACCUMULATE  //Internal, sums into grad instead of stepping
+};
+
 typedef struct {
     float *weights;
     float *dedw;
+    float *grad;        //n_weights+n_bias floats, mini-batch gradient accumulator (NULL if unused)
     float *bias;
     unsigned int *topology;
     unsigned int n_layers;
     unsigned int n_weights;
     unsigned int n_bias;
     float *output;
+    float *scratch;     //ann_scratch_size() floats, hidden activation ping-pong buffers
+    float *bp_scratch;  //ann_bp_scratch_size() floats, training arena
+    unsigned int batch_size;    //Samples per run_ann_batch tile, scratch holds batch_size*ann_scratch_size() floats
+
+    uint8_t activation[ANN_MAX_LAYERS - 1];    //ACT_* per layer, [0] is the first hidden layer
 
-    float (*output_activation_function)(float);
-    float (*output_activation_derivative)(float);
-    float (*hidden_activation_function)(float);
-    float (*hidden_activation_derivative)(float);
-    
     float eta;      //Learning Rate
     float beta;     //Bias Learning Rate
     float alpha;    //Momentum Coefficient
+
+    uint8_t optimizer;      //OPT_*
+    float *opt_state;       //ann_optimizer_state_size() floats
+    float decay1;           //RMSprop rho / Adam beta1
+    float decay2;           //Adam beta2
+    float epsilon;
+    unsigned int step;      //Optimizer steps taken
+    float corr1, corr2;     //Adam bias corrections for the current step
+
+    unsigned int arena_flags;   //ANN_ARENA_* layout used by ann_init_in_arena
+    unsigned int input_group;   //ann_normalize_input L2-normalizes groups of this many inputs, 0 for none
 } ANN;
 
 void train_ann(ANN *net, float *input, float *output);
+void train_ann_batch(ANN *net, float *inputs, float *outputs, int n);
+void accumulate_ann(ANN *net, float *input, float *output);
+void update_ann(ANN *net);
 void run_ann(ANN *net, float *input);
+void run_ann_batch(ANN *net, const float *inputs, int n, float *outputs);
 
 void init_ann(ANN *net);
 void init_pretrained_ann(ANN *net);
 
+//-----Input Normalization-----
+//Raw inputs go through ann_normalize_input, then the first layer. A per-feature standardization
+//(x - mean)/std is folded into the first layer by ann_fold_standardization instead, so it is free.
+void ann_normalize_input(ANN *net, const float *input, float *normalized);
+void ann_fold_standardization(ANN *net, const float *mean, const float *std);
+
+//-----Cascade-----
+//Early-exit inference over nets of growing cost with the same input and output widths. A stage
+//answers when the ratio of its two largest outputs reaches its threshold; the last always answers.
+#define ANN_CASCADE_STAGES 4
+
+typedef struct {
+    ANN *stage[ANN_CASCADE_STAGES];         //Cheapest first
+    float threshold[ANN_CASCADE_STAGES];    //Top-1/top-2 output ratio a stage needs to answer
+    unsigned int n_stages;
+    uint32_t hits[ANN_CASCADE_STAGES];      //Inputs answered by each stage
+    float *output;                          //Outputs of the stage that answered the last input
+} ANN_CASCADE;
+
+unsigned int run_ann_cascade(ANN_CASCADE *cascade, float *input);
+float ann_top2_ratio(float *output, unsigned int n);
+void set_cascade_stage(ANN_CASCADE *cascade, unsigned int stage, ANN *net, float threshold);
+
+//-----Incremental Trainer-----
+//Trains over a fixed sample set in time-budgeted slices. Samples are visited in order with one
+//train_ann each, or accumulate_ann and an update_ann every batch samples, so however the work is
+//sliced the weights end up bit-identical to one uninterrupted run.
+typedef struct {
+    ANN *net;
+    float *inputs;              //n_samples rows of topology[0] floats
+    float *targets;             //n_samples rows of output floats
+    unsigned int n_samples;
+    unsigned int batch;         //1 for train_ann, n > 1 for mini-batches of n (needs net->grad)
+    unsigned int total;         //Samples to train on, cycling through the set
+    unsigned int done;          //Samples trained on so far
+    unsigned int checkpoint;    //Also return after every multiple of this many samples, 0 for none
+    uint32_t (*clock_us)(void); //Free running microsecond counter, may wrap
+} ANN_TRAINER;
+
+void ann_trainer_init(ANN_TRAINER *trainer, ANN *net, float *inputs, float *targets, unsigned int n_samples,
+                      unsigned int batch, unsigned int total, uint32_t (*clock_us)(void));
+unsigned int ann_trainer_step(ANN_TRAINER *trainer, uint32_t budget_us);
+
+//-----Double Buffered Model-----
+//Two copies of one ANN: inference reads the active slot while a trainer updates the shadow, and
+//ann_swap_publish makes the shadow active in one store. Supports one inference context (e.g. an
+//ISR) and one training context; training buffers (dedw, grad, bp_scratch, opt_state) are shared.
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define ANN_ATOMIC _Atomic
+#else
+#define ANN_ATOMIC volatile     //Single core only: aligned word loads and stores are atomic
+#endif
+
+typedef struct {
+    ANN slot[2];
+    ANN_ATOMIC unsigned int active;     //Slot inference reads, written by the trainer only
+    ANN_ATOMIC unsigned int reading;    //Slot held by inference plus one, 0 when idle, written by inference only
+    unsigned int stale;                 //Shadow predates the last publish and needs the active weights
+} ANN_SWAP;
+
+void ann_swap_init(ANN_SWAP *swap, ANN *net, float *weights, float *bias, float *scratch, float *output);
+ANN *ann_swap_acquire(ANN_SWAP *swap);
+void ann_swap_release(ANN_SWAP *swap);
+ANN *ann_swap_shadow(ANN_SWAP *swap);
+void ann_swap_publish(ANN_SWAP *swap);
+
+//-----Online Learning-----
+//Bounded ring of recent labelled samples replayed next to new ones so the net does not forget
+typedef struct {
+    float *inputs;          //capacity rows of n_in floats
+    float *targets;         //capacity rows of n_out floats
+    unsigned int n_in;
+    unsigned int n_out;
+    unsigned int capacity;
+    unsigned int count;     //Rows filled, up to capacity
+    unsigned int next;      //Row the next sample overwrites
+    uint32_t seed;          //Replay sampling state
+} ANN_REPLAY;
+
+void ann_replay_init(ANN_REPLAY *replay, float *inputs, float *targets, unsigned int n_in, unsigned int n_out,
+                     unsigned int capacity);
+void ann_replay_add(ANN_REPLAY *replay, float *input, float *target);
+void ann_learn_online(ANN *net, ANN_REPLAY *replay, float *input, float *target, unsigned int steps,
+                      unsigned int n_replay);
+
+//-----Half Precision ANN Structure-----
+//Inference copy of an ANN with IEEE binary16 weights and biases, widened to float as they are used
+typedef struct {
+    uint16_t *weights;      //Same layout as ANN.weights
+    uint16_t *bias;         //Per layer offsets as ANN.bias
+    unsigned int *topology;
+    unsigned int n_layers;
+    unsigned int n_weights;
+    unsigned int n_bias;
+    float *output;
+    float *scratch;         //ann_h_scratch_size() floats
+
+    uint8_t activation[ANN_MAX_LAYERS - 1];
+} ANN_H;
+
+void run_ann_h(ANN_H *net, float *input);
+void convert_ann_h(ANN *net, ANN_H *hnet);
+void set_model_h_memory(ANN_H *model, uint16_t *weights, uint16_t *bias, float *scratch, float *output);
+float half_to_float(uint16_t h);
+uint16_t float_to_half(float x);
+
+//-----Sparse ANN Structure-----
+//CSR copy of a pruned ANN; rows of all layers are numbered consecutively as in ANN.bias
+typedef struct {
+    float *values;              //Nonzero weights, row after row
+    uint16_t *col_index;        //Input index of each value
+    unsigned int *row_start;    //n_bias+1 offsets into values
+    float *bias;
+    unsigned int *topology;
+    unsigned int n_layers;
+    unsigned int n_bias;
+    unsigned int nnz;
+    float *output;
+    float *scratch;             //ann_s_scratch_size() floats
+
+    uint8_t activation[ANN_MAX_LAYERS - 1];
+} ANN_S;
+
+void run_ann_s(ANN_S *net, float *input);
+unsigned int prune_ann(ANN *net, float sparsity);
+unsigned int ann_nnz(ANN *net);
+void sparsify_ann(ANN *net, ANN_S *snet);
+void set_model_s_memory(ANN_S *model, float *values, uint16_t *col_index, unsigned int *row_start, float *scratch, float *output);
+
+//-----Arena-----
+//ann_init_in_arena places weights, bias, the buffers selected here, scratch and output in one block
+#define ANN_ARENA_ALIGN     32              //Block alignment, one cache line
+#define ANN_ARENA_TRAIN     0x01            //dedw and bp_scratch for train_ann
+#define ANN_ARENA_GRADIENT  0x02            //grad for accumulate_ann/update_ann
+#define ANN_ARENA_RMSPROP   0x04            //Optimizer state, selects set_model_optimizer 'r'
+#define ANN_ARENA_ADAM      0x08            //Optimizer state, selects set_model_optimizer 'a'
+#define ANN_ARENA_BATCH(n)  ((n) << 8)      //run_ann_batch tile size, 1 if omitted
+
+unsigned int ann_required_bytes(unsigned int *topology, unsigned int nlayers, unsigned int flags);
+void ann_init_in_arena(ANN *net, void *arena);
+void set_model_arena_flags(ANN *model, unsigned int flags);
+
+//-----Quantized ANN Structure-----
+#define ANN_Q_FRAC_BITS 16              //Pre-activations are held as Q16 int32
+#define ANN_Q_ONE (1 << ANN_Q_FRAC_BITS)
+
+typedef struct {
+    int32_t mult;   //Q31 multiplier in [2^30, 2^31)
+    int32_t shift;  //Right shift after the Q31 multiply, negative shifts left
+} ANN_Q_SCALE;
+
+typedef struct {
+    int8_t *weights;            //Symmetric int8, one scale per layer or per output channel
+    int32_t *bias;              //In accumulator scale with the input zero point folded in, per layer offsets
+    ANN_Q_SCALE *acc_scale;     //Accumulator -> Q16 pre-activation, n_layers-1 entries (n_bias if per_channel)
+    ANN_Q_SCALE *act_requant;   //Q16 activation -> int8, n_layers entries ([0] and output unused)
+    float *act_scale;           //Activation scale per layer, [0] is the input
+    int32_t *act_zero_point;
+    unsigned int *topology;
+    unsigned int n_layers;
+    unsigned int n_weights;
+    unsigned int n_bias;
+    unsigned int per_channel;
+    int8_t *scratch;            //ann_q_scratch_size() bytes
+    float *output;              //Dequantized output layer
+
+    //ACT_* per layer as in ANN. Hidden layers run in Q16 and need an integer form (relu, relu2,
+    //linear, leaky relu); the output layer is dequantized first, so any activation including softmax
+    uint8_t activation[ANN_MAX_LAYERS - 1];
+} ANN_Q;
+
+#define ANN_Q_ERR_ACTIVATION -1     //A hidden layer's activation has no integer form
+
+void run_ann_q(ANN_Q *net, float *input);
+int quantize_ann(ANN *net, ANN_Q *qnet, float *act_min, float *act_max);
+void quantize_multiplier(float real, ANN_Q_SCALE *scale);
+
+void set_model_q_memory(ANN_Q *model, int8_t *weights, int32_t *bias, ANN_Q_SCALE *acc_scale, ANN_Q_SCALE *act_requant,
+                        float *act_scale, int32_t *act_zero_point, int8_t *scratch, float *output);
+void set_model_q_parameters(ANN_Q *model, unsigned int *topology, unsigned int nlayers, char activation_function, unsigned int per_channel);
+
+//-----Model Format-----
+//Native little endian blob, 4-byte aligned: ANN_MODEL_HEADER, uint32 topology[n_layers], then
+//if ANN_MODEL_FLOAT: float weights[n_weights], float bias[n_bias]
+//if ANN_MODEL_TRAIN: float eta, beta, alpha, float dedw[n_weights]
+//if ANN_MODEL_QUANT: float act_scale[n_layers], int32 act_zero_point[n_layers], ANN_Q_SCALE act_requant[n_layers],
+//                    ANN_Q_SCALE acc_scale[n_acc], int32 bias[n_bias], int8 weights[n_weights] padded to 4 bytes
+//if ANN_MODEL_NORM:  uint32 input_group
+#define ANN_MODEL_MAGIC 0x4D4C4D45u    //"EMLM"
+#define ANN_MODEL_VERSION 1
+
+#define ANN_MODEL_FLOAT         0x0001
+#define ANN_MODEL_QUANT         0x0002
+#define ANN_MODEL_PER_CHANNEL   0x0004  //Quantized section has one acc_scale per neuron
+#define ANN_MODEL_TRAIN         0x0008  //Float model carries momentum and learning rates
+#define ANN_MODEL_NORM          0x0010  //Inputs are L2-normalized in groups, see ann_normalize_input
+
+#define ANN_MODEL_OK            0
+#define ANN_MODEL_ERR_SIZE      -1      //Truncated, or counts inconsistent with the topology
+#define ANN_MODEL_ERR_MAGIC     -2
+#define ANN_MODEL_ERR_VERSION   -3
+#define ANN_MODEL_ERR_CRC       -4
+#define ANN_MODEL_ERR_ALIGN     -5
+#define ANN_MODEL_ERR_SECTION   -6      //Requested float/quantized section not present
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;             //ANN_MODEL_* section flags
+    uint32_t n_layers;
+    uint32_t n_weights;
+    uint32_t n_bias;
+    uint32_t size;              //Bytes including this header
+    uint8_t activation[ANN_MAX_LAYERS - 1];     //ANN and ANN_Q activation table
+    uint8_t reserved;           //0
+    uint32_t crc;               //ann_crc32 of the header up to here and everything after it
+} ANN_MODEL_HEADER;
+
+unsigned int ann_model_size(ANN *net, ANN_Q *qnet);
+unsigned int ann_save_to_buffer(ANN *net, ANN_Q *qnet, void *buf, unsigned int size);
+int ann_load_from_buffer(ANN *net, void *buf, unsigned int size);
+int ann_q_load_from_buffer(ANN_Q *net, void *buf, unsigned int size);
+uint32_t ann_crc32(uint32_t crc, const void *data, unsigned int n);
+
 void set_model_memory(ANN *model, float *weights, float *dedw, float *bias, float *output);
+void set_model_scratch(ANN *model, float *scratch);
+void set_model_gradient(ANN *model, float *grad);
+void set_model_bp_scratch(ANN *model, float *bp_scratch);
+void set_model_batch_scratch(ANN *model, float *scratch, unsigned int batch_size);
 void set_model_parameters(ANN *model, unsigned int *topology, unsigned int nlayers, char activation_function);
 void set_model_hyperparameters(ANN *model, float learning_rate, float bias_learning_rate, float momentum_factor);
+void set_model_optimizer(ANN *model, char optimizer, float *state);
+void set_optimizer_parameters(ANN *model, float decay1, float decay2, float epsilon);
 
 void set_learning_rate(ANN *model, float eta);
 void set_bias_learning_rate(ANN *model, float beta);
 void set_momentum_factor(ANN *model, float alpha);
 void set_output_actfunc(ANN *model, char func);
 void set_hidden_actfunc(ANN *model, char func);
+void set_layer_actfunc(ANN *model, unsigned int layer, char func);
 
 //-----Utility-----
+unsigned int ann_scratch_size(ANN *net);
+unsigned int ann_bp_scratch_size(ANN *net);
+unsigned int ann_q_scratch_size(ANN_Q *net);
+unsigned int ann_h_scratch_size(ANN_H *net);
+unsigned int ann_s_scratch_size(ANN_S *net);
+unsigned int ann_optimizer_state_size(ANN *net, char optimizer);
 void fill_zeros(float *v, unsigned int size);
 void fill_number(float *v, unsigned int size, float number);
 
 //------Activation Functions-----
+void activate_layer(uint8_t activation, float *x, float *d, unsigned int n);
+
 float relu(float x);
 float relu_derivative(float x);
 
 float relu2(float x);
 float relu2_derivative(float x);
 
+float tanh_table(float x);
+float sigmoid_table(float x);
+
+int32_t relu_q(int32_t x);
+int32_t relu2_q(int32_t x);
+
 #endif
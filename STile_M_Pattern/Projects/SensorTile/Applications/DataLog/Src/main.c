@@ -70,10 +70,29 @@
 #define Z_ACCEL_THRESHOLD 300
 #define START_POSITION_INTERVAL 3000
 #define TRAINING_CYCLES 2000
+/* Training time per main loop pass, leaves room in each DATA_PERIOD_MS */
+#define TRAINING_BUDGET_US 5000
 #define LED_BLINK_INTERVAL 200
 
 #define MAX_ROTATION_ACQUIRE_CYCLES 300
 
+/* Accumulate the 6 exercises and apply one weight update per epoch */
+#define MINI_BATCH_TRAINING
+
+/* Save the trained ANN to the SDCard and resume from it on boot */
+#define PERSIST_MODEL
+
+/* Keep learning from classifications confirmed or corrected over USB */
+#define ONLINE_LEARNING
+#define ONLINE_STEPS 4          /* train_ann passes over each confirmed exercise */
+#define ONLINE_REPLAY 3         /* Replayed exercises per pass, against forgetting */
+#define REPLAY_CAPACITY 32
+
+/* Answer confident exercises with a single 6-6 softmax layer, the full ANN runs only on the rest */
+#define CASCADE_INFERENCE
+#define CASCADE_THRESHOLD 5.0       /* Top-1/top-2 output ratio the first stage needs to answer */
+#define FAST_TRAINING_EPOCHS 50
+
 //#define NOT_DEBUGGING
 
 /* Private macro -------------------------------------------------------------*/
@@ -110,6 +129,7 @@ static void initializeAllSensors(void);
 /* Private functions ---------------------------------------------------------*/
 
 static volatile uint8_t hasTrained = 0;
+static uint8_t isTraining = 0;
 unsigned int training_cycles = TRAINING_CYCLES;
 
 void print(char *format, ...) {
@@ -123,6 +143,30 @@ void print(char *format, ...) {
 	CDC_Fill_Buffer((uint8_t *) buffer, strlen(buffer));
 }
 
+#ifdef ANN_PROFILE
+/*
+ * Dumps the per-layer profile counters; totals are printed in thousands
+ * since newlib-nano's printf has no 64-bit conversions
+ */
+void printProfile_ANN(ANN *net) {
+	unsigned int l;
+
+	print("\r\nProfile: %lu forward, %lu backward passes\r\nLayer\tPass\tkTicks\tkMACs\tkBytes",
+			(unsigned long) ann_profile.forward_calls, (unsigned long) ann_profile.backward_calls);
+	for (l = 0; l < net->n_layers - 1; l++) {
+		print("\r\n%u\tFP\t%lu\t%lu\t%lu", l + 1,
+				(unsigned long) (ann_profile.forward[l].ticks / 1000),
+				(unsigned long) (ann_profile.forward[l].macs / 1000),
+				(unsigned long) (ann_profile.forward[l].bytes / 1000));
+		print("\r\n%u\tBP\t%lu\t%lu\t%lu", l + 1,
+				(unsigned long) (ann_profile.backward[l].ticks / 1000),
+				(unsigned long) (ann_profile.backward[l].macs / 1000),
+				(unsigned long) (ann_profile.backward[l].bytes / 1000));
+	}
+	print("\r\n");
+}
+#endif
+
 void stable_softmax(float *x, float *y) {
 	int size = 3;
 	float multiplier = 1.0;
@@ -147,53 +191,6 @@ void stable_softmax(float *x, float *y) {
 	}
 }
 
-void motion_softmax(int size, float *x, float *y) {
-	int i, j;
-	float norm_temp; // norm for each triplet
-
-	/*
-	 * Loop through each triplet of array 'x'
-	 */
-	for (i = 0; i < size/3; i++) {
-		norm_temp = 0;
-
-		/*
-		 * Loop over each item in array 'x'
-		 */
-		for (j = 0; j < size; j++) {
-			/*
-			 * If 'x' item in specific triplet, add square of item to norm_temp
-			 */
-			if (floor(j/3) == i) {
-				norm_temp += pow(x[j], 2);
-			}
-		}
-
-		/*
-		 * Root the sum of squares of the triplet
-		 */
-		norm_temp = sqrt(norm_temp);
-
-		/*
-		 * Loop over each item in array 'x'
-		 * Set 'y' item of same 'x' index to normalized value of 'x' item
-		 */
-		for (j = 0; j < size; j++) {
-			if (floor(j/3) == i) {
-				y[j] = abs(x[j]) / norm_temp;
-			}
-		}
-	}
-
-	/*
-	 * Re-apply negatives
-	 */
-	for (i = 0; i < size; i++) {
-		if (x[i] < 0.0)
-			y[i] = y[i] * -1.0;
-	}
-}
-
 void LED_Code_Blink(int count) {
 
 	int i;
@@ -541,18 +538,137 @@ void printOutput_ANN(ANN *net, int input_state, int * error) {
 
 }
 
-void TrainOrientation(void *handle, void *handle_g, ANN *net) {
+/*
+ * Training state, kept between the time slices of TrainOrientation_Step
+ */
+static float training_dataset[6][8][6];
+static float eval_dataset[6][6];
+static float _Motions[6][6] = {
+	{ 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
+	{ 0.0, 1.0, 0.0, 0.0, 0.0, 0.0 },
+	{ 0.0, 0.0, 1.0, 0.0, 0.0, 0.0 },
+	{ 0.0, 0.0, 0.0, 1.0, 0.0, 0.0 },
+	{ 0.0, 0.0, 0.0, 0.0, 1.0, 0.0 },
+	{ 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 }
+};
+static int num_train_data_cycles;
+static int train_data_cycle;
+static ANN_TRAINER trainer;
+
+#ifdef ONLINE_LEARNING
+/*
+ * Recent labelled exercises and the last classification awaiting feedback
+ */
+static ANN_REPLAY replay;
+static float replay_inputs[REPLAY_CAPACITY][6];
+static float replay_targets[REPLAY_CAPACITY][6];
+static float pending_input[6];
+static int pending_loc;
+static uint8_t hasPending = 0;
+#endif
+
+#ifdef CASCADE_INFERENCE
+/*
+ * First stage of the classification cascade, retrained whenever the full
+ * model learns; stage 1 is the active model, set on every classification
+ */
+static ANN fast_net;
+static ANN_CASCADE cascade;
+static uint8_t hasFastStage = 0;
+
+static void TrainFastStage(float *inputs, float *targets, int n) {
+	int e, i;
+
+	for (e = 0; e < FAST_TRAINING_EPOCHS; e++) {
+		for (i = 0; i < n; i++) {
+			train_ann(&fast_net, &inputs[6 * i], &targets[6 * i]);
+		}
+	}
+	if (!hasFastStage) {
+		/* Hit counters cover the two-stage cascade only */
+		cascade.hits[0] = 0;
+		cascade.hits[1] = 0;
+		set_cascade_stage(&cascade, 0, &fast_net, CASCADE_THRESHOLD);
+		hasFastStage = 1;
+	}
+}
+#endif
+
+#ifdef PERSIST_MODEL
+/*
+ * model_blob stages the model between the SD card and the arena; with
+ * CASCADE_INFERENCE the first stage follows the full model, word aligned
+ */
+static uint32_t model_blob[384];
+
+static void SaveModel(ANN *net) {
+	uint32_t size = ann_save_to_buffer(net, 0, model_blob, sizeof(model_blob));
+#ifdef CASCADE_INFERENCE
+	uint32_t fast_offset = (size + 3) / 4;
+
+	if (size && hasFastStage) {
+		size = ann_save_to_buffer(&fast_net, 0, &model_blob[fast_offset], sizeof(model_blob) - 4 * fast_offset);
+		if (size) {
+			size += 4 * fast_offset;
+		}
+	}
+#endif
+	if (size == 0 || !DATALOG_SD_Save_Model(model_blob, size)) {
+		print("\n\rCould not save trained model to SD card");
+	}
+}
+#endif
+
+/*
+ * Microsecond counter for the training budget, extended in software from
+ * the DWT cycle counter so it wraps at 2^32 us; needs a call every few seconds
+ */
+static uint32_t Micros(void) {
+	static uint32_t last, cycles, us;
+	uint32_t now = DWT->CYCCNT;
+	uint32_t per_us = SystemCoreClock / 1000000;
+
+	cycles += now - last;
+	last = now;
+	us += cycles / per_us;
+	cycles %= per_us;
+	return us;
+}
+
+/*
+ * Gathers cycle k's exercises into one batch and restarts the trainer on it
+ */
+static void TrainOrientation_Cycle(ANN *net, int k) {
+	int m, j;
+
+	for (m = 0; m < 6; m++) {
+		for (j = 0; j < 6; j++) {
+			eval_dataset[m][j] = training_dataset[m][k][j];
+		}
+	}
+
+	/* Whole passes over the six exercises, as the blocking loop did */
+#ifdef MINI_BATCH_TRAINING
+	ann_trainer_init(&trainer, net, &eval_dataset[0][0], &_Motions[0][0], 6, 6,
+			6 * ((training_cycles + 5) / 6), Micros);
+#else
+	ann_trainer_init(&trainer, net, &eval_dataset[0][0], &_Motions[0][0], 6, 1,
+			6 * ((training_cycles + 5) / 6), Micros);
+#endif
+}
+
+/*
+ * Records one set of exercises and prepares the trainer; returns 0 if the
+ * sensors are not ready and nothing was recorded
+ */
+int RecordOrientation(void *handle, void *handle_g, ANN *net) {
 
 	uint8_t id, id_g;
 	SensorAxes_t acceleration, angular_velocity;
 	uint8_t status, status_g;
-	float training_dataset[6][8][6];
 	float XYZ[6];
 	float xyz[6];
-	char msg1[256];
-	int num_train_data_cycles;
-	int i, j, k, m, r;
-	int error, net_error;
+	int i, j, k, r;
 	uint8_t doubleTap = 0;
 
 	int features[6];
@@ -609,7 +725,7 @@ void TrainOrientation(void *handle, void *handle_g, ANN *net) {
 					XYZ[j] = (float) features[j];
 				}
 
-				motion_softmax(net->topology[0], XYZ, xyz);
+				ann_normalize_input(net, XYZ, xyz);
 
 				for (j = 0; j < 6; j++) {
 					training_dataset[i][k][j] = xyz[j];
@@ -634,65 +750,41 @@ void TrainOrientation(void *handle, void *handle_g, ANN *net) {
 			}
 		}
 
-		/*
-		 * Enter NN training
-		 */
-		float _Motions[6][6] = {
-			{ 1.0, 0.0, 0.0, 0.0, 0.0, 0.0 },
-			{ 0.0, 1.0, 0.0, 0.0, 0.0, 0.0 },
-			{ 0.0, 0.0, 1.0, 0.0, 0.0, 0.0 },
-			{ 0.0, 0.0, 0.0, 1.0, 0.0, 0.0 },
-			{ 0.0, 0.0, 0.0, 0.0, 1.0, 0.0 },
-			{ 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 }
-		};
-
-		sprintf(msg1, "\r\n\r\nNeural Network is now training...\r\n");
-		CDC_Fill_Buffer((uint8_t *) msg1, strlen(msg1));
-
-		for (k = 0; k < num_train_data_cycles; k++) {
-
-			i = 0;
-			while (i < training_cycles) {
-				for (j = 0; j < 6; j++) {
-
-
-					if ((i % 20 == 0 && i < 100) || i % 100 == 0) {
-						print("\r\n\r\nTraining Epochs: %d\r\n", i);
-
-						LED_Code_Blink(0);
-
-						net_error = 0;
-						for (m = 0; m < 6; m++) {
-							run_ann(net, training_dataset[m][k]);
-							printOutput_ANN(net, m, &error);
-							if (error == 1) {
-								net_error = 1;
-							}
-						}
-						print("\r\nError State: %i\r\n", net_error);
-						if (net_error == 0) {
-							return;
-						}
+		train_data_cycle = 0;
+		TrainOrientation_Cycle(net, 0);
 
-					}
-
-					train_ann(net, training_dataset[j][k], _Motions[j]);
-
-					i++;
-					HAL_Delay(5);
-				}
-
-			}
-
-		}
+		print("\r\n\r\nNeural Network is now training...\r\n");
+		return 1;
 	}
+	return 0;
+}
 
-	if (SendOverUSB) /* Write data on the USB */
-	{
-		//sprintf( dataOut, "\n\rAX: %d, AY: %d, AZ: %d", (int)acceleration.AXIS_X, (int)acceleration.AXIS_Y, (int)acceleration.AXIS_Z );
-		//CDC_Fill_Buffer(( uint8_t * )dataOut, strlen( dataOut ));
+/*
+ * Runs the network on every recorded exercise; returns 1 if any is misclassified
+ */
+static int EvaluateOrientation(ANN *net) {
+	float eval_output[6][6];
+	int m, r;
+	int error, net_error = 0;
+
+	run_ann_batch(net, &eval_dataset[0][0], 6, &eval_output[0][0]);
+	for (m = 0; m < 6; m++) {
+		for (r = 0; r < 6; r++) {
+			net->output[r] = eval_output[m][r];
+		}
+		printOutput_ANN(net, m, &error);
+		if (error == 1) {
+			net_error = 1;
+		}
 	}
+	print("\r\nError State: %i\r\n", net_error);
+	return net_error;
+}
 
+/*
+ * Signals the result of training on the LED
+ */
+static void TrainOrientation_Complete(int net_error) {
 	if (net_error == 0){
 		LED_Code_Blink(0);
 		LED_Code_Blink(0);
@@ -703,10 +795,37 @@ void TrainOrientation(void *handle, void *handle_g, ANN *net) {
 
 	print("\r\n\r\nTraining Complete, Now Start Classifying Exercises.");
 	print("\r\nDOUBLE TAP to Record an Exercise Motion for Classification.\r\n");
-	return;
 }
 
-int Accel_Gyro_Sensor_Handler(void *handle, void *handle_g, ANN *net, int prev_loc) {
+/*
+ * Trains for at most TRAINING_BUDGET_US and returns 1 once training is over,
+ * either because every exercise is classified or all cycles have been used
+ */
+int TrainOrientation_Step(ANN *net) {
+
+	/* Evaluate every 20 samples up to 100, then every 100 */
+	if ((trainer.done % 20 == 0 && trainer.done < 100) || trainer.done % 100 == 0) {
+		print("\r\n\r\nTraining Epochs: %d\r\n", trainer.done);
+		if (EvaluateOrientation(net) == 0) {
+			TrainOrientation_Complete(0);
+			return 1;
+		}
+	}
+	trainer.checkpoint = (trainer.done < 100) ? 20 : 100;
+
+	if (ann_trainer_step(&trainer, TRAINING_BUDGET_US) < trainer.total) {
+		return 0;
+	}
+	if (++train_data_cycle < num_train_data_cycles) {
+		TrainOrientation_Cycle(net, train_data_cycle);
+		return 0;
+	}
+
+	TrainOrientation_Complete(1);
+	return 1;
+}
+
+int Accel_Gyro_Sensor_Handler(void *handle, void *handle_g, ANN_SWAP *models, int prev_loc) {
 	uint8_t id, id_g;
 	SensorAxes_t acceleration, angular_velocity;
 	uint8_t status, status_g;
@@ -714,6 +833,11 @@ int Accel_Gyro_Sensor_Handler(void *handle, void *handle_g, ANN *net, int prev_l
 	float XYZ[6];
 	float point;
 	int i, loc;
+	ANN *net;
+	float *output;
+#ifdef CASCADE_INFERENCE
+	unsigned int stage;
+#endif
 	uint8_t doubleTap = 0;
 	int features[6];
 
@@ -736,64 +860,134 @@ int Accel_Gyro_Sensor_Handler(void *handle, void *handle_g, ANN *net, int prev_l
 		}
 
 		/*
-		 * Perform limited number of NN execution and prediction cycles.
-		 * Upon return, training will be repeased
+		 * Classify at most one exercise per call so training can run in between;
+		 * the active model is pinned only while it is read
 		 */
+		BSP_LED_Off(LED1);
+		BSP_ACCELERO_Get_Double_Tap_Detection_Status_Ext(LSM6DSM_X_0_handle, &doubleTap);
+		if (doubleTap) { /* Double Tap event */
+			LED_Code_Blink(0);
+			doubleTap = 0;
 
-		//while (i < NUMBER_TEST_CYCLES) {
-		while (1) {
-
-			BSP_LED_Off(LED1);
-			BSP_ACCELERO_Get_Double_Tap_Detection_Status_Ext(LSM6DSM_X_0_handle, &doubleTap);
-			if (doubleTap) { /* Double Tap event */
-				LED_Code_Blink(0);
-				doubleTap = 0;
-
-				Feature_Extraction_State_0(handle, &features);
-				Feature_Extraction_State_1(handle_g, &features);
+			Feature_Extraction_State_0(handle, &features);
+			Feature_Extraction_State_1(handle_g, &features);
 
-				for (i = 0; i < 6; i++) {
-					XYZ[i] = (float) features[i];
-				}
+			for (i = 0; i < 6; i++) {
+				XYZ[i] = (float) features[i];
+			}
 
-				motion_softmax(net->topology[0], XYZ, xyz);
+			net = ann_swap_acquire(models);
+			ann_normalize_input(net, XYZ, xyz);
 
-				print("\r\n Softmax Input: \t");
-				for (i = 0; i < 6; i++) {
-					print("%i\t", (int) XYZ[i]);
-				}
-				print("\r\n Softmax Output: \t");
-				for (i = 0; i < 6; i++) {
-					print("%i\t", (int) (100 * xyz[i]));
-				}
+			print("\r\n Softmax Input: \t");
+			for (i = 0; i < 6; i++) {
+				print("%i\t", (int) XYZ[i]);
+			}
+			print("\r\n Softmax Output: \t");
+			for (i = 0; i < 6; i++) {
+				print("%i\t", (int) (100 * xyz[i]));
+			}
 
-				run_ann(net, xyz);
+#ifdef CASCADE_INFERENCE
+			set_cascade_stage(&cascade, hasFastStage, net, 0.0);
+			stage = run_ann_cascade(&cascade, xyz);
+			output = cascade.output;
+#else
+			run_ann(net, xyz);
+			output = net->output;
+#endif
 
-				point = 0.0;
-				loc = -1;
+			point = 0.0;
+			loc = -1;
 
-				for (i = 0; i < net->topology[net->n_layers - 1]; i++) {
-					if (net->output[i] > point && net->output[i] > 0.1) {
-						point = net->output[i];
-						loc = i;
-					}
+			for (i = 0; i < net->topology[net->n_layers - 1]; i++) {
+				if (output[i] > point && output[i] > 0.1) {
+					point = output[i];
+					loc = i;
 				}
+			}
+			ann_swap_release(models);
+#ifdef CASCADE_INFERENCE
+			if (hasFastStage) {
+				print("\r\n Answered by the %s (first stage %lu, full ANN %lu)", stage ? "full ANN" : "first stage",
+						(unsigned long) cascade.hits[0], (unsigned long) cascade.hits[1]);
+			}
+#endif
 
-				if (loc == -1) {
-					LED_Code_Blink(0);
-				} else {
-					LED_Code_Blink(loc + 1);
-				}
+			if (loc == -1) {
+				LED_Code_Blink(0);
+			} else {
+				LED_Code_Blink(loc + 1);
+			}
 
-				print("\r\n\r\nYou performed Exercise #%i.\n\n", loc + 1);
-				print("\r\nDOUBLE TAP to Record another Exercise Motion for Classification.\r\n");
+			print("\r\n\r\nYou performed Exercise #%i.\n\n", loc + 1);
+#ifdef ONLINE_LEARNING
+			for (i = 0; i < 6; i++) {
+				pending_input[i] = xyz[i];
 			}
+			pending_loc = loc;
+			hasPending = 1;
+			/* Only a key pressed after this classification may confirm or correct it */
+			CDC_Clear_Char();
+			print("\r\nPress ENTER to confirm, or 1-6 to name the exercise performed.");
+#endif
+			print("\r\nDOUBLE TAP to Record another Exercise Motion for Classification.\r\n");
+			prev_loc = loc;
 		}
 	}
 	return prev_loc;
 }
 
 
+#ifdef ONLINE_LEARNING
+/*
+ * Learns from the last classification once it is confirmed (ENTER) or
+ * corrected (1-6) over USB; returns 1 if a refined model was published
+ */
+int OnlineLearning_Step(ANN_SWAP *models) {
+	ANN *shadow;
+	uint8_t key;
+	int label;
+	uint32_t start;
+
+	if (!hasPending) {
+		return 0;
+	}
+	/* Leave the key unread until the shadow is free */
+	shadow = ann_swap_shadow(models);
+	if (!shadow || !CDC_Read_Char(&key)) {
+		return 0;
+	}
+	hasPending = 0;
+
+	if (key >= '1' && key <= '6') {
+		label = key - '1';
+	} else if (key == '\r' || key == '\n') {
+		label = pending_loc;
+	} else {
+		label = -1;
+	}
+	if (label < 0) {
+		return 0;
+	}
+
+	start = Micros();
+	ann_learn_online(shadow, &replay, pending_input, _Motions[label], ONLINE_STEPS, ONLINE_REPLAY);
+	ann_swap_publish(models);
+#ifdef CASCADE_INFERENCE
+	/* A first stage trained on fewer exercises than classes would answer everything */
+	if (replay.count >= 6) {
+		TrainFastStage(&replay_inputs[0][0], &replay_targets[0][0], replay.count);
+	}
+#endif
+	print("\r\nLearned Exercise #%i in %lu us\r\n", label + 1, (unsigned long) (Micros() - start));
+#ifdef PERSIST_MODEL
+	SaveModel(shadow);
+#endif
+	return 1;
+}
+#endif
+
 int main(void) {
 	uint32_t msTick, msTickPrev = 0;
 	uint8_t doubleTap = 0;
@@ -810,6 +1004,10 @@ int main(void) {
 	/* Configure the system clock */
 	SystemClock_Config();
 
+	/* Start the DWT cycle counter behind Micros() */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 	if (SendOverUSB) {
 		/* Initialize LED */
 		BSP_LED_Init(LED1);
@@ -845,6 +1043,11 @@ int main(void) {
 	{
 		DATALOG_SD_Init();
 	}
+#ifdef PERSIST_MODEL
+	if (SendOverUSB) {
+		DATALOG_SD_Init();
+	}
+#endif
 	HAL_Delay(200);
 
 	/* Configure and disable all the Chip Select pins */
@@ -861,7 +1064,7 @@ int main(void) {
 	print("\n\rInstructions: To start recording the next exercise, DOUBLE TAP the device.");
 
 	//---EMBEDDED ANN---
-	float weights[108] = {0.982900, 0.478700, 0.926600, 0.947100, 0.939900,
+	static const float initial_weights[108] = {0.982900, 0.478700, 0.926600, 0.947100, 0.939900,
 	 0.126900, 0.812800, 0.532500, 0.415700, 0.694800,
 	 0.785300, 0.685900, 0.763800, 0.324600, 0.117900,
 	 0.978500, 0.437700, 0.179800, 0.182300, 0.266300,
@@ -882,39 +1085,105 @@ int main(void) {
 	 0.857900, 0.020000, 0.605400, 0.784800, 0.740900,
 	 0.397000, 0.428300, 0.975900, 0.127500, 0.397800,
 	};
-	float dedw[108];
-	float bias[15];
 	unsigned int network_topology[3] = { 6, 9, 6 };
-	float output[6];
 
-	ANN net;
-	net.weights = weights;
-	net.dedw = dedw;
-	net.bias = bias;
-	net.topology = network_topology;
-	net.n_layers = 3;
-	net.n_weights = 108;
-	net.n_bias = 15;
-	net.output = output;
+	/* Weights, bias, optimizer state, gradient and scratch in one block, see ann_required_bytes.
+	 * Sized for ANN_ARENA_ADAM (3135 bytes); momentum alone needs 2143, RMSprop 2655. */
+	static uint8_t ann_arena[3136];
 
-	for (i = 0; i < 15; i++){
-		bias[i] = 0.5;
-	}
-	for (i = 0; i < 6; i++){
-		output[i] = 0.0;
+	ANN net;
+	set_model_parameters(&net, network_topology, 3, 'R');
+	set_model_arena_flags(&net, ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(6));  //Add ANN_ARENA_ADAM or ANN_ARENA_RMSPROP to switch optimizer
+	if (ann_required_bytes(network_topology, 3, net.arena_flags) > sizeof(ann_arena)) {
+		Error_Handler();
 	}
+	ann_init_in_arena(&net, ann_arena);
+
 	for (i = 0; i < 108; i++){
-		dedw[i] = 0.0;
+		net.weights[i] = initial_weights[i];
+	}
+	for (i = 0; i < 15; i++){
+		net.bias[i] = 0.5;
 	}
 
 	//OPTIONS
 	net.eta = 0.13;     //Learning Rate
 	net.beta = 0.01;    //Bias Learning Rate
 	net.alpha = 0.25;   //Momentum Coefficient
-	net.output_activation_function = &relu2;
-	net.hidden_activation_function = &relu2;
+	set_output_actfunc(&net, 'x');  //Softmax, trained with cross-entropy
+	set_hidden_actfunc(&net, 'R');
+	net.input_group = 3;    //Acceleration and angular velocity triplets scaled to unit length
 
 	init_ann(&net);
+
+#ifdef PERSIST_MODEL
+	ANN restored = net;
+	uint32_t model_bytes = DATALOG_SD_Load_Model(model_blob, sizeof(model_blob));
+	if (model_bytes
+			&& ann_load_from_buffer(&restored, model_blob, sizeof(model_blob)) == ANN_MODEL_OK
+			&& restored.n_layers == 3 && restored.topology[0] == 6
+			&& restored.topology[1] == 9 && restored.topology[2] == 6
+			&& (((ANN_MODEL_HEADER *)model_blob)->flags & ANN_MODEL_TRAIN)) {
+		memcpy(net.weights, restored.weights, net.n_weights * sizeof(float));
+		memcpy(net.bias, restored.bias, net.n_bias * sizeof(float));
+		memcpy(net.dedw, restored.dedw, net.n_weights * sizeof(float));
+		memcpy(net.activation, restored.activation, sizeof(net.activation));
+		net.eta = restored.eta;
+		net.beta = restored.beta;
+		net.alpha = restored.alpha;
+		net.input_group = restored.input_group;
+		hasTrained = 1;
+		print("\n\rRestored trained model from SD card");
+	}
+#endif
+
+	/* Classification reads the active copy while training updates the shadow */
+	static ANN_SWAP models;
+	static uint8_t shadow_arena[1024];
+	ANN *trained;
+	ANN shadow = net;
+	set_model_arena_flags(&shadow, ANN_ARENA_BATCH(6));
+	if (ann_required_bytes(network_topology, 3, shadow.arena_flags) > sizeof(shadow_arena)) {
+		Error_Handler();
+	}
+	ann_init_in_arena(&shadow, shadow_arena);
+	ann_swap_init(&models, &net, shadow.weights, shadow.bias, shadow.scratch, shadow.output);
+#ifdef ONLINE_LEARNING
+	ann_replay_init(&replay, &replay_inputs[0][0], &replay_targets[0][0], 6, 6, REPLAY_CAPACITY);
+#endif
+
+#ifdef CASCADE_INFERENCE
+	/* First stage starts from zero weights, the full ANN answers until it is trained */
+	static uint8_t fast_arena[512];
+	unsigned int fast_topology[2] = { 6, 6 };
+	set_model_parameters(&fast_net, fast_topology, 2, 'R');
+	set_model_arena_flags(&fast_net, ANN_ARENA_TRAIN);
+	if (ann_required_bytes(fast_topology, 2, fast_net.arena_flags) > sizeof(fast_arena)) {
+		Error_Handler();
+	}
+	ann_init_in_arena(&fast_net, fast_arena);
+	set_model_hyperparameters(&fast_net, 0.2, 0.2, 0.25);
+	set_output_actfunc(&fast_net, 'x');
+	init_ann(&fast_net);
+#ifdef PERSIST_MODEL
+	/* A first stage saved behind the restored model answers from the start */
+	if (hasTrained) {
+		ANN fast_restored = fast_net;
+		uint32_t fast_offset = (((ANN_MODEL_HEADER *) model_blob)->size + 3) / 4;
+		if (model_bytes > 4 * fast_offset
+				&& ann_load_from_buffer(&fast_restored, &model_blob[fast_offset], model_bytes - 4 * fast_offset) == ANN_MODEL_OK
+				&& fast_restored.n_layers == 2 && fast_restored.topology[0] == 6 && fast_restored.topology[1] == 6
+				&& (((ANN_MODEL_HEADER *) &model_blob[fast_offset])->flags & ANN_MODEL_TRAIN)) {
+			memcpy(fast_net.weights, fast_restored.weights, fast_net.n_weights * sizeof(float));
+			memcpy(fast_net.bias, fast_restored.bias, fast_net.n_bias * sizeof(float));
+			memcpy(fast_net.dedw, fast_restored.dedw, fast_net.n_weights * sizeof(float));
+			set_cascade_stage(&cascade, 0, &fast_net, CASCADE_THRESHOLD);
+			hasFastStage = 1;
+			print("\n\rRestored first stage from SD card");
+		}
+	}
+#endif
+#endif
 	//---------------------
 
 	int loc = -1;
@@ -931,12 +1200,10 @@ int main(void) {
 			//RTC_Handler( &RtcHandle );
 
 			if (hasTrained){
-				loc = Accel_Gyro_Sensor_Handler(LSM6DSM_X_0_handle, LSM6DSM_G_0_handle, &net, loc);
-				/*
-				 * Upon return from Accel_Gyro_Sensor_Handler, initiate retraining.
-				 */
-				hasTrained = 0;
-				print("\n\r\n\DOUBLE TAP to start recording new Two-Motion Exercises");
+				loc = Accel_Gyro_Sensor_Handler(LSM6DSM_X_0_handle, LSM6DSM_G_0_handle, &models, loc);
+#ifdef ONLINE_LEARNING
+				OnlineLearning_Step(&models);
+#endif
 			}
 
 			if (SendOverUSB) {
@@ -945,14 +1212,46 @@ int main(void) {
 
 		}
 
-		/* Check LSM6DSM Double Tap Event  */
-		if (!hasTrained) {
-			TrainOrientation(LSM6DSM_X_0_handle, LSM6DSM_G_0_handle, &net);
-			hasTrained = 1;
+		/* Record new exercises, then train the shadow model one time slice per pass */
+		if (!hasTrained && !isTraining) {
+#ifdef ANN_PROFILE
+			ann_profile_reset();
+#endif
+			isTraining = RecordOrientation(LSM6DSM_X_0_handle, LSM6DSM_G_0_handle, ann_swap_shadow(&models));
+			if (!isTraining) {
+				/* Sensors not ready, keep classifying with the current model */
+				hasTrained = 1;
+			}
+		}
+		if (isTraining) {
+			trained = ann_swap_shadow(&models);
+			if (trained && TrainOrientation_Step(trained)) {
+				ann_swap_publish(&models);
+				isTraining = 0;
+				hasTrained = 1;
+#ifdef ANN_PROFILE
+				printProfile_ANN(trained);
+#endif
+#ifdef ONLINE_LEARNING
+				/* Replay the recorded exercises alongside later corrections */
+				ann_replay_init(&replay, &replay_inputs[0][0], &replay_targets[0][0], 6, 6, REPLAY_CAPACITY);
+				for (i = 0; i < 6; i++) {
+					ann_replay_add(&replay, eval_dataset[i], _Motions[i]);
+				}
+#endif
+#ifdef CASCADE_INFERENCE
+				TrainFastStage(&eval_dataset[0][0], &_Motions[0][0], 6);
+#endif
+#ifdef PERSIST_MODEL
+				SaveModel(trained);
+#endif
+			}
 		}
 
-		/* Go to Sleep */
-		__WFI();
+		/* Go to Sleep, unless training continues on the next pass */
+		if (!isTraining) {
+			__WFI();
+		}
 	}
 }
 
@@ -74,6 +74,10 @@ uint32_t UserTxBufPtrOut = 0; /* Increment this pointer or roll it back to
 volatile uint8_t USB_RxBuffer[USB_RxBufferDim];
 volatile uint16_t USB_RxBufferStart_idx = 0;
 
+/* Last character received over USB, read once by CDC_Read_Char */
+static volatile uint8_t USB_RxChar;
+static volatile uint8_t USB_RxCharPending = 0;
+
 /* TIM handler declaration */
 TIM_HandleTypeDef  TimHandle;
 /* USB handler declaration */
@@ -279,6 +283,11 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
   */
 static int8_t CDC_Itf_Receive(uint8_t* Buf, uint32_t *Len)
 {
+  if (*Len > 0)
+  {
+    USB_RxChar = Buf[*Len - 1];
+    USB_RxCharPending = 1;
+  }
 //  uint16_t numByteToCopy;
 //  if(((USB_RxBufferStart_idx) + (uint16_t)*Len) > USB_RxBufferDim)
 //  {
@@ -302,9 +311,36 @@ static int8_t CDC_Itf_Receive(uint8_t* Buf, uint32_t *Len)
 //  
 //  /* Initiate next USB packet transfer */
 //  USBD_CDC_ReceivePacket(&USBD_Device);
+  USBD_CDC_ReceivePacket(&USBD_Device);
   return (USBD_OK);
 }
 
+/**
+  * @brief  Takes the last character received over USB, if any
+  * @param  c: where to store the character
+  * @retval 1 if a character was pending, 0 otherwise
+  */
+uint8_t CDC_Read_Char(uint8_t *c)
+{
+  if (!USB_RxCharPending)
+  {
+    return 0;
+  }
+  *c = USB_RxChar;
+  USB_RxCharPending = 0;
+  return 1;
+}
+
+/**
+  * @brief  Drops a character received before the caller started waiting for one
+  * @param  None
+  * @retval None
+  */
+void CDC_Clear_Char(void)
+{
+  USB_RxCharPending = 0;
+}
+
 
 /**
   * @brief  TIM_Config: Configure TIMx timer
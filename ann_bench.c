@@ -0,0 +1,1106 @@
+/*
+ * ann_bench.c - Host benchmarks of the EmbeddedML kernels
+ *
+ * Host tool. Times inference and training of embeddedML.c, built unchanged, over a matrix of
+ * topologies, activations and batch sizes, and prints one CSV row per case so runs can be
+ * diffed or plotted to catch kernel regressions before flashing.
+ *
+ * Build:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_bench.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -pthread -o ann_bench
+ *
+ * Usage:
+ *   ann_bench [-m report] [-t topology]... [-a activations] [-n iterations] [-r repeats] [-f model]
+ *             [-d dataset] [-g group]
+ *
+ *   -m  report to print (default matrix):
+ *         matrix   every inference and training variant, columns below
+ *         batch    run_ann called N times against run_ann_batch over N samples, N = 1..32
+ *         gflops   GFLOP/s of the single-accumulator row loop FP_ANN used before the blocked
+ *                  kernels, run_ann, run_ann_batch and train_ann; pass the layer sizes with -t,
+ *                  e.g. -t 64,64 -t 128,128 -t 256,256 -t 300,128,64,10. Building with
+ *                  -DANN_SCALAR_KERNELS gives the library's own scalar reference numbers.
+ *         stack    latency and peak stack of run_ann against the recursive FP_ANN it replaced,
+ *                  which put a VLA of every hidden layer on the stack; run_ann's ping-pong
+ *                  buffers are caller-owned and listed separately
+ *         backprop latency and peak stack of train_ann against the recursive BP_ANN it replaced,
+ *                  whose frames held the layer's gradient matrix, a transposed copy of the next
+ *                  layer's weights and its activations; train_ann's bp_scratch is listed separately
+ *         quant    run_ann_q with per-layer and per-channel scales against run_ann: latency, and
+ *                  largest output error and argmax agreement on held-out inputs (the int8 copy
+ *                  is calibrated on the first 64 samples, as ann_quantize does on its set)
+ *         half     run_ann_h against run_ann: largest output error and argmax agreement on the
+ *                  benchmark inputs, latency, and weight plus bias bytes of the float and fp16 copies
+ *         lut      activate_layer's table sigmoid and tanh (S, T) against the expf/tanhf ones (s, t):
+ *                  ns per neuron over inputs in [-8, 8], and largest error against the exact
+ *                  function; ignores -t and -a
+ *         optimizer  epochs and training wall time until momentum SGD, RMSprop and Adam classify
+ *                  every sample the way printOutput_ANN calls error free, from the same start
+ *                  weights, with a softmax output and -a on the hidden layers. Trains on the -d
+ *                  dataset, or on eight jittered recordings of one random direction per output
+ *                  like the device's training_dataset; -n caps the epochs (default 2000)
+ *         model    blob size and the time of ann_save_to_buffer, ann_load_from_buffer (CRC check and
+ *                  zero-copy pointers) and ann_q_load_from_buffer, against copying the weights
+ *         generated  generate_ann.py's unrolled <name>_run against run_ann on the same model:
+ *                  exact output matches, largest difference and latency. Needs the header
+ *                  compiled in and its blob, e.g.
+ *                    python3 generate_ann.py --topology 6,9,6 --name motion --blob motion.bin
+ *                    gcc ... -DANN_BENCH_GENERATED=motion -include motion_ann.h ann_bench.c ...
+ *                    ann_bench -m generated -f motion.bin
+ *                  or from a trained model, softmax output included:
+ *                    python3 generate_ann.py --model model.bin --name motion
+ *   -t  comma separated layer widths, repeatable (default 6,9,6  36,32,6  300,128,64,10)
+ *   -a  activation letters as in set_model_parameters (default rR)
+ *   -n  iterations per case (default scaled so every case does about 2e7 MACs)
+ *   -r  timed repeats per case, the fastest is reported (default 3)
+ *   -f  model blob for the reports that need a trained model (ann_load_from_buffer)
+ *   -d  dataset, one sample per line: topology[0] inputs then the output-width targets
+ *   -g  L2-normalize the -d inputs in groups of this width first, as ann_normalize_input
+ *
+ * Output columns of the matrix report (the others print their own header):
+ *   topology,activation,variant,batch,iterations,ns_per_op,samples_per_s
+ *
+ *   ns_per_op is per sample: one inference, or one training step for the train_* variants
+ *   (one accumulate_ann for train_batch, with its update_ann spread over the batch).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "ann_host.h"
+
+#define MAX_LAYERS 8
+#define MAX_TOPOLOGIES 8
+#define N_SAMPLES 64
+#define MAX_BATCH 32
+#define TARGET_MACS 2e7
+#define STACK_BYTES (4 << 20)
+#define STACK_PAINT 0xA5
+#define MAX_EPOCHS 2000
+#define N_CYCLES 8
+
+typedef void (*REPORT_FN)(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                          unsigned int iterations, unsigned int repeats);
+
+static const char *model_path;      //-f
+static const char *dataset_path;    //-d
+static unsigned int input_group;    //-g
+
+typedef struct {
+    ANN *net;
+    ANN_Q *qnet;
+    ANN_H *hnet;
+    ANN_S *snet;
+    float *inputs;
+    float *targets;
+    float *outputs;
+    float *ref_a, *ref_b;
+    float *normalized;
+    uint32_t *blob;
+    unsigned int blob_size;
+    unsigned int batch;
+} BENCH;
+
+typedef void (*BENCH_FN)(BENCH *b, unsigned int s);
+
+static volatile float sink;
+
+//Deterministic uniform numbers in [-1, 1) so every run sees the same data
+static float uniform(void){
+    static uint32_t state = 12345;
+    state = state*1664525u + 1013904223u;
+    return (float)(state >> 8)/(float)(1u << 23) - 1.0f;
+}
+
+//-----Cases-----
+//Each case consumes samples s, s+1, ... of the dataset and returns once it has handled b->batch of them
+
+static void bench_run(BENCH *b, unsigned int s){
+    run_ann(b->net, &b->inputs[b->net->topology[0]*s]);
+    sink = b->net->output[0];
+}
+
+//Forward pass as FP_ANN did it before the blocked kernels: one accumulator per row, every MAC
+//waiting on the previous one
+static void reference_forward(ANN *net, float *input, float *a, float *b){
+    unsigned int DIM[2];
+    unsigned int i,k,l;
+    float *weights = net->weights;
+    float *bias = net->bias;
+    float *src = input;
+    float *dst = a;
+    float sum;
+
+    for(l = 1; l < net->n_layers; l++){
+        DIM[0] = net->topology[l];
+        DIM[1] = net->topology[l-1];
+        if(l == net->n_layers - 1) dst = net->output;
+        for(i = 0; i < DIM[0]; i++){
+            sum = 0.0;
+            for(k = 0; k < DIM[1]; k++){
+                sum += weights[(DIM[1]*i)+k]*src[k];
+            }
+            dst[i] = sum + bias[i];
+        }
+        activate_layer(net->activation[l-1], dst, 0, DIM[0]);
+        weights += DIM[0]*DIM[1];
+        bias += DIM[0];
+        src = dst;
+        dst = (dst == a) ? b : a;
+    }
+}
+
+static void bench_reference(BENCH *b, unsigned int s){
+    reference_forward(b->net, &b->inputs[b->net->topology[0]*s], b->ref_a, b->ref_b);
+    sink = b->net->output[0];
+}
+
+//Forward pass as FP_ANN did it before it became iterative: one frame per layer, each with a VLA
+//of that layer's activations (with the per-layer bias offsets fixed since)
+static void recursive_forward(ANN *net, float *input, unsigned int depth, float *weights, float *bias){
+    unsigned int DIM[2] = {net->topology[net->n_layers - depth], net->topology[net->n_layers - depth - 1]};
+    unsigned int i,k;
+
+    if(depth == 1){
+        for(i = 0; i < DIM[0]; i++){
+            net->output[i] = 0.0;
+            for(k = 0; k < DIM[1]; k++){
+                net->output[i] += weights[(DIM[1]*i)+k]*input[k];
+            }
+            net->output[i] = net->output[i] + bias[i];
+        }
+        activate_layer(net->activation[net->n_layers - 2], net->output, 0, DIM[0]);
+        return;
+    }
+    else{
+        float a[DIM[0]];
+        for(i = 0; i < DIM[0]; i++){
+            a[i] = 0.0;
+            for(k = 0; k < DIM[1]; k++){
+                a[i] += weights[(DIM[1]*i)+k]*input[k];
+            }
+            a[i] = a[i] + bias[i];
+        }
+        activate_layer(net->activation[net->n_layers - depth - 1], a, 0, DIM[0]);
+        recursive_forward(net, a, depth-1, &weights[DIM[0]*DIM[1]], &bias[DIM[0]]);
+    }
+}
+
+static void bench_recursive(BENCH *b, unsigned int s){
+    recursive_forward(b->net, &b->inputs[b->net->topology[0]*s], b->net->n_layers - 1, b->net->weights, b->net->bias);
+    sink = b->net->output[0];
+}
+
+//Backprop as BP_ANN did it before the fused kernel: one frame per layer, each with VLAs of the
+//activations, a transposed copy of the next layer's weights and the whole gradient matrix, then a
+//momentum step (with the per-layer bias offsets and the activation table of today)
+static void recursive_backward(ANN *net, float *input, float *output, float *weights, float *velocity, float *bias,
+                               float *delta, unsigned int depth){
+    unsigned int i,j;
+    unsigned int DIM[2] = {net->topology[net->n_layers - depth], net->topology[net->n_layers - depth - 1]};
+    uint8_t activation = net->activation[net->n_layers - depth - 1];
+
+    if(depth == 1){
+        float d[DIM[0]];
+        for(i = 0; i < DIM[0]; i++){
+            net->output[i] = 0.0;
+            for(j = 0; j < DIM[1]; j++){
+                net->output[i] += weights[(DIM[1]*i)+j]*input[j];
+            }
+            net->output[i] = net->output[i] + bias[i];
+        }
+        activate_layer(activation, net->output, d, DIM[0]);
+        for(i = 0; i < DIM[0]; i++){
+            delta[i] = (output[i] - net->output[i])*d[i];
+            bias[i] = bias[i] + delta[i]*net->beta;
+        }
+
+        float dEdW[DIM[0]*DIM[1]];
+        for(i = 0; i < DIM[0]; i++){
+            for(j = 0; j < DIM[1]; j++){
+                dEdW[(DIM[1]*i)+j] = delta[i]*input[j];
+            }
+        }
+        for(i = 0; i < DIM[0]*DIM[1]; i++){
+            velocity[i] = dEdW[i]*net->eta - velocity[i]*net->alpha;
+            weights[i] = weights[i] + velocity[i];
+        }
+        return;
+    }
+    else{
+        float a[DIM[0]];
+        float d[DIM[0]];
+
+        for(i = 0; i < DIM[0]; i++){
+            a[i] = 0.0;
+            for(j = 0; j < DIM[1]; j++){
+                a[i] += weights[(DIM[1]*i)+j]*input[j];
+            }
+            a[i] += bias[i];
+        }
+        activate_layer(activation, a, d, DIM[0]);
+
+        unsigned int DIM1 = net->topology[net->n_layers - depth + 1];
+
+        float prev_delta[DIM1];
+        unsigned int weight_iter = DIM[0] * DIM[1];
+
+        float next_weights_T[DIM[0]*DIM1];
+        unsigned int iter = 0;
+        for(i = 0; i < DIM[0]; i++){
+            for(j = 0; j < DIM1; j++){
+                next_weights_T[iter] = weights[(DIM[0]*j)+i+weight_iter];
+                iter++;
+            }
+        }
+
+        recursive_backward(net, a, output, &weights[weight_iter], &velocity[weight_iter], &bias[DIM[0]], prev_delta,
+                           depth-1);
+
+        for(i = 0; i < DIM[0]; i++){
+            delta[i] = 0;
+            for(j = 0; j < DIM1; j++){
+                delta[i] += next_weights_T[(DIM1*i)+j]*prev_delta[j];
+            }
+            delta[i] = delta[i]*d[i];
+            bias[i] = bias[i] + delta[i]*net->beta;
+        }
+        float dEdW[DIM[0]*DIM[1]];
+        for(i = 0; i < DIM[0]; i++){
+            for(j = 0; j < DIM[1]; j++){
+                dEdW[(DIM[1]*i)+j] = delta[i]*input[j];
+            }
+        }
+        for(i = 0; i < DIM[0]*DIM[1]; i++){
+            velocity[i] = dEdW[i]*net->eta - velocity[i]*net->alpha;
+            weights[i] = weights[i] + velocity[i];
+        }
+    }
+}
+
+static void bench_recursive_train(BENCH *b, unsigned int s){
+    ANN *net = b->net;
+    float delta[net->topology[1]];
+    recursive_backward(net, &b->inputs[net->topology[0]*s], &b->targets[net->topology[net->n_layers-1]*s],
+                       net->weights, net->dedw, net->bias, delta, net->n_layers - 1);
+    sink = net->output[0];
+}
+
+static void bench_save(BENCH *b, unsigned int s){
+    (void)s;
+    sink = (float)ann_save_to_buffer(b->net, b->qnet, b->blob, b->blob_size);
+}
+
+static void bench_load(BENCH *b, unsigned int s){
+    ANN net;
+    (void)s;
+    sink = (float)ann_load_from_buffer(&net, b->blob, b->blob_size);
+}
+
+static void bench_q_load(BENCH *b, unsigned int s){
+    ANN_Q qnet;
+    (void)s;
+    sink = (float)ann_q_load_from_buffer(&qnet, b->blob, b->blob_size);
+}
+
+//What loading cost before the format: the float weights and biases copied into place
+static void bench_copy(BENCH *b, unsigned int s){
+    (void)s;
+    memcpy(b->outputs, b->blob, (b->net->n_weights + b->net->n_bias)*sizeof(float));
+    sink = b->outputs[0];
+}
+
+static void bench_nothing(BENCH *b, unsigned int s){
+    (void)b; (void)s;
+}
+
+#ifdef ANN_BENCH_GENERATED
+//run_ann on a loaded model, with the input normalization the model asks for
+static void bench_run_model(BENCH *b, unsigned int s){
+    unsigned int n_in = b->net->topology[0];
+    float *input = &b->inputs[n_in*s];
+
+    if(b->net->input_group){
+        ann_normalize_input(b->net, input, b->normalized);
+        input = b->normalized;
+    }
+    run_ann(b->net, input);
+    sink = b->net->output[0];
+}
+
+#define GENERATED_RUN_(name) name##_run
+#define GENERATED_RUN(name) GENERATED_RUN_(name)
+
+static void bench_generated(BENCH *b, unsigned int s){
+    GENERATED_RUN(ANN_BENCH_GENERATED)(&b->inputs[b->net->topology[0]*s], b->outputs);
+    sink = b->outputs[0];
+}
+#endif
+
+//b->batch separate run_ann calls, the baseline run_ann_batch replaces
+static void bench_run_each(BENCH *b, unsigned int s){
+    unsigned int i, n_in = b->net->topology[0];
+    for(i = 0; i < b->batch; i++) run_ann(b->net, &b->inputs[n_in*(s + i)]);
+    sink = b->net->output[0];
+}
+
+static void bench_run_batch(BENCH *b, unsigned int s){
+    run_ann_batch(b->net, &b->inputs[b->net->topology[0]*s], b->batch, b->outputs);
+    sink = b->outputs[0];
+}
+
+static void bench_run_q(BENCH *b, unsigned int s){
+    run_ann_q(b->qnet, &b->inputs[b->net->topology[0]*s]);
+    sink = b->qnet->output[0];
+}
+
+static void bench_run_h(BENCH *b, unsigned int s){
+    run_ann_h(b->hnet, &b->inputs[b->net->topology[0]*s]);
+    sink = b->hnet->output[0];
+}
+
+static void bench_run_s(BENCH *b, unsigned int s){
+    run_ann_s(b->snet, &b->inputs[b->net->topology[0]*s]);
+    sink = b->snet->output[0];
+}
+
+static void bench_train(BENCH *b, unsigned int s){
+    unsigned int n_out = b->net->topology[b->net->n_layers - 1];
+    train_ann(b->net, &b->inputs[b->net->topology[0]*s], &b->targets[n_out*s]);
+}
+
+static void bench_train_batch(BENCH *b, unsigned int s){
+    unsigned int n_out = b->net->topology[b->net->n_layers - 1];
+    train_ann_batch(b->net, &b->inputs[b->net->topology[0]*s], &b->targets[n_out*s], b->batch);
+}
+
+//Runs fn over calls*b->batch samples and returns the best ns per sample of repeats
+static double time_samples(BENCH *b, BENCH_FN fn, unsigned int calls, unsigned int repeats){
+    unsigned int c, r, s;
+    double t, best = 0.0;
+
+    //Warm caches and branch predictors
+    for(c = 0, s = 0; c < calls/10 + 1; c++, s = (s + b->batch) % N_SAMPLES) fn(b, s);
+
+    for(r = 0; r < repeats; r++){
+        t = now_ns();
+        for(c = 0, s = 0; c < calls; c++, s = (s + b->batch) % N_SAMPLES) fn(b, s);
+        t = now_ns() - t;
+        if(r == 0 || t < best) best = t;
+    }
+    return best/((double)calls*b->batch);
+}
+
+//Times iterations samples of fn, best of repeats, and prints the CSV row
+static void measure(BENCH *b, const char *topo, char act, const char *variant, BENCH_FN fn,
+                    unsigned int iterations, unsigned int repeats){
+    unsigned int calls = (iterations + b->batch - 1)/b->batch;
+    double ns = time_samples(b, fn, calls, repeats);
+
+    printf("%s,%c,%s,%u,%u,%.1f,%.0f\n", topo, act, variant, b->batch, calls*b->batch, ns, 1e9/ns);
+    fflush(stdout);
+}
+
+typedef struct {
+    BENCH *b;
+    BENCH_FN fn;
+} STACK_CALL;
+
+static void *stack_call(void *arg){
+    STACK_CALL *c = arg;
+    c->fn(c->b, 0);
+    return NULL;
+}
+
+//Bytes of a painted thread stack that one call of fn overwrote, less what an empty call costs
+//(thread start-up and the TLS block glibc keeps at the top of a caller-provided stack)
+static unsigned int stack_bytes(BENCH *b, BENCH_FN fn){
+    STACK_CALL call = {b, fn};
+    unsigned int used[2], i, pass;
+    unsigned char *stack;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if(posix_memalign((void **)&stack, 4096, STACK_BYTES)){
+        fprintf(stderr, "no memory for a %u byte stack\n", STACK_BYTES);
+        exit(1);
+    }
+    for(pass = 0; pass < 2; pass++){
+        call.fn = pass ? fn : bench_nothing;
+        memset(stack, STACK_PAINT, STACK_BYTES);
+        pthread_attr_init(&attr);
+        pthread_attr_setstack(&attr, stack, STACK_BYTES);
+        if(pthread_create(&thread, &attr, stack_call, &call)){
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+        pthread_join(thread, NULL);
+        pthread_attr_destroy(&attr);
+        //The stack grows down, the deepest write is the first unpainted byte from the bottom
+        for(i = 0; i < STACK_BYTES && stack[i] == STACK_PAINT; i++);
+        used[pass] = STACK_BYTES - i;
+    }
+    free(stack);
+    return used[1] - used[0];
+}
+
+//-----Setup-----
+static void random_weights(ANN *net){
+    unsigned int i;
+    for(i = 0; i < net->n_weights; i++) net->weights[i] = 0.5f*uniform();
+    for(i = 0; i < net->n_bias; i++) net->bias[i] = 0.1f*uniform();
+}
+
+//Float net in its own arena with the given ANN_ARENA_* flags
+static ANN *make_net(unsigned int *topology, unsigned int n_layers, char act, unsigned int flags){
+    ANN *net = calloc(1, sizeof(ANN));
+
+    set_model_parameters(net, topology, n_layers, act);
+    set_model_arena_flags(net, flags);
+    ann_init_in_arena(net, malloc(ann_required_bytes(topology, n_layers, flags)));
+    //Small steps keep the weights finite however long a case trains
+    set_model_hyperparameters(net, 0.001, 0.001, 0.25);
+    set_optimizer_parameters(net, 0.9, 0.999, 1e-7);
+    random_weights(net);
+    return net;
+}
+
+//Int8 copy of net calibrated on the benchmark inputs, as ann_quantize does; NULL if a hidden
+//activation has no integer form
+static ANN_Q *make_q(ANN *net, char act, float *inputs, unsigned int per_channel){
+    ANN_Q *qnet = calloc(1, sizeof(ANN_Q));
+    ANN probe;
+    float act_min[MAX_LAYERS] = {0}, act_max[MAX_LAYERS] = {0};
+    unsigned int n_layers = net->n_layers;
+    unsigned int *topology = net->topology;
+    unsigned int l, s, i;
+
+    for(s = 0; s < N_SAMPLES; s++){
+        for(i = 0; i < topology[0]; i++){
+            if(inputs[topology[0]*s + i] < act_min[0]) act_min[0] = inputs[topology[0]*s + i];
+            if(inputs[topology[0]*s + i] > act_max[0]) act_max[0] = inputs[topology[0]*s + i];
+        }
+    }
+    for(l = 1; l < n_layers - 1; l++){
+        probe = *net;
+        probe.n_layers = l + 1;
+        probe.output = calloc(topology[l], sizeof(float));
+        for(s = 0; s < N_SAMPLES; s++){
+            run_ann(&probe, &inputs[topology[0]*s]);
+            for(i = 0; i < topology[l]; i++){
+                if(probe.output[i] < act_min[l]) act_min[l] = probe.output[i];
+                if(probe.output[i] > act_max[l]) act_max[l] = probe.output[i];
+            }
+        }
+        free(probe.output);
+    }
+
+    set_model_q_parameters(qnet, topology, n_layers, act, 0);
+    set_model_q_memory(qnet, calloc(qnet->n_weights, 1), calloc(qnet->n_bias, sizeof(int32_t)),
+                       calloc(qnet->n_bias, sizeof(ANN_Q_SCALE)), calloc(n_layers, sizeof(ANN_Q_SCALE)),
+                       calloc(n_layers, sizeof(float)), calloc(n_layers, sizeof(int32_t)),
+                       NULL, calloc(topology[n_layers-1], sizeof(float)));
+    qnet->scratch = calloc(ann_q_scratch_size(qnet), 1);
+    qnet->per_channel = per_channel;
+    return (quantize_ann(net, qnet, act_min, act_max) == 0) ? qnet : NULL;
+}
+
+static ANN_H *make_h(ANN *net){
+    ANN_H *hnet = calloc(1, sizeof(ANN_H));
+
+    set_model_h_memory(hnet, calloc(net->n_weights, sizeof(uint16_t)), calloc(net->n_bias, sizeof(uint16_t)),
+                       NULL, calloc(net->topology[net->n_layers - 1], sizeof(float)));
+    convert_ann_h(net, hnet);
+    hnet->scratch = calloc(ann_h_scratch_size(hnet), sizeof(float));
+    return hnet;
+}
+
+//CSR copy of a 75% pruned clone of net; net itself stays dense
+static ANN_S *make_s(ANN *net){
+    ANN_S *snet = calloc(1, sizeof(ANN_S));
+    ANN pruned = *net;
+    unsigned int nnz;
+
+    pruned.weights = malloc(net->n_weights*sizeof(float));
+    memcpy(pruned.weights, net->weights, net->n_weights*sizeof(float));
+    prune_ann(&pruned, 0.75);
+    nnz = ann_nnz(&pruned);
+    set_model_s_memory(snet, calloc(nnz + 1, sizeof(float)), calloc(nnz + 1, sizeof(uint16_t)),
+                       calloc(net->n_bias + 1, sizeof(unsigned int)),
+                       calloc(ann_scratch_size(net), sizeof(float)),
+                       calloc(net->topology[net->n_layers - 1], sizeof(float)));
+    sparsify_ann(&pruned, snet);
+    free(pruned.weights);
+    return snet;
+}
+
+//Uniform inputs with one-hot targets cycling through the classes, room for a whole batch past
+//the last sample
+static void make_data(BENCH *b, unsigned int n_in, unsigned int n_out){
+    unsigned int i, s;
+
+    b->inputs = malloc((N_SAMPLES + MAX_BATCH)*n_in*sizeof(float));
+    b->targets = calloc((N_SAMPLES + MAX_BATCH)*n_out, sizeof(float));
+    b->outputs = malloc(MAX_BATCH*n_out*sizeof(float));
+    for(s = 0; s < N_SAMPLES + MAX_BATCH; s++){
+        for(i = 0; i < n_in; i++) b->inputs[n_in*s + i] = uniform();
+        b->targets[n_out*s + s % n_out] = 1.0;
+    }
+}
+
+//Default iteration count, about TARGET_MACS multiply-adds per case
+static unsigned int default_iterations(unsigned int *topology, unsigned int n_layers, char act){
+    ANN shape;
+    set_model_parameters(&shape, topology, n_layers, act);
+    return (unsigned int)(TARGET_MACS/shape.n_weights) + 1;
+}
+
+static unsigned int parse_topology(const char *text, unsigned int *topology){
+    unsigned int n = 0;
+    char *end;
+
+    while(n < MAX_LAYERS){
+        topology[n++] = strtoul(text, &end, 10);
+        if(*end != ',') break;
+        text = end + 1;
+    }
+    return n;
+}
+
+//Runs every variant for one topology and activation
+static void bench_topology(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                           unsigned int iterations, unsigned int repeats){
+    static const unsigned int batches[] = {8, MAX_BATCH};
+    static const struct { const char *variant; unsigned int flags; } trainers[] = {
+        {"train_momentum", 0},
+        {"train_rmsprop", ANN_ARENA_RMSPROP},
+        {"train_adam", ANN_ARENA_ADAM},
+    };
+    unsigned int base = ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(MAX_BATCH);
+    unsigned int i;
+    char variant[32];
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+
+    b.net = make_net(topology, n_layers, act, base);
+    b.qnet = make_q(b.net, act, b.inputs, 0);
+    b.hnet = make_h(b.net);
+    b.snet = make_s(b.net);
+
+    b.batch = 1;
+    measure(&b, name, act, "run_ann", bench_run, iterations, repeats);
+    for(i = 0; i < sizeof(batches)/sizeof(batches[0]); i++){
+        b.batch = batches[i];
+        measure(&b, name, act, "run_ann_batch", bench_run_batch, iterations, repeats);
+    }
+    b.batch = 1;
+    if(b.qnet) measure(&b, name, act, "run_ann_q", bench_run_q, iterations, repeats);
+    measure(&b, name, act, "run_ann_h", bench_run_h, iterations, repeats);
+    measure(&b, name, act, "run_ann_s75", bench_run_s, iterations, repeats);
+
+    //Training last, it changes the weights the inference copies were made from
+    for(i = 0; i < sizeof(trainers)/sizeof(trainers[0]); i++){
+        b.net = make_net(topology, n_layers, act, base | trainers[i].flags);
+        init_pretrained_ann(b.net);
+        b.batch = 1;
+        measure(&b, name, act, trainers[i].variant, bench_train, iterations/4 + 1, repeats);
+        b.batch = 8;
+        sprintf(variant, "%s_batch", trainers[i].variant);
+        measure(&b, name, act, variant, bench_train_batch, iterations/4 + 1, repeats);
+    }
+}
+
+//-----Reports-----
+//Throughput against batch size: N separate run_ann calls, then one run_ann_batch over the same N
+static void report_batch(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                         unsigned int iterations, unsigned int repeats){
+    unsigned int n;
+    double ns_each, ns_batch;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, ANN_ARENA_BATCH(MAX_BATCH));
+
+    for(n = 1; n <= MAX_BATCH; n *= 2){
+        b.batch = n;
+        ns_each = time_samples(&b, bench_run_each, (iterations + n - 1)/n, repeats);
+        ns_batch = time_samples(&b, bench_run_batch, (iterations + n - 1)/n, repeats);
+        printf("%s,%c,%u,%.1f,%.1f,%.0f,%.0f,%.2f\n", name, act, n, ns_each, ns_batch, 1e9/ns_each, 1e9/ns_batch,
+               ns_each/ns_batch);
+        fflush(stdout);
+    }
+}
+
+//Floating point throughput of the forward kernels against the old row loop, and of training. A
+//forward pass is 2 flops per weight; train_ann adds the propagation through every layer but the
+//first and the weight update, 2 flops per weight each.
+static void report_gflops(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                          unsigned int iterations, unsigned int repeats){
+    static const struct { const char *variant; BENCH_FN fn; unsigned int batch; } variants[] = {
+        {"reference_loop", bench_reference, 1},
+        {"run_ann", bench_run, 1},
+        {"run_ann_batch", bench_run_batch, MAX_BATCH},
+        {"train_ann", bench_train, 1},
+    };
+    unsigned int v, flops;
+    unsigned int first = topology[0]*topology[1];
+    double ns;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, ANN_ARENA_TRAIN | ANN_ARENA_BATCH(MAX_BATCH));
+    b.ref_a = calloc(ann_scratch_size(b.net) + 1, sizeof(float));
+    b.ref_b = calloc(ann_scratch_size(b.net) + 1, sizeof(float));
+
+    for(v = 0; v < sizeof(variants)/sizeof(variants[0]); v++){
+        b.batch = variants[v].batch;
+        if(variants[v].fn == bench_train){
+            init_pretrained_ann(b.net);
+            flops = 2*(3*b.net->n_weights - first);
+            ns = time_samples(&b, bench_train, iterations/4 + 1, repeats);
+        }
+        else{
+            flops = 2*b.net->n_weights;
+            ns = time_samples(&b, variants[v].fn, (iterations + b.batch - 1)/b.batch, repeats);
+        }
+        printf("%s,%c,%s,%u,%.1f,%.3f\n", name, act, variants[v].variant, flops, ns, flops/ns);
+        fflush(stdout);
+    }
+}
+
+//Latency and peak stack of one inference, old recursive FP_ANN against run_ann. run_ann's
+//activations live in the caller-owned scratch instead, its size is the last column.
+static void report_stack(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                         unsigned int iterations, unsigned int repeats){
+    static const struct { const char *variant; BENCH_FN fn; } variants[] = {
+        {"recursive_fp_ann", bench_recursive},
+        {"run_ann", bench_run},
+    };
+    unsigned int v;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, 0);
+    b.batch = 1;
+
+    for(v = 0; v < sizeof(variants)/sizeof(variants[0]); v++){
+        printf("%s,%c,%s,%.1f,%u,%u\n", name, act, variants[v].variant,
+               time_samples(&b, variants[v].fn, iterations, repeats), stack_bytes(&b, variants[v].fn),
+               variants[v].fn == bench_run ? (unsigned int)(ann_scratch_size(b.net)*sizeof(float)) : 0);
+        fflush(stdout);
+    }
+}
+
+//Latency and peak stack of one momentum training step, old recursive BP_ANN against train_ann.
+//train_ann's activations, derivatives and deltas live in the caller-owned bp_scratch instead.
+static void report_backprop(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                            unsigned int iterations, unsigned int repeats){
+    static const struct { const char *variant; BENCH_FN fn; } variants[] = {
+        {"recursive_bp_ann", bench_recursive_train},
+        {"train_ann", bench_train},
+    };
+    unsigned int v;
+    double ns[2];
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, ANN_ARENA_TRAIN);
+    b.batch = 1;
+
+    for(v = 0; v < sizeof(variants)/sizeof(variants[0]); v++){
+        init_pretrained_ann(b.net);
+        ns[v] = time_samples(&b, variants[v].fn, iterations/4 + 1, repeats);
+        printf("%s,%c,%s,%.1f,%u,%u,%.2f\n", name, act, variants[v].variant, ns[v], stack_bytes(&b, variants[v].fn),
+               variants[v].fn == bench_train ? (unsigned int)(ann_bp_scratch_size(b.net)*sizeof(float)) : 0,
+               ns[0]/ns[v]);
+        fflush(stdout);
+    }
+}
+
+//Int8 inference against float: throughput, and accuracy on the MAX_BATCH samples past the
+//N_SAMPLES that make_q calibrates on
+static void report_quant(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                         unsigned int iterations, unsigned int repeats){
+    unsigned int n_out = topology[n_layers - 1];
+    unsigned int s, i, agree, per_channel;
+    float *reference;
+    double ns_float, ns_q, e, max_err;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], n_out);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, 0);
+    b.batch = 1;
+
+    reference = malloc(MAX_BATCH*n_out*sizeof(float));
+    for(s = 0; s < MAX_BATCH; s++){
+        run_ann(b.net, &b.inputs[topology[0]*(N_SAMPLES + s)]);
+        memcpy(&reference[n_out*s], b.net->output, n_out*sizeof(float));
+    }
+    ns_float = time_samples(&b, bench_run, iterations, repeats);
+
+    for(per_channel = 0; per_channel < 2; per_channel++){
+        b.qnet = make_q(b.net, act, b.inputs, per_channel);
+        if(!b.qnet){
+            printf("%s,%c,%s,hidden activation has no integer form\n", name, act, per_channel ? "per_channel" : "per_layer");
+            return;
+        }
+        max_err = 0.0;
+        agree = 0;
+        for(s = 0; s < MAX_BATCH; s++){
+            run_ann_q(b.qnet, &b.inputs[topology[0]*(N_SAMPLES + s)]);
+            for(i = 0; i < n_out; i++){
+                e = fabs((double)b.qnet->output[i] - reference[n_out*s + i]);
+                if(e > max_err) max_err = e;
+            }
+            if(argmax(b.qnet->output, n_out) == argmax(&reference[n_out*s], n_out)) agree++;
+        }
+        ns_q = time_samples(&b, bench_run_q, iterations, repeats);
+        printf("%s,%c,%s,%g,%u/%u,%.1f,%.1f,%.2f\n", name, act, per_channel ? "per_channel" : "per_layer",
+               max_err, agree, MAX_BATCH, ns_float, ns_q, ns_float/ns_q);
+        fflush(stdout);
+    }
+    free(reference);
+}
+
+//Half precision inference against float: throughput, and accuracy on the N_SAMPLES inputs (the
+//fp16 copy needs no calibration), with the weight and bias bytes of both
+static void report_half(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                        unsigned int iterations, unsigned int repeats){
+    unsigned int n_out = topology[n_layers - 1];
+    unsigned int s, i, agree = 0;
+    double ns_float, ns_h, e, max_err = 0.0;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], n_out);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, 0);
+    b.hnet = make_h(b.net);
+    b.batch = 1;
+
+    for(s = 0; s < N_SAMPLES; s++){
+        run_ann(b.net, &b.inputs[topology[0]*s]);
+        run_ann_h(b.hnet, &b.inputs[topology[0]*s]);
+        for(i = 0; i < n_out; i++){
+            e = fabs((double)b.hnet->output[i] - b.net->output[i]);
+            if(e > max_err) max_err = e;
+        }
+        if(argmax(b.hnet->output, n_out) == argmax(b.net->output, n_out)) agree++;
+    }
+    ns_float = time_samples(&b, bench_run, iterations, repeats);
+    ns_h = time_samples(&b, bench_run_h, iterations, repeats);
+    printf("%s,%c,%g,%u/%u,%.1f,%.1f,%.2f,%u,%u\n", name, act, max_err, agree, N_SAMPLES, ns_float, ns_h,
+           ns_float/ns_h, (unsigned int)((b.net->n_weights + b.net->n_bias)*sizeof(float)),
+           (unsigned int)((b.net->n_weights + b.net->n_bias)*sizeof(uint16_t)));
+    fflush(stdout);
+}
+
+//Table activations against the libm ones, per neuron, forward only and with the derivative
+static void report_lut(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                       unsigned int iterations, unsigned int repeats){
+    static const struct { const char *function; char act; uint8_t code; } variants[] = {
+        {"sigmoid", 's', ACT_SIGMOID}, {"sigmoid", 'S', ACT_SIGMOID_LUT},
+        {"tanh", 't', ACT_TANH}, {"tanh", 'T', ACT_TANH_LUT},
+    };
+    enum { N = 4096 };
+    static float src[N], x[N], d[N];
+    unsigned int v, i, r, c, calls, with_d;
+    uint8_t code;
+    double t, best, e, exact, max_err;
+
+    (void)name; (void)topology; (void)n_layers; (void)act;
+    calls = iterations ? (iterations + N - 1)/N : 2000;
+    for(v = 0; v < sizeof(variants)/sizeof(variants[0]); v++){
+        code = variants[v].code;
+
+        //Evenly spaced for the error, scattered for the timing so a table walk is not cache friendly
+        max_err = 0.0;
+        for(i = 0; i < N; i++) x[i] = -8.0f + 16.0f*i/(N - 1);
+        activate_layer(code, x, 0, N);
+        for(i = 0; i < N; i++){
+            t = -8.0 + 16.0*i/(N - 1);
+            exact = (code == ACT_SIGMOID || code == ACT_SIGMOID_LUT) ? 1.0/(1.0 + exp(-t)) : tanh(t);
+            e = fabs(x[i] - exact);
+            if(e > max_err) max_err = e;
+        }
+        for(i = 0; i < N; i++) src[i] = -8.0f + 16.0f*((i*2654435761u) % N)/(N - 1);
+
+        for(with_d = 0; with_d < 2; with_d++){
+            best = 0.0;
+            for(r = 0; r < repeats; r++){
+                t = now_ns();
+                for(c = 0; c < calls; c++){
+                    memcpy(x, src, sizeof(x));
+                    activate_layer(code, x, with_d ? d : 0, N);
+                }
+                t = now_ns() - t;
+                if(r == 0 || t < best) best = t;
+            }
+            sink = x[N/3];
+            printf("%s,%c,%s,%.2f,%g\n", variants[v].function, variants[v].act, with_d ? "with_derivative" : "forward",
+                   best/((double)calls*N), max_err);
+            fflush(stdout);
+        }
+    }
+}
+
+//printOutput_ANN's test in main.c: the right output is largest, its z-score against all outputs
+//is at least 1 and it beats the runner-up (among outputs over 0.1) by 5%
+static unsigned int error_free(const float *output, unsigned int n, unsigned int target){
+    unsigned int i, loc = argmax(output, n);
+    float mean = 0.0, rms = 0.0, next = 0.0;
+
+    if(loc != target) return 0;
+    for(i = 0; i < n; i++) mean += output[i];
+    mean /= n;
+    for(i = 0; i < n; i++){
+        rms += (output[i] - mean)*(output[i] - mean);
+        if(i != loc && output[i] > next && output[i] > 0.1f) next = output[i];
+    }
+    rms = sqrtf(rms/(n - 1));
+    return rms > 0.0f && (output[loc] - mean)/rms >= 1.0f && (next == 0.0f || output[loc]/next >= 1.05f);
+}
+
+//Epochs to error free and their training time for every optimizer, from the same start weights
+static void report_optimizer(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                             unsigned int iterations, unsigned int repeats){
+    static const struct { const char *variant; unsigned int flags; float eta, beta; } optimizers[] = {
+        {"momentum", 0, 0.13, 0.01},      //main.c's rates
+        {"rmsprop", ANN_ARENA_RMSPROP, 0.005, 0.005},
+        {"adam", ANN_ARENA_ADAM, 0.01, 0.01},
+    };
+    unsigned int n_in = topology[0], n_out = topology[n_layers - 1];
+    unsigned int max_epochs = iterations ? iterations : MAX_EPOCHS;
+    unsigned int n_samples, o, e, s, i, c, errors;
+    float *inputs, *targets, *start_w, *start_b;
+    double t;
+    ANN *net;
+
+    (void)repeats;
+    if(dataset_path){
+        n_samples = read_dataset(dataset_path, n_in, n_out, &inputs, &targets);
+        if(input_group){
+            net = make_net(topology, n_layers, act, 0);
+            net->input_group = input_group;
+            for(s = 0; s < n_samples; s++) ann_normalize_input(net, &inputs[n_in*s], &inputs[n_in*s]);
+        }
+    }
+    else{
+        //One direction per class, recorded N_CYCLES times with jitter
+        n_samples = n_out*N_CYCLES;
+        inputs = malloc(n_samples*n_in*sizeof(float));
+        targets = calloc(n_samples*n_out, sizeof(float));
+        start_w = malloc(n_in*sizeof(float));
+        for(c = 0; c < n_out; c++){
+            for(i = 0; i < n_in; i++) start_w[i] = uniform();
+            for(s = c*N_CYCLES; s < (c + 1)*N_CYCLES; s++){
+                for(i = 0; i < n_in; i++) inputs[n_in*s + i] = start_w[i] + 0.6f*uniform();
+                targets[n_out*s + c] = 1.0;
+            }
+        }
+        free(start_w);
+    }
+
+    for(o = 0; o < sizeof(optimizers)/sizeof(optimizers[0]); o++){
+        net = make_net(topology, n_layers, act, ANN_ARENA_TRAIN | optimizers[o].flags);
+        set_output_actfunc(net, 'x');
+        set_model_hyperparameters(net, optimizers[o].eta, optimizers[o].beta, 0.25);
+        if(o == 0){
+            start_w = malloc(net->n_weights*sizeof(float));
+            start_b = malloc(net->n_bias*sizeof(float));
+            memcpy(start_w, net->weights, net->n_weights*sizeof(float));
+            memcpy(start_b, net->bias, net->n_bias*sizeof(float));
+        }
+        memcpy(net->weights, start_w, net->n_weights*sizeof(float));
+        memcpy(net->bias, start_b, net->n_bias*sizeof(float));
+        init_pretrained_ann(net);
+
+        t = 0.0;
+        errors = n_samples;
+        for(e = 0; e < max_epochs && errors; e++){
+            t -= now_ns();
+            for(s = 0; s < n_samples; s++) train_ann(net, &inputs[n_in*s], &targets[n_out*s]);
+            t += now_ns();
+            errors = 0;
+            for(s = 0; s < n_samples; s++){
+                run_ann(net, &inputs[n_in*s]);
+                if(!error_free(net->output, n_out, argmax(&targets[n_out*s], n_out))) errors++;
+            }
+        }
+        printf("%s,%c,%s,%g,%u,%s%u,%.2f,%u\n", name, act, optimizers[o].variant, optimizers[o].eta, n_samples,
+               errors ? ">" : "", e, 1e-6*t, errors);
+        fflush(stdout);
+    }
+    free(start_w);
+    free(start_b);
+    free(inputs);
+    free(targets);
+}
+
+//Save and load times of a float model with training state plus its int8 copy
+static void report_model(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                         unsigned int iterations, unsigned int repeats){
+    unsigned int calls;
+    double ns_save, ns_load, ns_q_load, ns_copy;
+    BENCH b;
+
+    memset(&b, 0, sizeof(b));
+    make_data(&b, topology[0], topology[n_layers - 1]);
+    if(!iterations) iterations = default_iterations(topology, n_layers, act);
+    b.net = make_net(topology, n_layers, act, ANN_ARENA_TRAIN);
+    b.qnet = make_q(b.net, act, b.inputs, 0);
+    b.blob_size = ann_model_size(b.net, b.qnet);
+    b.blob = malloc(b.blob_size);
+    free(b.outputs);
+    b.outputs = malloc((b.net->n_weights + b.net->n_bias)*sizeof(float));
+    b.batch = 1;
+    calls = iterations/16 + 1;
+
+    ns_save = time_samples(&b, bench_save, calls, repeats);
+    ns_load = time_samples(&b, bench_load, calls, repeats);
+    ns_q_load = b.qnet ? time_samples(&b, bench_q_load, calls, repeats) : 0.0;
+    ns_copy = time_samples(&b, bench_copy, calls, repeats);
+    printf("%s,%c,%u,%.0f,%.0f,%.0f,%.0f,%.1f\n", name, act, b.blob_size, ns_save, ns_load, ns_q_load, ns_copy,
+           b.blob_size/ns_load*1e3);
+    fflush(stdout);
+}
+
+//Generated forward pass against run_ann on the -f model; topology and activation come from the model
+static void report_generated(const char *name, unsigned int *topology, unsigned int n_layers, char act,
+                             unsigned int iterations, unsigned int repeats){
+#ifdef ANN_BENCH_GENERATED
+    unsigned int i, s, n_out, exact = 0;
+    double ns_run, ns_gen, diff, max_diff = 0.0;
+    char topo[64];
+    ANN net;
+    BENCH b;
+
+    (void)name; (void)topology; (void)n_layers; (void)act;
+    if(!model_path){
+        fprintf(stderr, "-m generated needs the model blob of the generated header (-f)\n");
+        exit(1);
+    }
+    load_model(model_path, &net);
+    n_out = net.topology[net.n_layers - 1];
+    memset(&b, 0, sizeof(b));
+    make_data(&b, net.topology[0], n_out);
+    b.net = &net;
+    b.batch = 1;
+    b.normalized = malloc(net.topology[0]*sizeof(float));
+    if(!iterations) iterations = default_iterations(net.topology, net.n_layers, 'r');
+
+    for(s = 0; s < N_SAMPLES; s++){
+        bench_run_model(&b, s);
+        bench_generated(&b, s);
+        if(!memcmp(b.outputs, net.output, n_out*sizeof(float))) exact++;
+        for(i = 0; i < n_out; i++){
+            diff = fabs((double)b.outputs[i] - net.output[i]);
+            if(diff > max_diff) max_diff = diff;
+        }
+    }
+    ns_run = time_samples(&b, bench_run_model, iterations, repeats);
+    ns_gen = time_samples(&b, bench_generated, iterations, repeats);
+
+    for(i = 0, s = 0; i < net.n_layers && s < sizeof(topo) - 12; i++){
+        s += sprintf(&topo[s], i ? "-%u" : "%u", net.topology[i]);
+    }
+    printf("%s,%u/%u,%g,%.1f,%.1f,%.2f\n", topo, exact, N_SAMPLES, max_diff, ns_run, ns_gen, ns_run/ns_gen);
+#else
+    (void)name; (void)topology; (void)n_layers; (void)act; (void)iterations; (void)repeats;
+    fprintf(stderr, "-m generated needs a build with -DANN_BENCH_GENERATED=<name> -include <name>_ann.h\n");
+    exit(1);
+#endif
+}
+
+static const struct {
+    const char *name;
+    const char *header;
+    REPORT_FN fn;
+    unsigned int once;      //Ignores -t and -a, e.g. works on the -f model
+} reports[] = {
+    {"matrix", "topology,activation,variant,batch,iterations,ns_per_op,samples_per_s", bench_topology, 0},
+    {"batch", "topology,activation,n,ns_per_sample_run_ann,ns_per_sample_batch,samples_per_s_run_ann,"
+              "samples_per_s_batch,speedup", report_batch, 0},
+    {"gflops", "topology,activation,variant,flops_per_sample,ns_per_sample,gflops", report_gflops, 0},
+    {"stack", "topology,activation,variant,ns_per_sample,stack_bytes,buffer_bytes", report_stack, 0},
+    {"backprop", "topology,activation,variant,ns_per_sample,stack_bytes,buffer_bytes,speedup", report_backprop, 0},
+    {"quant", "topology,activation,scales,max_abs_err,argmax_agree,ns_run_ann,ns_run_ann_q,speedup", report_quant, 0},
+    {"half", "topology,activation,max_abs_err,argmax_agree,ns_run_ann,ns_run_ann_h,speedup,float_bytes,"
+             "half_bytes", report_half, 0},
+    {"lut", "function,activation,pass,ns_per_neuron,max_abs_err", report_lut, 1},
+    {"optimizer", "topology,activation,optimizer,eta,samples,epochs,ms_training,errors_left", report_optimizer, 0},
+    {"model", "topology,activation,blob_bytes,ns_save,ns_load,ns_q_load,ns_copy_weights,load_mb_per_s", report_model, 0},
+    {"generated", "topology,exact_outputs,max_abs_diff,ns_run_ann,ns_generated,speedup", report_generated, 1},
+};
+
+int main(int argc, char **argv){
+    const char *names[MAX_TOPOLOGIES] = {"6-9-6", "36-32-6", "300-128-64-10"};
+    unsigned int topologies[MAX_TOPOLOGIES][MAX_LAYERS] = {{6, 9, 6}, {36, 32, 6}, {300, 128, 64, 10}};
+    unsigned int n_layers[MAX_TOPOLOGIES] = {3, 3, 4};
+    unsigned int n_topologies = 3, custom = 0;
+    unsigned int iterations = 0, repeats = 3;
+    const char *acts = "rR";
+    const char *report = "matrix";
+    char *name;
+    unsigned int t, l, r;
+    int i;
+
+    for(i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "-t") && i + 1 < argc && custom < MAX_TOPOLOGIES){
+            n_layers[custom] = parse_topology(argv[++i], topologies[custom]);
+            //Dashed name, as in the default matrix
+            name = malloc(strlen(argv[i]) + 1);
+            strcpy(name, argv[i]);
+            for(l = 0; name[l]; l++) if(name[l] == ',') name[l] = '-';
+            names[custom++] = name;
+            n_topologies = custom;
+        }
+        else if(!strcmp(argv[i], "-m") && i + 1 < argc) report = argv[++i];
+        else if(!strcmp(argv[i], "-a") && i + 1 < argc) acts = argv[++i];
+        else if(!strcmp(argv[i], "-n") && i + 1 < argc) iterations = strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-r") && i + 1 < argc) repeats = strtoul(argv[++i], NULL, 10);
+        else if(!strcmp(argv[i], "-f") && i + 1 < argc) model_path = argv[++i];
+        else if(!strcmp(argv[i], "-d") && i + 1 < argc) dataset_path = argv[++i];
+        else if(!strcmp(argv[i], "-g") && i + 1 < argc) input_group = strtoul(argv[++i], NULL, 10);
+        else{
+            fprintf(stderr, "usage: %s [-m report] [-t topology]... [-a activations] [-n iterations] [-r repeats] "
+                            "[-f model] [-d dataset] [-g group]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(repeats == 0) repeats = 1;
+    for(r = 0; r < sizeof(reports)/sizeof(reports[0]) && strcmp(reports[r].name, report); r++);
+    if(r == sizeof(reports)/sizeof(reports[0])){
+        fprintf(stderr, "unknown report %s\n", report);
+        return 1;
+    }
+
+    printf("%s\n", reports[r].header);
+    if(reports[r].once){
+        reports[r].fn(NULL, NULL, 0, 0, iterations, repeats);
+        return 0;
+    }
+    for(t = 0; t < n_topologies; t++){
+        if(n_layers[t] < 2 || n_layers[t] > ANN_MAX_LAYERS){
+            fprintf(stderr, "%s: need 2 to %d layers\n", names[t], ANN_MAX_LAYERS);
+            return 1;
+        }
+        for(l = 0; acts[l]; l++) reports[r].fn(names[t], topologies[t], n_layers[t], acts[l], iterations, repeats);
+    }
+    return 0;
+}
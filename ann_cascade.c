@@ -0,0 +1,162 @@
+/*
+ * ann_cascade.c - First-stage training and threshold sweep for cascade inference
+ *
+ * Host tool. Trains a single-layer softmax classifier on a recorded dataset as the cheap first
+ * stage in front of a trained full model, then replays the held-out part of the dataset through
+ * run_ann_cascade for every threshold and reports how often the first stage answers, the accuracy
+ * against the labels and the full model, and the average latency against the full model alone.
+ *
+ * Build:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_cascade.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -o ann_cascade
+ *
+ * Usage:
+ *   ann_cascade <model> <dataset> <name> [-t thresholds] [-e epochs] [-l eta] [-v fraction]
+ *
+ *   model        full model blob, e.g. written by ann_train
+ *   dataset      one sample per line: topology[0] inputs then the output-width targets; the
+ *                inputs go through ann_normalize_input with the model's input groups
+ *   name         output prefix, writes the first stage to <name>.bin (ann_load_from_buffer)
+ *   -t           comma separated top-1/top-2 ratios to try (default 1.5,2,3,5,10,20)
+ *   -e / -l      first stage epochs and learning rate (default 20, 0.05)
+ *   -v           fraction of the samples held out for the sweep, spread evenly over the file so
+ *                every class is represented; the first stage never trains on them (default 0.25)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ann_host.h"
+
+#define MAX_THRESHOLDS 16
+
+int main(int argc, char **argv){
+    static unsigned int fast_topology[2];
+    float thresholds[MAX_THRESHOLDS] = {1.5, 2, 3, 5, 10, 20};
+    unsigned int n_thresholds = 6;
+    unsigned int epochs = 20, n_samples, n_in, n_out, s, e, t;
+    unsigned int hits_full, hits_cascade, agree;
+    float eta = 0.05, holdout = 0.25;
+    float *inputs, *targets, *full_labels;
+    float *train_inputs, *train_targets, *eval_inputs, *eval_targets;
+    unsigned int n_train = 0, n_eval = 0;
+    double ns_full, ns_cascade;
+    char *tok;
+    ANN full, fast;
+    ANN_CASCADE cascade;
+    int i;
+
+    if(argc < 4){
+        fprintf(stderr, "usage: %s <model> <dataset> <name> [-t thresholds] [-e epochs] [-l eta] [-v fraction]\n",
+                argv[0]);
+        return 1;
+    }
+    for(i = 4; i < argc; i++){
+        if(!strcmp(argv[i], "-t") && i + 1 < argc){
+            n_thresholds = 0;
+            for(tok = strtok(argv[++i], ","); tok && n_thresholds < MAX_THRESHOLDS; tok = strtok(NULL, ",")){
+                thresholds[n_thresholds++] = strtof(tok, NULL);
+            }
+        }
+        else if(!strcmp(argv[i], "-e") && i + 1 < argc) epochs = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc) eta = strtof(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-v") && i + 1 < argc) holdout = strtof(argv[++i], NULL);
+        else{
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    load_model(argv[1], &full);
+    n_in = full.topology[0];
+    n_out = full.topology[full.n_layers - 1];
+
+    n_samples = read_dataset(argv[2], n_in, n_out, &inputs, &targets);
+    for(s = 0; s < n_samples; s++){
+        //Both stages see the inputs the way the model file says the device prepares them
+        ann_normalize_input(&full, &inputs[n_in*s], &inputs[n_in*s]);
+    }
+
+    //Sample s is held out when the running count of held-out samples steps up at s
+    train_inputs = malloc(n_samples*n_in*sizeof(float));
+    train_targets = malloc(n_samples*n_out*sizeof(float));
+    eval_inputs = malloc(n_samples*n_in*sizeof(float));
+    eval_targets = malloc(n_samples*n_out*sizeof(float));
+    for(s = 0; s < n_samples; s++){
+        if((unsigned int)((s + 1)*holdout) > (unsigned int)(s*holdout)){
+            memcpy(&eval_inputs[n_in*n_eval], &inputs[n_in*s], n_in*sizeof(float));
+            memcpy(&eval_targets[n_out*n_eval++], &targets[n_out*s], n_out*sizeof(float));
+        }
+        else{
+            memcpy(&train_inputs[n_in*n_train], &inputs[n_in*s], n_in*sizeof(float));
+            memcpy(&train_targets[n_out*n_train++], &targets[n_out*s], n_out*sizeof(float));
+        }
+    }
+    if(n_train == 0 || n_eval == 0){
+        fprintf(stderr, "%s: %u samples leave none to %s with -v %g\n", argv[2], n_samples,
+                n_train ? "evaluate" : "train", holdout);
+        return 1;
+    }
+    full_labels = malloc(n_eval*sizeof(float));
+
+    //First stage: one softmax layer straight from the inputs
+    fast_topology[0] = n_in;
+    fast_topology[1] = n_out;
+    memset(&fast, 0, sizeof(fast));
+    set_model_parameters(&fast, fast_topology, 2, 'R');
+    set_output_actfunc(&fast, 'x');
+    fast.input_group = full.input_group;
+    set_model_hyperparameters(&fast, eta, eta, 0.25);
+    fast.weights = calloc(fast.n_weights, sizeof(float));
+    fast.dedw = calloc(fast.n_weights, sizeof(float));
+    fast.bias = calloc(fast.n_bias, sizeof(float));
+    fast.bp_scratch = calloc(ann_bp_scratch_size(&fast) + 1, sizeof(float));
+    fast.output = calloc(n_out, sizeof(float));
+    fast.scratch = calloc(ann_scratch_size(&fast) + 1, sizeof(float));
+    fast.batch_size = 1;
+    init_pretrained_ann(&fast);
+    for(e = 0; e < epochs; e++){
+        for(s = 0; s < n_train; s++) train_ann(&fast, &train_inputs[n_in*s], &train_targets[n_out*s]);
+    }
+
+    //Full model alone, on the held-out samples like every cascade below
+    hits_full = 0;
+    ns_full = now_ns();
+    for(s = 0; s < n_eval; s++){
+        run_ann(&full, &eval_inputs[n_in*s]);
+        full_labels[s] = (float)argmax(full.output, n_out);
+    }
+    ns_full = (now_ns() - ns_full)/n_eval;
+    for(s = 0; s < n_eval; s++){
+        if(full_labels[s] == argmax(&eval_targets[n_out*s], n_out)) hits_full++;
+    }
+
+    printf("samples: %u, first stage trained on %u, evaluated on %u held out\n", n_samples, n_train, n_eval);
+    printf("full model %u parameters, first stage %u parameters\n", full.n_weights + full.n_bias,
+           fast.n_weights + fast.n_bias);
+    printf("threshold,first_stage_rate,accuracy_full,accuracy_cascade,agreement,ns_full,ns_cascade,speedup\n");
+    for(t = 0; t < n_thresholds; t++){
+        memset(&cascade, 0, sizeof(cascade));
+        set_cascade_stage(&cascade, 0, &fast, thresholds[t]);
+        set_cascade_stage(&cascade, 1, &full, 0.0);
+
+        hits_cascade = 0;
+        agree = 0;
+        ns_cascade = now_ns();
+        for(s = 0; s < n_eval; s++) run_ann_cascade(&cascade, &eval_inputs[n_in*s]);
+        ns_cascade = (now_ns() - ns_cascade)/n_eval;
+
+        //Accuracy from a second, untimed pass
+        for(s = 0; s < n_eval; s++){
+            run_ann_cascade(&cascade, &eval_inputs[n_in*s]);
+            if(argmax(cascade.output, n_out) == argmax(&eval_targets[n_out*s], n_out)) hits_cascade++;
+            if(argmax(cascade.output, n_out) == full_labels[s]) agree++;
+        }
+        printf("%g,%.4f,%.4f,%.4f,%.4f,%.1f,%.1f,%.2f\n", thresholds[t], (float)cascade.hits[0]/(2*n_eval),
+               (float)hits_full/n_eval, (float)hits_cascade/n_eval, (float)agree/n_eval,
+               ns_full, ns_cascade, ns_full/ns_cascade);
+    }
+
+    write_blob(argv[3], &fast, NULL);
+    return 0;
+}
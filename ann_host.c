@@ -0,0 +1,133 @@
+/*
+ * ann_host.c - File and timing helpers shared by the EmbeddedML host tools
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ann_host.h"
+
+float *read_floats(const char *path, unsigned int *count){
+    FILE *f = fopen(path, "r");
+    float *v = NULL;
+    unsigned int n = 0, cap = 0;
+    int c;
+    char tok[64];
+    unsigned int len;
+
+    if(!f){ perror(path); exit(1); }
+    while((c = fgetc(f)) != EOF){
+        if(c == '[' || c == '='){
+            //Array sizes and names are not data
+            if(c == '['){ while((c = fgetc(f)) != EOF && c != ']'); }
+            continue;
+        }
+        if(!(c == '-' || c == '+' || c == '.' || (c >= '0' && c <= '9'))) continue;
+        len = 0;
+        do{
+            if(len < sizeof(tok) - 1) tok[len++] = (char)c;
+            c = fgetc(f);
+        } while(c != EOF && (c == '.' || c == 'e' || c == 'E' || c == '-' || c == '+' || (c >= '0' && c <= '9')));
+        tok[len] = 0;
+        if(n == cap){
+            cap = cap ? 2*cap : 256;
+            v = realloc(v, cap*sizeof(float));
+        }
+        v[n++] = strtof(tok, NULL);
+    }
+    fclose(f);
+    *count = n;
+    return v;
+}
+
+unsigned int read_dataset(const char *path, unsigned int n_in, unsigned int n_out, float **inputs, float **targets){
+    unsigned int n_values, n_samples, s;
+    float *data = read_floats(path, &n_values);
+
+    n_samples = n_values/(n_in + n_out);
+    if(n_samples == 0 || n_values % (n_in + n_out)){
+        fprintf(stderr, "%s: %u values is not a whole number of %u-value samples\n", path, n_values, n_in + n_out);
+        exit(1);
+    }
+    *inputs = malloc(n_samples*n_in*sizeof(float));
+    *targets = malloc(n_samples*n_out*sizeof(float));
+    for(s = 0; s < n_samples; s++){
+        memcpy(&(*inputs)[n_in*s], &data[(n_in + n_out)*s], n_in*sizeof(float));
+        memcpy(&(*targets)[n_out*s], &data[(n_in + n_out)*s + n_in], n_out*sizeof(float));
+    }
+    free(data);
+    return n_samples;
+}
+
+void write_floats(const char *name, const char *field, float *v, unsigned int n){
+    char path[256];
+    unsigned int i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s_%s.txt", name, field);
+    f = fopen(path, "w");
+    if(!f){ perror(path); exit(1); }
+    fprintf(f, "float %s[%u] = {", field, n);
+    for(i = 0; i < n; i++) fprintf(f, "%s%.9g", (i % 5) ? ", " : (i ? ",\n    " : "\n    "), v[i]);
+    fprintf(f, "\n};\n");
+    fclose(f);
+}
+
+void write_blob(const char *name, ANN *net, ANN_Q *qnet){
+    char path[256];
+    unsigned int size = ann_model_size(net, qnet);
+    uint32_t *blob = calloc(size/sizeof(uint32_t), sizeof(uint32_t));
+    FILE *f;
+
+    ann_save_to_buffer(net, qnet, blob, size);
+    snprintf(path, sizeof(path), "%s.bin", name);
+    f = fopen(path, "wb");
+    if(!f || fwrite(blob, 1, size, f) != size){ perror(path); exit(1); }
+    fclose(f);
+    free(blob);
+}
+
+uint32_t *read_blob(const char *path, unsigned int *size){
+    FILE *f = fopen(path, "rb");
+    uint32_t *blob;
+    long n;
+
+    if(!f){ perror(path); exit(1); }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    rewind(f);
+    blob = malloc(n + sizeof(uint32_t));
+    if(fread(blob, 1, n, f) != (size_t)n){ perror(path); exit(1); }
+    fclose(f);
+    *size = (unsigned int)n;
+    return blob;
+}
+
+void load_model(const char *path, ANN *net){
+    unsigned int size;
+    uint32_t *blob = read_blob(path, &size);
+    int err;
+
+    memset(net, 0, sizeof(*net));
+    err = ann_load_from_buffer(net, blob, size);
+    if(err != ANN_MODEL_OK){
+        fprintf(stderr, "%s: not a float model (error %d)\n", path, err);
+        exit(1);
+    }
+    net->output = calloc(net->topology[net->n_layers - 1], sizeof(float));
+    net->scratch = calloc(ann_scratch_size(net) + 1, sizeof(float));
+    net->batch_size = 1;
+}
+
+unsigned int argmax(const float *v, unsigned int n){
+    unsigned int i, best = 0;
+    for(i = 1; i < n; i++) if(v[i] > v[best]) best = i;
+    return best;
+}
+
+double now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1e9 + t.tv_nsec;
+}
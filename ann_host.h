@@ -0,0 +1,39 @@
+/*
+ * ann_host.h - File and timing helpers shared by the EmbeddedML host tools
+ *
+ * Host only, built next to each tool:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src <tool>.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -o <tool>
+ *
+ * Every helper prints the path and exits on an I/O or format error, as the tools did before.
+ */
+
+#ifndef ANN_HOST_H
+#define ANN_HOST_H
+
+#include "embeddedML.h"
+
+//Every number in a text file, skipping C declaration text such as "float weights[108] = {"
+float *read_floats(const char *path, unsigned int *count);
+
+//Splits a dataset of one sample per line, n_in inputs then n_out targets, and returns the sample count
+unsigned int read_dataset(const char *path, unsigned int n_in, unsigned int n_out, float **inputs, float **targets);
+
+//Writes "float <field>[n] = {...};" to <name>_<field>.txt
+void write_floats(const char *name, const char *field, float *v, unsigned int n);
+
+//Saves net and/or qnet with ann_save_to_buffer to <name>.bin
+void write_blob(const char *name, ANN *net, ANN_Q *qnet);
+
+//Whole file in a malloc'd, word aligned buffer
+uint32_t *read_blob(const char *path, unsigned int *size);
+
+//Float model blob loaded with ann_load_from_buffer, plus the output and scratch run_ann needs
+void load_model(const char *path, ANN *net);
+
+unsigned int argmax(const float *v, unsigned int n);
+
+//CLOCK_MONOTONIC in nanoseconds
+double now_ns(void);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * ann_prune.c - Magnitude pruning of an EmbeddedML ANN
+ *
+ * Host tool. Reads a trained float model blob, zeroes the smallest weights of every layer with
+ * prune_ann, compares run_ann_s on the pruned CSR net against the dense net on an evaluation set
+ * and writes the pruned model plus a C header with the CSR arrays. The per-layer activation
+ * table, softmax output included, and the input groups come from the model.
+ *
+ * Before writing, a sweep over 50, 75 and 90% sparsity prints one CSV row per level:
+ *   sparsity,pruned,max_abs_err,argmax_agree,ns_dense,ns_csr,speedup,csr_bytes
+ * ns_dense and ns_csr are per evaluation vector, the fastest of three timed passes.
+ *
+ * Build:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_prune.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -o ann_prune
+ *
+ * Usage:
+ *   ann_prune <model> <evaluation> <sparsity> <name>
+ *
+ *   model        float model blob, e.g. written by ann_train or generate_ann.py --blob
+ *   evaluation   one raw feature vector per line; the inputs go through ann_normalize_input
+ *                with the model's input groups
+ *   sparsity     fraction of each layer's weights to remove, e.g. 0.75
+ *   name         output prefix, writes <name>.bin (ann_load_from_buffer), <name>_weights.txt
+ *                and <name>.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ann_host.h"
+
+#define TARGET_MACS 2e7
+#define REPEATS 3
+
+static const float sweep[] = {0.5, 0.75, 0.9};
+
+//ns per vector of run_ann (snet NULL) or run_ann_s over the evaluation set, fastest of REPEATS
+static double time_eval(ANN *net, ANN_S *snet, float *eval, unsigned int n_eval){
+    unsigned int n_in = net->topology[0];
+    unsigned int passes = (unsigned int)(TARGET_MACS/((double)n_eval*net->n_weights)) + 1;
+    unsigned int r, p, s;
+    double t, best = 0.0;
+
+    for(r = 0; r < REPEATS; r++){
+        t = now_ns();
+        for(p = 0; p < passes; p++){
+            for(s = 0; s < n_eval; s++){
+                if(snet) run_ann_s(snet, &eval[n_in*s]);
+                else run_ann(net, &eval[n_in*s]);
+            }
+        }
+        t = (now_ns() - t)/((double)passes*n_eval);
+        if(r == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+//Largest output difference of run_ann_s against the dense outputs, and the argmax agreement count
+static float compare(ANN_S *snet, float *eval, unsigned int n_eval, float *dense, unsigned int *agree){
+    unsigned int n_in = snet->topology[0];
+    unsigned int n_out = snet->topology[snet->n_layers-1];
+    unsigned int s, i;
+    float e, max_err = 0.0;
+
+    *agree = 0;
+    for(s = 0; s < n_eval; s++){
+        run_ann_s(snet, &eval[n_in*s]);
+        for(i = 0; i < n_out; i++){
+            e = fabsf(snet->output[i] - dense[n_out*s + i]);
+            if(e > max_err) max_err = e;
+        }
+        if(argmax(snet->output, n_out) == argmax(&dense[n_out*s], n_out)) (*agree)++;
+    }
+    return max_err;
+}
+
+static unsigned int csr_bytes(ANN_S *snet){
+    return (unsigned int)(snet->nnz*(sizeof(float) + sizeof(uint16_t)) + (snet->n_bias + 1)*sizeof(unsigned int));
+}
+
+static void write_header(const char *name, ANN_S *s){
+    char path[256];
+    unsigned int i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.h", name);
+    f = fopen(path, "w");
+    if(!f){ perror(path); exit(1); }
+
+    fprintf(f, "/* Generated by ann_prune, do not edit */\n\n");
+    fprintf(f, "#ifndef %s_SPARSE_H\n#define %s_SPARSE_H\n\n", name, name);
+    fprintf(f, "#include \"embeddedML.h\"\n\n");
+    fprintf(f, "#define %s_NNZ %u\n\n", name, s->nnz);
+    fprintf(f, "const uint8_t %s_activation[%u] = {", name, s->n_layers - 1);
+    for(i = 0; i < s->n_layers - 1; i++) fprintf(f, "%s%u", i ? ", " : "", s->activation[i]);
+    fprintf(f, "};\n\n");
+    fprintf(f, "float %s_values[%u] = {", name, s->nnz);
+    for(i = 0; i < s->nnz; i++) fprintf(f, "%s%.9g", (i % 6) ? ", " : (i ? ",\n    " : "\n    "), s->values[i]);
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "uint16_t %s_col_index[%u] = {", name, s->nnz);
+    for(i = 0; i < s->nnz; i++) fprintf(f, "%s%u", (i % 16) ? ", " : (i ? ",\n    " : "\n    "), s->col_index[i]);
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "unsigned int %s_row_start[%u] = {", name, s->n_bias + 1);
+    for(i = 0; i <= s->n_bias; i++) fprintf(f, "%s%u", (i % 16) ? ", " : (i ? ",\n    " : "\n    "), s->row_start[i]);
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "#endif\n");
+    fclose(f);
+}
+
+int main(int argc, char **argv){
+    unsigned int n_eval, n_in, n_out;
+    unsigned int i, s, zeros, agree;
+    float *eval, *dense;
+    float sparsity, max_err;
+    double ns_dense, ns_csr;
+    ANN net, pruned;
+    ANN_S snet;
+
+    if(argc < 5){
+        fprintf(stderr, "usage: %s <model> <evaluation> <sparsity> <name>\n", argv[0]);
+        return 1;
+    }
+    sparsity = strtof(argv[3], NULL);
+
+    load_model(argv[1], &net);
+    n_in = net.topology[0];
+    n_out = net.topology[net.n_layers-1];
+
+    eval = read_floats(argv[2], &n_eval);
+    if(n_eval % n_in){
+        fprintf(stderr, "%s: %u values is not a whole number of %u-input vectors\n", argv[2], n_eval, n_in);
+        return 1;
+    }
+    n_eval /= n_in;
+    if(n_eval == 0){
+        fprintf(stderr, "%s: no evaluation vectors\n", argv[2]);
+        return 1;
+    }
+    for(s = 0; s < n_eval; s++) ann_normalize_input(&net, &eval[n_in*s], &eval[n_in*s]);
+
+    //Dense reference outputs before pruning
+    dense = calloc(n_eval*n_out, sizeof(float));
+    for(s = 0; s < n_eval; s++){
+        run_ann(&net, &eval[n_in*s]);
+        memcpy(&dense[n_out*s], net.output, n_out*sizeof(float));
+    }
+    ns_dense = time_eval(&net, NULL, eval, n_eval);
+
+    //CSR arrays sized for a net with nothing pruned, reused by every level
+    memset(&snet, 0, sizeof(snet));
+    set_model_s_memory(&snet, calloc(net.n_weights + 1, sizeof(float)), calloc(net.n_weights + 1, sizeof(uint16_t)),
+                       calloc(net.n_bias + 1, sizeof(unsigned int)), net.scratch, calloc(n_out, sizeof(float)));
+
+    //Sweep on a copy of the weights, the dense net stays intact for the requested level
+    pruned = net;
+    pruned.weights = malloc(net.n_weights*sizeof(float));
+    printf("sparsity,pruned,max_abs_err,argmax_agree,ns_dense,ns_csr,speedup,csr_bytes\n");
+    for(i = 0; i < sizeof(sweep)/sizeof(sweep[0]); i++){
+        memcpy(pruned.weights, net.weights, net.n_weights*sizeof(float));
+        zeros = prune_ann(&pruned, sweep[i]);
+        sparsify_ann(&pruned, &snet);
+        max_err = compare(&snet, eval, n_eval, dense, &agree);
+        ns_csr = time_eval(&net, &snet, eval, n_eval);
+        printf("%.2f,%u/%u,%g,%u/%u,%.1f,%.1f,%.2f,%u\n", sweep[i], zeros, net.n_weights, max_err, agree, n_eval,
+               ns_dense, ns_csr, ns_dense/ns_csr, csr_bytes(&snet));
+    }
+    printf("\n");
+    free(pruned.weights);
+
+    zeros = prune_ann(&net, sparsity);
+    sparsify_ann(&net, &snet);
+    max_err = compare(&snet, eval, n_eval, dense, &agree);
+
+    printf("evaluation vectors: %u\n", n_eval);
+    printf("pruned weights: %u of %u (%.1f%%)\n", zeros, net.n_weights, 100.0*zeros/net.n_weights);
+    printf("max output error: %f\n", max_err);
+    printf("argmax agreement: %u/%u\n", agree, n_eval);
+    printf("weight bytes: dense %u, csr %u\n", (unsigned int)(net.n_weights*sizeof(float)), csr_bytes(&snet));
+
+    write_blob(argv[4], &net, NULL);
+    write_floats(argv[4], "weights", net.weights, net.n_weights);
+    write_header(argv[4], &snet);
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * ann_quantize.c - Post-training int8 quantization of an EmbeddedML ANN
+ *
+ * Host tool. Reads a trained float model blob and a calibration set, measures the activation
+ * range of every layer with run_ann, quantizes with quantize_ann and writes a model blob plus a
+ * C header for the device. The model's per-layer activation table carries over: hidden layers
+ * need an integer form (r, R, l, L), the output layer may use any activation, softmax included.
+ *
+ * Build:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_quantize.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -o ann_quantize
+ *
+ * Usage:
+ *   ann_quantize <model> <calibration> <name> [-l|-c]
+ *
+ *   model        float model blob, e.g. written by ann_train or generate_ann.py --blob
+ *   calibration  one raw feature vector per line; the inputs go through ann_normalize_input with
+ *                the model's input groups, which the device applies before run_ann_q as well
+ *   name         output prefix, writes <name>.bin (ann_q_load_from_buffer) and <name>.h
+ *   -l / -c      force per-layer / per-channel weight scales (default: lower error wins)
+ *
+ * The blob is the EmbeddedML model format (see ANN_MODEL_HEADER) with only the quantized section.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ann_host.h"
+
+#define MAX_LAYERS 8
+
+//Quantizes with the given weight granularity and returns the max abs output error against run_ann
+static float quantize_and_measure(ANN *net, ANN_Q *qnet, unsigned int per_channel, float *act_min, float *act_max,
+                                  float *calib, unsigned int n_calib, float *max_err){
+    unsigned int s, i;
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    float worst = 0.0, e;
+
+    qnet->per_channel = per_channel;
+    quantize_ann(net, qnet, act_min, act_max);
+
+    for(i = 0; i < n_out; i++) max_err[i] = 0.0;
+    for(s = 0; s < n_calib; s++){
+        run_ann(net, &calib[n_in*s]);
+        run_ann_q(qnet, &calib[n_in*s]);
+        for(i = 0; i < n_out; i++){
+            e = fabsf(net->output[i] - qnet->output[i]);
+            if(e > max_err[i]) max_err[i] = e;
+            if(e > worst) worst = e;
+        }
+    }
+    return worst;
+}
+
+static void write_array_i8(FILE *f, const char *name, const char *field, int8_t *v, unsigned int n){
+    unsigned int i;
+    fprintf(f, "static const int8_t %s_%s[%u] = {", name, field, n);
+    for(i = 0; i < n; i++) fprintf(f, "%s%d", (i % 16) ? ", " : (i ? ",\n    " : "\n    "), v[i]);
+    fprintf(f, "\n};\n\n");
+}
+
+static void write_array_i32(FILE *f, const char *name, const char *field, int32_t *v, unsigned int n){
+    unsigned int i;
+    fprintf(f, "static const int32_t %s_%s[%u] = {", name, field, n);
+    for(i = 0; i < n; i++) fprintf(f, "%s%ld", (i % 8) ? ", " : (i ? ",\n    " : "\n    "), (long)v[i]);
+    fprintf(f, "\n};\n\n");
+}
+
+static void write_array_scale(FILE *f, const char *name, const char *field, ANN_Q_SCALE *v, unsigned int n){
+    unsigned int i;
+    fprintf(f, "static const ANN_Q_SCALE %s_%s[%u] = {", name, field, n);
+    for(i = 0; i < n; i++) fprintf(f, "%s{%ld, %ld}", (i % 4) ? ", " : (i ? ",\n    " : "\n    "), (long)v[i].mult, (long)v[i].shift);
+    fprintf(f, "\n};\n\n");
+}
+
+static void write_header(const char *name, ANN_Q *q, unsigned int n_acc){
+    char path[256];
+    unsigned int i;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s.h", name);
+    f = fopen(path, "w");
+    if(!f){ perror(path); exit(1); }
+
+    fprintf(f, "/* Generated by ann_quantize, do not edit */\n\n");
+    fprintf(f, "#ifndef %s_QUANTIZED_H\n#define %s_QUANTIZED_H\n\n", name, name);
+    fprintf(f, "#include \"embeddedML.h\"\n\n");
+    fprintf(f, "#define %s_N_LAYERS %u\n", name, q->n_layers);
+    fprintf(f, "#define %s_PER_CHANNEL %u\n\n", name, q->per_channel);
+    fprintf(f, "/* ANN_Q takes the tables through casts, e.g.\n");
+    fprintf(f, " *   set_model_q_parameters(&q, (unsigned int *)%s_topology, %s_N_LAYERS, 'r', %s_PER_CHANNEL);\n",
+            name, name, name);
+    fprintf(f, " *   memcpy(q.activation, %s_activation, sizeof(%s_activation));\n", name, name);
+    fprintf(f, " *   set_model_q_memory(&q, (int8_t *)%s_weights, (int32_t *)%s_bias, (ANN_Q_SCALE *)%s_acc_scale,\n",
+            name, name, name);
+    fprintf(f, " *                      (ANN_Q_SCALE *)%s_act_requant, (float *)%s_act_scale,\n", name, name);
+    fprintf(f, " *                      (int32_t *)%s_act_zero_point, scratch, output);\n */\n\n", name);
+    fprintf(f, "static const unsigned int %s_topology[%u] = {", name, q->n_layers);
+    for(i = 0; i < q->n_layers; i++) fprintf(f, "%s%u", i ? ", " : "", q->topology[i]);
+    fprintf(f, "};\n\n");
+    fprintf(f, "static const uint8_t %s_activation[%u] = {", name, q->n_layers - 1);
+    for(i = 0; i < q->n_layers - 1; i++) fprintf(f, "%s%u", i ? ", " : "", q->activation[i]);
+    fprintf(f, "};\n\n");
+    //The output layer is dequantized, so only the input and hidden layers have a scale
+    fprintf(f, "static const float %s_act_scale[%u] = {", name, q->n_layers - 1);
+    for(i = 0; i < q->n_layers - 1; i++) fprintf(f, "%s%.9g", i ? ", " : "", q->act_scale[i]);
+    fprintf(f, "};\n\n");
+    write_array_i32(f, name, "act_zero_point", q->act_zero_point, q->n_layers);
+    write_array_scale(f, name, "act_requant", q->act_requant, q->n_layers);
+    write_array_scale(f, name, "acc_scale", q->acc_scale, n_acc);
+    write_array_i32(f, name, "bias", q->bias, q->n_bias);
+    write_array_i8(f, name, "weights", q->weights, q->n_weights);
+    fprintf(f, "#endif\n");
+    fclose(f);
+}
+
+int main(int argc, char **argv){
+    unsigned int n_calib, n_acc, n_layers;
+    unsigned int *topology;
+    unsigned int i, l, s;
+    int force = 0;
+    float *calib;
+    float act_min[MAX_LAYERS], act_max[MAX_LAYERS];
+    float err_layer, err_channel;
+    ANN net, probe;
+    ANN_Q qnet;
+
+    if(argc < 4){
+        fprintf(stderr, "usage: %s <model> <calibration> <name> [-l|-c]\n", argv[0]);
+        return 1;
+    }
+    if(argc > 4) force = argv[4][1];
+
+    load_model(argv[1], &net);
+    topology = net.topology;
+    n_layers = net.n_layers;
+
+    calib = read_floats(argv[2], &n_calib);
+    if(n_calib % topology[0]){
+        fprintf(stderr, "%s: %u values is not a whole number of %u-input vectors\n", argv[2], n_calib, topology[0]);
+        return 1;
+    }
+    n_calib /= topology[0];
+    if(n_calib == 0){
+        fprintf(stderr, "%s: no calibration vectors\n", argv[2]);
+        return 1;
+    }
+    for(s = 0; s < n_calib; s++) ann_normalize_input(&net, &calib[topology[0]*s], &calib[topology[0]*s]);
+
+    //quantize_ann refuses these too; say which layer before doing any work
+    for(l = 1; l < n_layers - 1; l++){
+        if(net.activation[l-1] != ACT_RELU && net.activation[l-1] != ACT_RELU2 &&
+           net.activation[l-1] != ACT_LINEAR && net.activation[l-1] != ACT_LEAKY_RELU){
+            fprintf(stderr, "%s: hidden layer %u activation (ACT_* %u) has no integer form, use r, R, l or L\n",
+                    argv[1], l, net.activation[l-1]);
+            return 1;
+        }
+    }
+
+    //Range of every hidden layer, observed by running the net truncated after that layer
+    //(the activation table is per layer, so the truncated output keeps the hidden activation)
+    for(l = 0; l < n_layers - 1; l++){
+        act_min[l] = 0.0;
+        act_max[l] = 0.0;
+    }
+    for(s = 0; s < n_calib; s++){
+        for(i = 0; i < topology[0]; i++){
+            if(calib[topology[0]*s + i] < act_min[0]) act_min[0] = calib[topology[0]*s + i];
+            if(calib[topology[0]*s + i] > act_max[0]) act_max[0] = calib[topology[0]*s + i];
+        }
+    }
+    for(l = 1; l < n_layers - 1; l++){
+        probe = net;
+        probe.n_layers = l + 1;
+        probe.output = calloc(topology[l], sizeof(float));
+        for(s = 0; s < n_calib; s++){
+            run_ann(&probe, &calib[topology[0]*s]);
+            for(i = 0; i < topology[l]; i++){
+                if(probe.output[i] < act_min[l]) act_min[l] = probe.output[i];
+                if(probe.output[i] > act_max[l]) act_max[l] = probe.output[i];
+            }
+        }
+        free(probe.output);
+    }
+
+    memset(&qnet, 0, sizeof(qnet));
+    set_model_q_parameters(&qnet, topology, n_layers, 'r', 0);
+    set_model_q_memory(&qnet, calloc(qnet.n_weights, 1), calloc(qnet.n_bias, sizeof(int32_t)),
+                       calloc(qnet.n_bias, sizeof(ANN_Q_SCALE)), calloc(n_layers, sizeof(ANN_Q_SCALE)),
+                       calloc(n_layers, sizeof(float)), calloc(n_layers, sizeof(int32_t)),
+                       NULL, calloc(topology[n_layers-1], sizeof(float)));
+    qnet.scratch = calloc(ann_q_scratch_size(&qnet), 1);
+
+    float max_err[topology[n_layers-1]];
+    err_layer = quantize_and_measure(&net, &qnet, 0, act_min, act_max, calib, n_calib, max_err);
+    err_channel = quantize_and_measure(&net, &qnet, 1, act_min, act_max, calib, n_calib, max_err);
+
+    printf("calibration vectors: %u\n", n_calib);
+    if(net.input_group) printf("inputs L2-normalized in groups of %u, as the device must before run_ann_q\n", net.input_group);
+    for(l = 0; l < n_layers - 1; l++) printf("layer %u range: [%f, %f]\n", l, act_min[l], act_max[l]);
+    printf("max error per-layer: %f\n", err_layer);
+    printf("max error per-channel: %f\n", err_channel);
+
+    if(force == 'l' || (force != 'c' && err_layer < err_channel)){
+        quantize_and_measure(&net, &qnet, 0, act_min, act_max, calib, n_calib, max_err);
+    }
+    n_acc = qnet.per_channel ? qnet.n_bias : n_layers - 1;
+
+    printf("using %s scales\n", qnet.per_channel ? "per-channel" : "per-layer");
+    for(i = 0; i < topology[n_layers-1]; i++) printf("output %u max error: %f\n", i, max_err[i]);
+    printf("model bytes: float %u, int8 %u\n",
+           (unsigned int)((net.n_weights + qnet.n_bias)*sizeof(float)),
+           (unsigned int)(qnet.n_weights + qnet.n_bias*sizeof(int32_t) + n_acc*sizeof(ANN_Q_SCALE)));
+
+    write_blob(argv[3], NULL, &qnet);
+    write_header(argv[3], &qnet, n_acc);
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * ann_sd_test.c - Host test of the trained model's SD card round trip
+ *
+ * Host tool. Formats a RAM disk with the device's FatFs, saves a trained ANN to EMLMODEL.BIN with
+ * the calls DATALOG_SD_Save_Model makes, remounts as after a reset, reads it back in one f_read
+ * as DATALOG_SD_Load_Model does and restores it the way main() does, the cascade's first stage
+ * packed behind it as SaveModel does. Prints one line per check; the exit status is 1 if any failed.
+ *
+ * Build (FatFs from Middlewares with the device's Inc/ffconf.h minus its HAL includes):
+ *   A=STile_M_Pattern/Projects/SensorTile/Applications/DataLog F=STile_M_Pattern/Middlewares/Third_Party/FatFs/src
+ *   mkdir -p ffhost && grep -v '^#include' $A/Inc/ffconf.h > ffhost/ffconf.h
+ *   gcc -O2 -Iffhost -I$F -I$A/Src -include stdint.h -D__IO=volatile '-D__weak=__attribute__((weak))' \
+ *       ann_sd_test.c $F/ff.c $F/diskio.c $F/ff_gen_drv.c $F/option/syscall.c $F/option/unicode.c \
+ *       $A/Src/embeddedML.c -lm -o ann_sd_test
+ *
+ * Usage:
+ *   ann_sd_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ff_gen_drv.h"
+#include "embeddedML.h"
+
+#define MODEL_FILE_NAME "EMLMODEL.BIN"
+#define RAMDISK_SECTORS 4096        //2 MB, a FAT12/16 volume like a small card's
+#define SECTOR_SIZE 512
+
+//-----RAM Disk-----
+//A Diskio_drvTypeDef over one array, linked in place of sd_diskio's SD_Driver
+static uint8_t ramdisk[RAMDISK_SECTORS*SECTOR_SIZE];
+static unsigned int sector_reads, sector_writes;
+
+static DSTATUS ram_initialize(BYTE lun){
+    (void)lun;
+    return RES_OK;
+}
+
+static DSTATUS ram_status(BYTE lun){
+    (void)lun;
+    return RES_OK;
+}
+
+static DRESULT ram_read(BYTE lun, BYTE *buff, DWORD sector, UINT count){
+    (void)lun;
+    if(sector + count > RAMDISK_SECTORS) return RES_PARERR;
+    memcpy(buff, &ramdisk[sector*SECTOR_SIZE], count*SECTOR_SIZE);
+    sector_reads += count;
+    return RES_OK;
+}
+
+static DRESULT ram_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count){
+    (void)lun;
+    if(sector + count > RAMDISK_SECTORS) return RES_PARERR;
+    memcpy(&ramdisk[sector*SECTOR_SIZE], buff, count*SECTOR_SIZE);
+    sector_writes += count;
+    return RES_OK;
+}
+
+static DRESULT ram_ioctl(BYTE lun, BYTE cmd, void *buff){
+    (void)lun;
+    switch(cmd){
+        case CTRL_SYNC: return RES_OK;
+        case GET_SECTOR_COUNT: *(DWORD *)buff = RAMDISK_SECTORS; return RES_OK;
+        case GET_SECTOR_SIZE: *(WORD *)buff = SECTOR_SIZE; return RES_OK;
+        case GET_BLOCK_SIZE: *(DWORD *)buff = 1; return RES_OK;
+        default: return RES_PARERR;
+    }
+}
+
+static Diskio_drvTypeDef ram_driver = {ram_initialize, ram_status, ram_read, ram_write, ram_ioctl};
+
+//-----Device Calls-----
+//DATALOG_SD_Save_Model and DATALOG_SD_Load_Model without the SPI chip select around them
+static uint8_t sd_save_model(const void *model, uint32_t size){
+    FIL file;
+    UINT written;
+    uint8_t ok = 0;
+
+    if(f_open(&file, MODEL_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK){
+        ok = (f_write(&file, model, size, &written) == FR_OK && written == size);
+        if(f_close(&file) != FR_OK) ok = 0;
+    }
+    return ok;
+}
+
+static uint32_t sd_load_model(void *model, uint32_t size){
+    FIL file;
+    UINT read = 0;
+
+    if(f_open(&file, MODEL_FILE_NAME, FA_OPEN_EXISTING | FA_READ) == FR_OK){
+        if(f_size(&file) > size || f_read(&file, model, f_size(&file), &read) != FR_OK) read = 0;
+        f_close(&file);
+    }
+    return read;
+}
+
+//SaveModel's layout: the full model, then with CASCADE_INFERENCE the first stage, word aligned
+static uint32_t pack_models(ANN *net, ANN *fast, uint32_t *blob, uint32_t size){
+    uint32_t bytes = ann_save_to_buffer(net, 0, blob, size);
+    uint32_t fast_offset = (bytes + 3)/4;
+
+    if(bytes && fast){
+        bytes = ann_save_to_buffer(fast, 0, &blob[fast_offset], size - 4*fast_offset);
+        if(bytes) bytes += 4*fast_offset;
+    }
+    return bytes;
+}
+
+//-----Fixtures-----
+static unsigned int device_topology[3] = {6, 9, 6};
+static unsigned int fast_topology[2] = {6, 6};
+static FATFS fs;
+static char path[4];
+
+//main()'s net: 6-9-6 in an arena with momentum, R hidden layer, softmax output, triplets normalized
+static void make_device_net(ANN *net, uint8_t *arena){
+    unsigned int i;
+
+    set_model_parameters(net, device_topology, 3, 'R');
+    set_model_arena_flags(net, ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(6));
+    ann_init_in_arena(net, arena);
+    for(i = 0; i < net->n_weights; i++) net->weights[i] = (float)((i*37) % 101)/101.0f;
+    net->eta = 0.13;
+    net->beta = 0.01;
+    net->alpha = 0.25;
+    set_output_actfunc(net, 'x');
+    set_hidden_actfunc(net, 'R');
+    net->input_group = 3;
+    init_ann(net);
+}
+
+//Unmounts and mounts again with a fresh FATFS, as after a reset
+static FRESULT remount(void){
+    f_mount(0, path, 0);
+    memset(&fs, 0, sizeof(fs));
+    return f_mount(&fs, path, 0);
+}
+
+static unsigned int check(const char *what, int ok){
+    printf("%s: %s\n", what, ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main(void){
+    static uint8_t arena[3136], restored_arena[3136], fast_arena[512];
+    static uint32_t model_blob[384], large_blob[2048];
+    static float targets[6][6], input[6] = {0.3, -0.8, 0.5, 0.1, 0.9, -0.4};
+    unsigned int i, e, reads, failed = 0;
+    uint32_t size, loaded;
+    ANN net, fresh, restored, fast, fast_restored;
+    uint32_t fast_offset;
+    float output[6];
+    uint8_t *data;
+
+    //f_mkfs needs the volume registered with f_mount first
+    if(FATFS_LinkDriver(&ram_driver, path) != 0 || f_mount(&fs, path, 0) != FR_OK || f_mkfs(path, 1, 0) != FR_OK ||
+       remount() != FR_OK){
+        fprintf(stderr, "cannot format the RAM disk\n");
+        return 1;
+    }
+
+    //A few epochs so weights, bias and momentum all differ from their initial values
+    make_device_net(&net, arena);
+    for(i = 0; i < 6; i++) targets[i][i] = 1.0;
+    for(e = 0; e < 50; e++){
+        for(i = 0; i < 6; i++){
+            input[i] += 0.01f;
+            train_ann(&net, input, targets[i]);
+        }
+    }
+    ann_normalize_input(&net, input, input);
+    run_ann(&net, input);
+    memcpy(output, net.output, sizeof(output));
+
+    size = ann_save_to_buffer(&net, 0, model_blob, sizeof(model_blob));
+    failed += check("no model on a blank card", sd_load_model(model_blob, sizeof(model_blob)) == 0);
+    failed += check("save", size == ann_model_size(&net, 0) && sd_save_model(model_blob, size));
+
+    //Reset: remount, read the file in one call into a cleared buffer and restore as main() does
+    failed += check("remount", remount() == FR_OK);
+    memset(model_blob, 0, sizeof(model_blob));
+    sector_reads = 0;
+    loaded = sd_load_model(model_blob, sizeof(model_blob));
+    reads = sector_reads;
+    make_device_net(&fresh, restored_arena);
+    restored = fresh;
+    failed += check("load", loaded == size &&
+                    ann_load_from_buffer(&restored, model_blob, sizeof(model_blob)) == ANN_MODEL_OK &&
+                    restored.n_layers == 3 && restored.topology[1] == 9 &&
+                    (((ANN_MODEL_HEADER *)model_blob)->flags & ANN_MODEL_TRAIN));
+    memcpy(fresh.weights, restored.weights, fresh.n_weights*sizeof(float));
+    memcpy(fresh.bias, restored.bias, fresh.n_bias*sizeof(float));
+    memcpy(fresh.dedw, restored.dedw, fresh.n_weights*sizeof(float));
+    memcpy(fresh.activation, restored.activation, sizeof(fresh.activation));
+    fresh.eta = restored.eta;
+    fresh.beta = restored.beta;
+    fresh.alpha = restored.alpha;
+    fresh.input_group = restored.input_group;
+    failed += check("restored state", !memcmp(fresh.weights, net.weights, net.n_weights*sizeof(float)) &&
+                    !memcmp(fresh.bias, net.bias, net.n_bias*sizeof(float)) &&
+                    !memcmp(fresh.dedw, net.dedw, net.n_weights*sizeof(float)) &&
+                    fresh.eta == net.eta && fresh.alpha == net.alpha && fresh.input_group == 3);
+    run_ann(&fresh, input);
+    failed += check("restored outputs", !memcmp(fresh.output, output, sizeof(output)));
+    printf("  %u byte model, %u sector reads for the whole load\n", (unsigned int)size, reads);
+
+    //Training resumes from the restored momentum exactly as it would have gone on
+    train_ann(&net, input, targets[0]);
+    train_ann(&fresh, input, targets[0]);
+    failed += check("training resumes", !memcmp(fresh.weights, net.weights, net.n_weights*sizeof(float)));
+
+    //The first stage behind the full model: fast_net's 6-6 softmax layer with momentum
+    set_model_parameters(&fast, fast_topology, 2, 'R');
+    set_model_arena_flags(&fast, ANN_ARENA_TRAIN);
+    ann_init_in_arena(&fast, fast_arena);
+    set_model_hyperparameters(&fast, 0.2, 0.2, 0.25);
+    set_output_actfunc(&fast, 'x');
+    init_ann(&fast);
+    for(e = 0; e < 50; e++){
+        for(i = 0; i < 6; i++) train_ann(&fast, input, targets[i]);
+    }
+    size = pack_models(&net, &fast, model_blob, sizeof(model_blob));
+    failed += check("packed save", size == 4*((ann_model_size(&net, 0) + 3)/4) + ann_model_size(&fast, 0) &&
+                    size <= sizeof(model_blob) && sd_save_model(model_blob, size));
+    printf("  %u bytes with the first stage, model_blob holds %u\n", (unsigned int)size, (unsigned int)sizeof(model_blob));
+
+    //main() restores the full model, then finds the first stage behind it
+    failed += check("remount", remount() == FR_OK);
+    memset(model_blob, 0, sizeof(model_blob));
+    loaded = sd_load_model(model_blob, sizeof(model_blob));
+    restored = net;
+    fast_restored = fast;
+    fast_offset = (((ANN_MODEL_HEADER *)model_blob)->size + 3)/4;
+    failed += check("packed full model", loaded == size &&
+                    ann_load_from_buffer(&restored, model_blob, sizeof(model_blob)) == ANN_MODEL_OK &&
+                    !memcmp(restored.weights, net.weights, net.n_weights*sizeof(float)));
+    failed += check("packed first stage", loaded > 4*fast_offset &&
+                    ann_load_from_buffer(&fast_restored, &model_blob[fast_offset], loaded - 4*fast_offset) == ANN_MODEL_OK &&
+                    fast_restored.n_layers == 2 && fast_restored.topology[0] == 6 && fast_restored.topology[1] == 6 &&
+                    !memcmp(fast_restored.weights, fast.weights, fast.n_weights*sizeof(float)) &&
+                    !memcmp(fast_restored.bias, fast.bias, fast.n_bias*sizeof(float)) &&
+                    !memcmp(fast_restored.dedw, fast.dedw, fast.n_weights*sizeof(float)));
+
+    //A larger file than the buffer is refused rather than overrunning it
+    memset(large_blob, 0xA5, sizeof(large_blob));
+    failed += check("oversized file", sd_save_model(large_blob, sizeof(large_blob)) &&
+                    sd_load_model(model_blob, sizeof(model_blob)) == 0);
+
+    //FA_CREATE_ALWAYS truncates, so a save after a larger file reads back alone
+    size = ann_save_to_buffer(&net, 0, model_blob, sizeof(model_blob));
+    failed += check("overwrite", sd_save_model(model_blob, size) && remount() == FR_OK &&
+                    sd_load_model(model_blob, sizeof(model_blob)) == size &&
+                    ann_load_from_buffer(&restored, model_blob, sizeof(model_blob)) == ANN_MODEL_OK);
+
+    //A damaged sector reads fine through FatFs but fails the model CRC, so main() trains afresh.
+    //Freed clusters keep the earlier save, so find the sector by content, not by the magic alone.
+    for(data = ramdisk; data < ramdisk + sizeof(ramdisk) && memcmp(data, model_blob, SECTOR_SIZE); data += SECTOR_SIZE);
+    failed += check("file data on the image", data < ramdisk + sizeof(ramdisk));
+    data[100] ^= 0x01;
+    failed += check("damaged sector", remount() == FR_OK && sd_load_model(model_blob, sizeof(model_blob)) == size &&
+                    ann_load_from_buffer(&restored, model_blob, sizeof(model_blob)) == ANN_MODEL_ERR_CRC);
+
+    return failed ? 1 : 0;
+}
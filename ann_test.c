@@ -0,0 +1,518 @@
+/*
+ * ann_test.c - Host tests of the EmbeddedML library
+ *
+ * Host tool. Checks properties of embeddedML.c, built unchanged, that the device cannot easily
+ * check for itself, and prints one line per test. The exit status is 1 if any test failed.
+ *
+ * Build:
+ *   gcc -O2 -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_test.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -pthread -o ann_test
+ *
+ * Usage:
+ *   ann_test [test]...
+ *
+ *   Runs the named tests, or all of them:
+ *     minibatch   train_ann_batch over the device's training_dataset[6][8][6] shape converges like
+ *                 per-sample train_ann from the same start
+ *     model       ann_save_to_buffer / ann_load_from_buffer / ann_q_load_from_buffer round trips
+ *                 give the same outputs, and damaged or inconsistent blobs are rejected
+ *     trainer     ann_trainer_step in time-budgeted slices ends with the same weights, bias and
+ *                 optimizer state, bit for bit, as one uninterrupted run, for train_ann and for
+ *                 mini-batches with a partial last batch, with momentum and with Adam
+ *     fold        after ann_fold_standardization an RMSprop or Adam net finishes a pending
+ *                 mini-batch on raw inputs with the same parameter steps and moments as on
+ *                 standardized ones
+ *     swap        an inference thread in ann_swap_acquire/ann_swap_release and a training thread in
+ *                 ann_swap_shadow/ann_swap_publish never let inference see a half written model
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ann_host.h"
+
+#define N_EXERCISES 6
+#define N_CYCLES 8
+#define N_FEATURES 6
+#define TRAINING_CYCLES 2000
+#define SWAP_PUBLISHES 20000
+
+typedef int (*TEST_FN)(void);
+
+//Deterministic uniform numbers in [-1, 1) so every run sees the same data
+static uint32_t state = 12345;
+
+static float uniform(void){
+    state = state*1664525u + 1013904223u;
+    return (float)(state >> 8)/(float)(1u << 23) - 1.0f;
+}
+
+//-----Fixtures-----
+static unsigned int device_topology[3] = {6, 9, 6};
+
+//The device model of main.c: 6-9-6, R hidden layer, softmax output, triplets normalized, in an arena
+static ANN *make_device_net(unsigned int flags){
+    ANN *net = calloc(1, sizeof(ANN));
+    unsigned int i;
+
+    set_model_parameters(net, device_topology, 3, 'R');
+    set_model_arena_flags(net, flags);
+    ann_init_in_arena(net, malloc(ann_required_bytes(device_topology, 3, flags)));
+    net->eta = 0.13;
+    net->beta = 0.01;
+    net->alpha = 0.25;
+    set_output_actfunc(net, 'x');
+    net->input_group = 3;
+    state = 12345;
+    for(i = 0; i < net->n_weights; i++) net->weights[i] = 0.5f*(uniform() + 1.0f);
+    //init_ann sets the biases to 0.1 over main.c's 0.5
+    init_ann(net);
+    return net;
+}
+
+//Six exercises recorded over eight cycles like training_dataset[6][8][6]: one acceleration and one
+//angular velocity direction per exercise, jittered every cycle, normalized as RecordOrientation does
+static void make_dataset(ANN *net, float dataset[N_EXERCISES][N_CYCLES][N_FEATURES],
+                         float targets[N_EXERCISES][N_FEATURES]){
+    float prototype[N_FEATURES];
+    unsigned int m, k, j;
+
+    state = 4242;
+    memset(targets, 0, N_EXERCISES*N_FEATURES*sizeof(float));
+    for(m = 0; m < N_EXERCISES; m++){
+        for(j = 0; j < N_FEATURES; j++) prototype[j] = uniform();
+        for(k = 0; k < N_CYCLES; k++){
+            for(j = 0; j < N_FEATURES; j++) dataset[m][k][j] = prototype[j] + 0.15f*uniform();
+            ann_normalize_input(net, dataset[m][k], dataset[m][k]);
+        }
+        targets[m][m] = 1.0;
+    }
+}
+
+//Cross-entropy summed over every recorded vector, and how many of them classify correctly
+static float evaluate(ANN *net, float dataset[N_EXERCISES][N_CYCLES][N_FEATURES], unsigned int *correct){
+    unsigned int m, k;
+    float loss = 0.0;
+
+    *correct = 0;
+    for(m = 0; m < N_EXERCISES; m++){
+        for(k = 0; k < N_CYCLES; k++){
+            run_ann(net, dataset[m][k]);
+            loss -= logf(net->output[m] + 1e-12f);
+            if(argmax(net->output, N_FEATURES) == m) (*correct)++;
+        }
+    }
+    return loss;
+}
+
+//Int8 copy of net over fixed activation ranges, enough for a round trip
+static ANN_Q *make_device_q(ANN *net, unsigned int per_channel){
+    ANN_Q *qnet = calloc(1, sizeof(ANN_Q));
+    float act_min[ANN_MAX_LAYERS], act_max[ANN_MAX_LAYERS];
+    unsigned int l;
+
+    for(l = 0; l < ANN_MAX_LAYERS; l++){
+        act_min[l] = -2.0;
+        act_max[l] = 2.0;
+    }
+    set_model_q_parameters(qnet, net->topology, net->n_layers, 'r', per_channel);
+    set_model_q_memory(qnet, calloc(qnet->n_weights, 1), calloc(qnet->n_bias, sizeof(int32_t)),
+                       calloc(qnet->n_bias, sizeof(ANN_Q_SCALE)), calloc(net->n_layers, sizeof(ANN_Q_SCALE)),
+                       calloc(net->n_layers, sizeof(float)), calloc(net->n_layers, sizeof(int32_t)),
+                       calloc(ann_q_scratch_size(qnet), 1), calloc(net->topology[net->n_layers-1], sizeof(float)));
+    quantize_ann(net, qnet, act_min, act_max);
+    return qnet;
+}
+
+//Recomputes the CRC of a blob after a test edited it, so only the edit is under test
+static void reseal(uint32_t *blob){
+    ANN_MODEL_HEADER *h = (ANN_MODEL_HEADER *)blob;
+    uint32_t crc = ann_crc32(0, blob, offsetof(ANN_MODEL_HEADER, crc));
+    h->crc = ann_crc32(crc, (uint8_t *)blob + sizeof(ANN_MODEL_HEADER), h->size - sizeof(ANN_MODEL_HEADER));
+}
+
+//Microsecond clock for ann_trainer_step that ticks once per call, so a budget is a sample count
+static uint32_t ticks;
+
+static uint32_t tick_clock(void){
+    return ticks++;
+}
+
+static unsigned int check(const char *what, int ok){
+    if(!ok) printf("  %s: failed\n", what);
+    return ok ? 0 : 1;
+}
+
+//-----Tests-----
+//TrainOrientation on every cycle in turn, once with a train_ann per exercise and once with one
+//mini-batch of the six exercises per epoch. Both must classify the recorded set alike and end
+//with a comparable loss.
+static int test_minibatch(void){
+    static float dataset[N_EXERCISES][N_CYCLES][N_FEATURES];
+    static float targets[N_EXERCISES][N_FEATURES];
+    float batch[N_EXERCISES][N_FEATURES];
+    float loss[2];
+    unsigned int correct[2], updates[2];
+    unsigned int mode, k, m, e;
+    ANN *net;
+
+    for(mode = 0; mode < 2; mode++){
+        net = make_device_net(ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(N_EXERCISES));
+        if(mode == 0) make_dataset(net, dataset, targets);
+        updates[mode] = 0;
+        for(k = 0; k < N_CYCLES; k++){
+            for(m = 0; m < N_EXERCISES; m++) memcpy(batch[m], dataset[m][k], sizeof(batch[m]));
+            for(e = 0; e < (TRAINING_CYCLES + N_EXERCISES - 1)/N_EXERCISES; e++){
+                if(mode == 0){
+                    for(m = 0; m < N_EXERCISES; m++) train_ann(net, batch[m], targets[m]);
+                    updates[mode] += N_EXERCISES;
+                }
+                else{
+                    train_ann_batch(net, &batch[0][0], &targets[0][0], N_EXERCISES);
+                    updates[mode]++;
+                }
+            }
+        }
+        loss[mode] = evaluate(net, dataset, &correct[mode]);
+    }
+
+    printf("  per-sample: %u weight updates, %u/%u correct, loss %.4f\n", updates[0], correct[0],
+           N_EXERCISES*N_CYCLES, loss[0]);
+    printf("  mini-batch: %u weight updates, %u/%u correct, loss %.4f\n", updates[1], correct[1],
+           N_EXERCISES*N_CYCLES, loss[1]);
+    return correct[1] + 1 >= correct[0] && correct[1] >= N_EXERCISES*N_CYCLES - 2 &&
+           loss[1] < 2.0f*loss[0] + 0.05f;
+}
+
+//Float, quantized and combined blobs load back to the same outputs; blobs that are truncated,
+//damaged or whose counts disagree with the topology are refused
+static int test_model(void){
+    static uint32_t blob[1024], copy[1024];
+    static float input[N_FEATURES] = {0.3, -0.8, 0.5, 0.1, 0.9, -0.4};
+    ANN_MODEL_HEADER *h = (ANN_MODEL_HEADER *)blob;
+    float output[N_FEATURES], *x;
+    unsigned int size, failed = 0, per_channel, bad[3] = {6, 9, 6};
+    ANN *net = make_device_net(ANN_ARENA_TRAIN);
+    ANN *plain = make_device_net(0);
+    ANN_Q *qnet, loaded_q;
+    ANN loaded, broken;
+
+    ann_normalize_input(net, input, input);
+    run_ann(net, input);
+    memcpy(output, net->output, sizeof(output));
+
+    //Float model with training and normalization sections, loaded zero-copy
+    size = ann_save_to_buffer(net, NULL, blob, sizeof(blob));
+    failed += check("float save", size == ann_model_size(net, NULL) && size > 0);
+    loaded = *net;
+    failed += check("float load", ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_OK);
+    failed += check("float zero-copy", (uint8_t *)loaded.weights > (uint8_t *)blob &&
+                    (uint8_t *)loaded.weights < (uint8_t *)blob + size);
+    failed += check("float sections", loaded.dedw != net->dedw && loaded.input_group == 3 &&
+                    loaded.eta == net->eta && loaded.n_bias == net->n_bias &&
+                    !memcmp(loaded.activation, net->activation, sizeof(loaded.activation)));
+    run_ann(&loaded, input);
+    failed += check("float outputs", !memcmp(loaded.output, output, sizeof(output)));
+
+    //Loading a blob without those sections must not keep the previous model's
+    plain->input_group = 0;
+    size = ann_save_to_buffer(plain, NULL, copy, sizeof(copy));
+    plain->input_group = 3;
+    failed += check("plain load", ann_load_from_buffer(&loaded, copy, size) == ANN_MODEL_OK);
+    failed += check("plain resets dedw and input_group", loaded.dedw == 0 && loaded.input_group == 0);
+
+    //Quantized alone and next to the float model, both scale granularities
+    for(per_channel = 0; per_channel < 2; per_channel++){
+        qnet = make_device_q(net, per_channel);
+        run_ann_q(qnet, input);
+        memcpy(output, qnet->output, sizeof(output));
+        size = ann_save_to_buffer(per_channel ? net : NULL, qnet, blob, sizeof(blob));
+        loaded_q = *qnet;
+        failed += check("quantized load", ann_q_load_from_buffer(&loaded_q, blob, size) == ANN_MODEL_OK);
+        run_ann_q(&loaded_q, input);
+        failed += check("quantized outputs", !memcmp(loaded_q.output, output, sizeof(output)) &&
+                        loaded_q.per_channel == per_channel);
+        if(per_channel) failed += check("combined float load", ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_OK);
+        else failed += check("quantized only has no float", ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_ERR_SECTION);
+    }
+
+    //Damage
+    size = ann_save_to_buffer(net, NULL, blob, sizeof(blob));
+    memcpy(copy, blob, size);
+    failed += check("truncated", ann_load_from_buffer(&loaded, copy, size - 4) == ANN_MODEL_ERR_SIZE);
+    ((uint8_t *)copy)[size/2] ^= 0x10;
+    failed += check("flipped bit", ann_load_from_buffer(&loaded, copy, size) == ANN_MODEL_ERR_CRC);
+    memcpy(copy, blob, size);
+    copy[0] ^= 1;
+    failed += check("magic", ann_load_from_buffer(&loaded, copy, size) == ANN_MODEL_ERR_MAGIC);
+    memcpy((uint8_t *)copy + 1, blob, size);
+    failed += check("misaligned", ann_load_from_buffer(&loaded, (uint8_t *)copy + 1, size) == ANN_MODEL_ERR_ALIGN);
+
+    //CRC-valid blobs whose counts disagree with the topology: 9 biases for a 6-9-6 net, a zero-width
+    //layer, and a normalization group that does not divide the inputs
+    broken = *net;
+    broken.n_bias = 9;
+    size = ann_save_to_buffer(&broken, NULL, blob, sizeof(blob));
+    failed += check("bias count", size > 0 && ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_ERR_SIZE);
+    bad[1] = 0;
+    broken = *net;
+    broken.topology = bad;
+    broken.n_weights = 0;
+    broken.n_bias = 6;
+    size = ann_save_to_buffer(&broken, NULL, blob, sizeof(blob));
+    failed += check("zero-width layer", size > 0 && ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_ERR_SIZE);
+    size = ann_save_to_buffer(net, NULL, blob, sizeof(blob));
+    x = (float *)((uint8_t *)blob + size - sizeof(uint32_t));
+    *(uint32_t *)x = 4;
+    reseal(blob);
+    failed += check("input group", h->flags & ANN_MODEL_NORM && ann_load_from_buffer(&loaded, blob, size) == ANN_MODEL_ERR_SIZE);
+
+    return failed == 0;
+}
+
+//The same training, once in a single ann_trainer_step and once sliced by short and uneven budgets
+//with checkpoints, must leave every trained buffer identical
+static int test_trainer(void){
+    static float dataset[N_EXERCISES][N_CYCLES][N_FEATURES];
+    static float targets[N_EXERCISES*N_CYCLES][N_FEATURES], exercise_targets[N_EXERCISES][N_FEATURES];
+    static const struct { const char *what; unsigned int flags, batch, total; } cases[] = {
+        {"train_ann, momentum", 0, 1, 1000},
+        {"batch of 5, momentum", ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(5), 5, 1003},
+        {"batch of 4, Adam", ANN_ARENA_GRADIENT | ANN_ARENA_BATCH(4) | ANN_ARENA_ADAM, 4, 998},
+    };
+    static const uint32_t budgets[] = {1, 7, 2, 30, 3, 64};
+    unsigned int c, m, k, calls, failed = 0, n_samples = N_EXERCISES*N_CYCLES;
+    unsigned int flags;
+    ANN_TRAINER trainer;
+    ANN *once, *sliced;
+
+    for(c = 0; c < sizeof(cases)/sizeof(cases[0]); c++){
+        flags = ANN_ARENA_TRAIN | cases[c].flags;
+        once = make_device_net(flags);
+        sliced = make_device_net(flags);
+        make_dataset(once, dataset, exercise_targets);
+        for(m = 0; m < N_EXERCISES; m++){
+            for(k = 0; k < N_CYCLES; k++) memcpy(targets[m*N_CYCLES + k], exercise_targets[m], sizeof(targets[0]));
+        }
+
+        ann_trainer_init(&trainer, once, &dataset[0][0][0], &targets[0][0], n_samples, cases[c].batch,
+                         cases[c].total, tick_clock);
+        ann_trainer_step(&trainer, UINT32_MAX);
+        failed += check("one step trains everything", trainer.done == cases[c].total);
+
+        ann_trainer_init(&trainer, sliced, &dataset[0][0][0], &targets[0][0], n_samples, cases[c].batch,
+                         cases[c].total, tick_clock);
+        trainer.checkpoint = 100;
+        for(calls = 0; trainer.done < trainer.total && calls < 2*cases[c].total; calls++){
+            ann_trainer_step(&trainer, budgets[calls % (sizeof(budgets)/sizeof(budgets[0]))]);
+        }
+        printf("  %s: %u samples in %u slices\n", cases[c].what, trainer.done, calls);
+
+        failed += check("sliced trains everything", trainer.done == cases[c].total && calls > 1);
+        failed += check("weights", !memcmp(once->weights, sliced->weights, once->n_weights*sizeof(float)));
+        failed += check("bias", !memcmp(once->bias, sliced->bias, once->n_bias*sizeof(float)));
+        failed += check("dedw", !memcmp(once->dedw, sliced->dedw, once->n_weights*sizeof(float)));
+        failed += check("optimizer state", once->step == sliced->step && (!once->opt_state ||
+                        !memcmp(once->opt_state, sliced->opt_state,
+                                ann_optimizer_state_size(once, (flags & ANN_ARENA_ADAM) ? 'a' : 'm')*sizeof(float))));
+    }
+    return failed == 0;
+}
+
+//Two nets trained alike on standardized inputs; one has the standardization folded in and finishes
+//a pending mini-batch on raw inputs. With a zero mean every gradient of the folded first layer is
+//std times the other's, so with grad and the optimizer state rescaled by the fold the update must
+//move every parameter by the same amount in both nets (up to the optimizers' epsilon), and the
+//moments must stay std and std^2 times the unfolded ones.
+static int test_fold(void){
+    static float dataset[N_EXERCISES][N_CYCLES][N_FEATURES];
+    static float targets[N_EXERCISES][N_FEATURES];
+    static float raw[N_EXERCISES][N_FEATURES];
+    static const float mean[N_FEATURES] = {0};
+    static const float std[N_FEATURES] = {2.0, 0.5, 3.0, 1.5, 0.25, 4.0};
+    static const struct { const char *what; unsigned int flags; char optimizer; } cases[] = {
+        {"RMSprop", ANN_ARENA_RMSPROP, 'r'},
+        {"Adam", ANN_ARENA_ADAM, 'a'},
+    };
+    unsigned int c, m, j, i, e, k, n_first, n_params, failed = 0;
+    float *before, *folded_before, d, max_diff, max_step, max_state;
+    ANN *net, *folded;
+
+    for(c = 0; c < sizeof(cases)/sizeof(cases[0]); c++){
+        net = make_device_net(ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | cases[c].flags);
+        folded = make_device_net(ANN_ARENA_TRAIN | ANN_ARENA_GRADIENT | cases[c].flags);
+        n_first = net->topology[0]*net->topology[1];
+        n_params = net->n_weights + net->n_bias;
+        make_dataset(net, dataset, targets);
+        for(m = 0; m < N_EXERCISES; m++){
+            for(j = 0; j < N_FEATURES; j++) raw[m][j] = dataset[m][0][j]*std[j];
+        }
+
+        for(e = 0; e < 20; e++){
+            for(m = 0; m < N_EXERCISES; m++){
+                train_ann(net, dataset[m][e % N_CYCLES], targets[m]);
+                train_ann(folded, dataset[m][e % N_CYCLES], targets[m]);
+            }
+        }
+        for(m = 0; m < 3; m++){
+            accumulate_ann(net, dataset[m][0], targets[m]);
+            accumulate_ann(folded, dataset[m][0], targets[m]);
+        }
+
+        ann_fold_standardization(folded, mean, std);
+        for(m = 3; m < N_EXERCISES; m++){
+            accumulate_ann(net, dataset[m][0], targets[m]);
+            accumulate_ann(folded, raw[m], targets[m]);
+        }
+        before = malloc(n_params*sizeof(float));
+        folded_before = malloc(n_params*sizeof(float));
+        memcpy(before, net->weights, net->n_weights*sizeof(float));
+        memcpy(&before[net->n_weights], net->bias, net->n_bias*sizeof(float));
+        memcpy(folded_before, folded->weights, folded->n_weights*sizeof(float));
+        memcpy(&folded_before[net->n_weights], folded->bias, folded->n_bias*sizeof(float));
+        update_ann(net);
+        update_ann(folded);
+
+        //Steps of every weight and bias, relative to the largest step
+        max_diff = 0.0;
+        max_step = 0.0;
+        for(i = 0; i < n_params; i++){
+            d = (i < net->n_weights) ? net->weights[i] - before[i] : net->bias[i - net->n_weights] - before[i];
+            if(fabsf(d) > max_step) max_step = fabsf(d);
+            d -= (i < net->n_weights) ? folded->weights[i] - folded_before[i] :
+                 folded->bias[i - net->n_weights] - folded_before[i];
+            if(fabsf(d) > max_diff) max_diff = fabsf(d);
+        }
+
+        //First layer moments, relative to the folded ones
+        max_state = 0.0;
+        for(i = 0; i < n_first; i++){
+            k = i % net->topology[0];
+            for(j = 0; j < ann_optimizer_state_size(net, cases[c].optimizer)/n_params; j++){
+                d = net->opt_state[j*n_params + i]*((j == 0 && cases[c].optimizer == 'a') ? std[k] : std[k]*std[k]);
+                d = fabsf(d - folded->opt_state[j*n_params + i])/(fabsf(folded->opt_state[j*n_params + i]) + 1e-30f);
+                if(d > max_state) max_state = d;
+            }
+        }
+        printf("  %s: step difference %g of the largest step %g, moments off by %g\n", cases[c].what,
+               max_diff, max_step, max_state);
+        failed += check(cases[c].what, max_diff < 1e-3f*max_step && max_state < 1e-3f);
+        free(before);
+        free(folded_before);
+    }
+    return failed == 0;
+}
+
+//The inference side of the swap test: reads whole models until the writer is done
+typedef struct {
+    ANN_SWAP *swap;
+    atomic_int done;
+    atomic_uint reads;
+    unsigned int torn, backwards;
+} SWAP_READER;
+
+//Every weight and bias of a published model holds its generation number, so a slot seen with two
+//values was written while inference held it, and a lower generation than before was republished
+static void *swap_reader(void *arg){
+    SWAP_READER *r = arg;
+    float last = 0.0, generation;
+    unsigned int i;
+    ANN *net;
+
+    while(!r->done){
+        net = ann_swap_acquire(r->swap);
+        generation = net->weights[0];
+        for(i = 0; i < net->n_weights; i++) if(net->weights[i] != generation) break;
+        if(i < net->n_weights) r->torn++;
+        for(i = 0; i < net->n_bias; i++) if(net->bias[i] != generation) break;
+        if(i < net->n_bias) r->torn++;
+        if(net->weights[net->n_weights - 1] != generation) r->torn++;
+        ann_swap_release(r->swap);
+        if(generation < last) r->backwards++;
+        last = generation;
+        r->reads++;
+    }
+    return NULL;
+}
+
+//A writer thread fills the shadow with one generation number at a time and publishes it while a
+//reader thread checks every model it acquires
+static int test_swap(void){
+    static ANN_SWAP swap;
+    ANN *net = make_device_net(ANN_ARENA_TRAIN);
+    ANN *shadow_buffers = make_device_net(0);
+    ANN *shadow;
+    SWAP_READER reader;
+    pthread_t thread;
+    unsigned int g, i, busy = 0, failed = 0;
+
+    for(i = 0; i < net->n_weights; i++) net->weights[i] = 0.0;
+    for(i = 0; i < net->n_bias; i++) net->bias[i] = 0.0;
+    ann_swap_init(&swap, net, shadow_buffers->weights, shadow_buffers->bias, shadow_buffers->scratch,
+                  shadow_buffers->output);
+
+    memset(&reader, 0, sizeof(reader));
+    reader.swap = &swap;
+    if(pthread_create(&thread, NULL, swap_reader, &reader)) return 0;
+    while(reader.reads == 0);
+    for(g = 1; g <= SWAP_PUBLISHES; g++){
+        //The shadow is refused while the reader still holds it after the last publish
+        while(!(shadow = ann_swap_shadow(&swap))) busy++;
+        for(i = 0; i < shadow->n_weights; i++) shadow->weights[i] = (float)g;
+        for(i = 0; i < shadow->n_bias; i++) shadow->bias[i] = (float)g;
+        ann_swap_publish(&swap);
+    }
+    reader.done = 1;
+    pthread_join(thread, NULL);
+
+    net = ann_swap_acquire(&swap);
+    failed += check("last publish active", net->weights[0] == (float)SWAP_PUBLISHES);
+    ann_swap_release(&swap);
+    printf("  %u publishes, %u reads, %u shadow refusals, %u torn, %u out of order\n", SWAP_PUBLISHES,
+           (unsigned int)reader.reads, busy, reader.torn, reader.backwards);
+    failed += check("no torn models", reader.torn == 0);
+    failed += check("generations in order", reader.backwards == 0);
+    failed += check("reader ran", reader.reads > 0);
+    return failed == 0;
+}
+
+static const struct {
+    const char *name;
+    TEST_FN fn;
+} tests[] = {
+    {"minibatch", test_minibatch},
+    {"model", test_model},
+    {"trainer", test_trainer},
+    {"fold", test_fold},
+    {"swap", test_swap},
+};
+
+int main(int argc, char **argv){
+    unsigned int t, failed = 0;
+    int i, run;
+
+    for(t = 0; t < sizeof(tests)/sizeof(tests[0]); t++){
+        run = (argc < 2);
+        for(i = 1; i < argc; i++) if(!strcmp(argv[i], tests[t].name)) run = 1;
+        if(!run) continue;
+        printf("%s\n", tests[t].name);
+        if(tests[t].fn()) printf("  PASS\n");
+        else{
+            printf("  FAIL\n");
+            failed++;
+        }
+        fflush(stdout);
+    }
+    for(i = 1; i < argc; i++){
+        for(t = 0; t < sizeof(tests)/sizeof(tests[0]) && strcmp(argv[i], tests[t].name); t++);
+        if(t == sizeof(tests)/sizeof(tests[0])){
+            fprintf(stderr, "unknown test %s\n", argv[i]);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
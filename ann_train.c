@@ -0,0 +1,376 @@
+/*
+ * ann_train.c - Multi-threaded mini-batch training of an EmbeddedML ANN
+ *
+ * Host tool. Trains the device's ANN on a recorded dataset with the library's own backprop.
+ * Every mini-batch is split across a pool of threads; each thread runs accumulate_ann on its
+ * share into a private gradient buffer, the buffers are summed slice by slice (every thread owns
+ * a disjoint range of parameters, so no locks) and one update_ann applies the step. With one
+ * thread the weights match train_ann_batch exactly; with more only the summation order changes.
+ *
+ * Build:
+ *   gcc -O2 -pthread -ISTile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src ann_train.c ann_host.c \
+ *       STile_M_Pattern/Projects/SensorTile/Applications/DataLog/Src/embeddedML.c -lm -o ann_train
+ *
+ * Usage:
+ *   ann_train <topology> <activation> <dataset> <name> [options]
+ *
+ *   topology     comma separated layer widths, e.g. 6,9,6
+ *   activation   hidden layer activation as in set_model_parameters, e.g. 'R'
+ *   dataset      one sample per line: topology[0] inputs then the output-width targets
+ *   name         output prefix, writes <name>.bin (ann_load_from_buffer), <name>_weights.txt
+ *                and <name>_bias.txt
+ *
+ *   -e epochs    passes over the dataset (default 10)
+ *   -b batch     samples per update_ann, summed as on the device (default 32)
+ *   -j threads   worker threads (default: online cores)
+ *   -l eta       learning rate, also used for the biases (default 0.01)
+ *   -o m|r|a     momentum, RMSprop or Adam as in set_model_optimizer (default m)
+ *   -x           softmax output trained with cross-entropy (default: activation on every layer)
+ *   -w weights   initial weights, e.g. weights.txt, exactly one per connection of the topology
+ *                (default: Xavier uniform, biases 0)
+ *   -g group     L2-normalize the inputs in groups of this width (ann_normalize_input), e.g. 3
+ *                for the device's acceleration and angular velocity; stored in the model
+ *   -z           train on standardized inputs, (x - mean)/std per feature over the dataset, and
+ *                fold the standardization into the exported first layer
+ *   -s           only report scaling: time one epoch with 1, 2, 4, ... threads up to -j
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ann_host.h"
+
+#define MAX_LAYERS 8
+
+typedef struct {
+    ANN *master;
+    ANN net;                    //Shares master's weights, own grad, bp_scratch and output
+    unsigned int id;
+    struct TRAIN_POOL *pool;
+} WORKER;
+
+typedef struct TRAIN_POOL {
+    WORKER *workers;
+    unsigned int n_threads;
+    pthread_barrier_t start, reduce, done;
+    float *inputs, *targets;
+    unsigned int *order;        //Sample indices of the current epoch
+    unsigned int first, count;  //Current mini-batch within order
+    int quit;
+} TRAIN_POOL;
+
+//Rewrites inputs as (x - mean)/std per feature; a constant feature gets std 1
+static void standardize(float *inputs, unsigned int n_samples, unsigned int n_in, float *mean, float *std){
+    unsigned int s, k;
+    double sum, sq, m;
+
+    for(k = 0; k < n_in; k++){
+        sum = 0.0;
+        sq = 0.0;
+        for(s = 0; s < n_samples; s++){
+            sum += inputs[n_in*s + k];
+            sq += (double)inputs[n_in*s + k]*inputs[n_in*s + k];
+        }
+        m = sum/n_samples;
+        mean[k] = (float)m;
+        std[k] = (float)sqrt(sq/n_samples - m*m);
+        if(!(std[k] > 1e-6f)) std[k] = 1.0f;
+        for(s = 0; s < n_samples; s++){
+            inputs[n_in*s + k] = (inputs[n_in*s + k] - mean[k])/std[k];
+        }
+    }
+}
+
+//Deterministic uniform numbers in [0, 1) so runs are repeatable
+static float uniform(uint32_t *state){
+    *state = *state*1664525u + 1013904223u;
+    return (float)(*state >> 8)/(float)(1u << 24);
+}
+
+static void shuffle(unsigned int *order, unsigned int n, uint32_t *state){
+    unsigned int i, j, t;
+    for(i = n - 1; i > 0; i--){
+        j = (unsigned int)(uniform(state)*(i + 1));
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+//-----Thread Pool-----
+//Accumulates this worker's share of the mini-batch, then sums its slice of every worker's gradient
+//into the master. Thread 0 is the caller and applies update_ann once all slices are in.
+static void batch_step(WORKER *w){
+    TRAIN_POOL *pool = w->pool;
+    ANN *net = &w->net;
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    unsigned int n_params = net->n_weights + net->n_bias;
+    unsigned int lo = pool->count*w->id/pool->n_threads;
+    unsigned int hi = pool->count*(w->id + 1)/pool->n_threads;
+    unsigned int i, k, t, s;
+    float sum;
+
+    for(i = lo; i < hi; i++){
+        s = pool->order[pool->first + i];
+        accumulate_ann(net, &pool->inputs[n_in*s], &pool->targets[n_out*s]);
+    }
+    pthread_barrier_wait(&pool->reduce);
+
+    lo = n_params*w->id/pool->n_threads;
+    hi = n_params*(w->id + 1)/pool->n_threads;
+    for(k = lo; k < hi; k++){
+        sum = pool->workers[0].net.grad[k];
+        pool->workers[0].net.grad[k] = 0.0;
+        for(t = 1; t < pool->n_threads; t++){
+            sum += pool->workers[t].net.grad[k];
+            pool->workers[t].net.grad[k] = 0.0;
+        }
+        w->master->grad[k] = sum;
+    }
+    pthread_barrier_wait(&pool->done);
+}
+
+static void *worker_main(void *arg){
+    WORKER *w = arg;
+
+    for(;;){
+        pthread_barrier_wait(&w->pool->start);
+        if(w->pool->quit) break;
+        batch_step(w);
+    }
+    return NULL;
+}
+
+static void run_batch(TRAIN_POOL *pool, unsigned int first, unsigned int count){
+    pool->first = first;
+    pool->count = count;
+    pthread_barrier_wait(&pool->start);
+    batch_step(&pool->workers[0]);
+    update_ann(pool->workers[0].master);
+}
+
+static void pool_start(TRAIN_POOL *pool, ANN *master, unsigned int n_threads, pthread_t *threads){
+    unsigned int t;
+    ANN *net;
+
+    pool->n_threads = n_threads;
+    pool->quit = 0;
+    pool->workers = calloc(n_threads, sizeof(WORKER));
+    pthread_barrier_init(&pool->start, NULL, n_threads);
+    pthread_barrier_init(&pool->reduce, NULL, n_threads);
+    pthread_barrier_init(&pool->done, NULL, n_threads);
+
+    for(t = 0; t < n_threads; t++){
+        net = &pool->workers[t].net;
+        *net = *master;
+        net->grad = calloc(master->n_weights + master->n_bias, sizeof(float));
+        net->bp_scratch = calloc(ann_bp_scratch_size(master), sizeof(float));
+        net->output = calloc(master->topology[master->n_layers - 1], sizeof(float));
+        pool->workers[t].master = master;
+        pool->workers[t].id = t;
+        pool->workers[t].pool = pool;
+        if(t) pthread_create(&threads[t], NULL, worker_main, &pool->workers[t]);
+    }
+}
+
+static void pool_stop(TRAIN_POOL *pool, pthread_t *threads){
+    unsigned int t;
+
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for(t = 1; t < pool->n_threads; t++) pthread_join(threads[t], NULL);
+    for(t = 0; t < pool->n_threads; t++){
+        free(pool->workers[t].net.grad);
+        free(pool->workers[t].net.bp_scratch);
+        free(pool->workers[t].net.output);
+    }
+    free(pool->workers);
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->reduce);
+    pthread_barrier_destroy(&pool->done);
+}
+
+//One pass over order in mini-batches, returns the elapsed seconds
+static double train_epoch(TRAIN_POOL *pool, unsigned int n_samples, unsigned int batch){
+    unsigned int first;
+    double t = now_ns();
+
+    for(first = 0; first < n_samples; first += batch){
+        run_batch(pool, first, (n_samples - first < batch) ? n_samples - first : batch);
+    }
+    return 1e-9*(now_ns() - t);
+}
+
+//-----Model-----
+//Fresh weights, optimizer state and the thread-independent model buffers for one run
+static void init_model(ANN *net, float *init, char optimizer){
+    unsigned int l, i, off = 0;
+    float limit;
+    uint32_t state = 1;
+
+    if(init){
+        memcpy(net->weights, init, net->n_weights*sizeof(float));
+    }
+    else{
+        for(l = 1; l < net->n_layers; l++){
+            limit = sqrtf(6.0f/(net->topology[l] + net->topology[l-1]));
+            for(i = 0; i < net->topology[l]*net->topology[l-1]; i++) net->weights[off + i] = limit*(2.0f*uniform(&state) - 1.0f);
+            off += net->topology[l]*net->topology[l-1];
+        }
+    }
+    set_model_optimizer(net, optimizer, net->opt_state);
+    init_pretrained_ann(net);
+    fill_zeros(net->bias, net->n_bias);
+}
+
+//Fraction of samples whose largest output matches the largest target
+static float accuracy(ANN *net, float *inputs, float *targets, unsigned int n_samples){
+    unsigned int n_in = net->topology[0];
+    unsigned int n_out = net->topology[net->n_layers - 1];
+    unsigned int s, i, a, b, hits = 0;
+
+    for(s = 0; s < n_samples; s++){
+        run_ann(net, &inputs[n_in*s]);
+        a = 0;
+        b = 0;
+        for(i = 1; i < n_out; i++){
+            if(net->output[i] > net->output[a]) a = i;
+            if(targets[n_out*s + i] > targets[n_out*s + b]) b = i;
+        }
+        if(a == b) hits++;
+    }
+    return (float)hits/n_samples;
+}
+
+int main(int argc, char **argv){
+    unsigned int topology[MAX_LAYERS];
+    unsigned int n_layers = 0, n_in, n_out, n_samples, n_init = 0;
+    unsigned int epochs = 10, batch = 32, n_threads, e, s, t;
+    unsigned int softmax = 0, scaling = 0, group = 0, standardized = 0;
+    char optimizer = 'm';
+    float eta = 0.01;
+    float *inputs, *targets, *init = NULL;
+    float *raw = NULL, *mean = NULL, *std = NULL;
+    unsigned int *order;
+    uint32_t state = 7;
+    double seconds, base = 0.0;
+    char *tok;
+    pthread_t *threads;
+    TRAIN_POOL pool;
+    ANN net;
+    int i;
+
+    if(argc < 5){
+        fprintf(stderr, "usage: %s <topology> <activation> <dataset> <name> [-e epochs] [-b batch] [-j threads] "
+                        "[-l eta] [-o m|r|a] [-x] [-w weights] [-g group] [-z] [-s]\n", argv[0]);
+        return 1;
+    }
+    n_threads = (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    for(i = 5; i < argc; i++){
+        if(!strcmp(argv[i], "-e") && i + 1 < argc) epochs = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-b") && i + 1 < argc) batch = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-j") && i + 1 < argc) n_threads = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc) eta = strtof(argv[++i], NULL);
+        else if(!strcmp(argv[i], "-o") && i + 1 < argc) optimizer = argv[++i][0];
+        else if(!strcmp(argv[i], "-w") && i + 1 < argc) init = read_floats(argv[++i], &n_init);
+        else if(!strcmp(argv[i], "-g") && i + 1 < argc) group = (unsigned int)atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-x")) softmax = 1;
+        else if(!strcmp(argv[i], "-z")) standardized = 1;
+        else if(!strcmp(argv[i], "-s")) scaling = 1;
+        else{
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if(n_threads < 1) n_threads = 1;
+    if(batch < 1) batch = 1;
+
+    for(tok = strtok(argv[1], ","); tok && n_layers < MAX_LAYERS; tok = strtok(NULL, ",")){
+        topology[n_layers++] = (unsigned int)atoi(tok);
+    }
+
+    memset(&net, 0, sizeof(net));
+    set_model_parameters(&net, topology, n_layers, argv[2][0]);
+    if(softmax) set_output_actfunc(&net, 'x');
+    set_model_hyperparameters(&net, eta, eta, 0.25);
+    set_optimizer_parameters(&net, 0.9, 0.999, 1e-7);
+    n_in = topology[0];
+    n_out = topology[n_layers-1];
+    if(init && n_init != net.n_weights){
+        fprintf(stderr, "-w: %u weights, the topology needs %u\n", n_init, net.n_weights);
+        return 1;
+    }
+
+    n_samples = read_dataset(argv[3], n_in, n_out, &inputs, &targets);
+    order = malloc(n_samples*sizeof(unsigned int));
+    for(s = 0; s < n_samples; s++) order[s] = s;
+    if(group){
+        if(n_in % group){
+            fprintf(stderr, "-g %u does not divide the %u inputs\n", group, n_in);
+            return 1;
+        }
+        net.input_group = group;
+        for(s = 0; s < n_samples; s++) ann_normalize_input(&net, &inputs[n_in*s], &inputs[n_in*s]);
+    }
+    if(standardized){
+        //The exported model sees the inputs as they are before standardization
+        raw = malloc(n_samples*n_in*sizeof(float));
+        mean = malloc(n_in*sizeof(float));
+        std = malloc(n_in*sizeof(float));
+        memcpy(raw, inputs, n_samples*n_in*sizeof(float));
+        standardize(inputs, n_samples, n_in, mean, std);
+    }
+
+    net.weights = malloc(net.n_weights*sizeof(float));
+    net.bias = malloc(net.n_bias*sizeof(float));
+    net.dedw = malloc(net.n_weights*sizeof(float));
+    net.grad = calloc(net.n_weights + net.n_bias, sizeof(float));
+    net.opt_state = calloc(ann_optimizer_state_size(&net, 'a'), sizeof(float));
+    net.output = malloc(n_out*sizeof(float));
+    net.scratch = malloc(ann_scratch_size(&net)*sizeof(float));
+    net.batch_size = 1;
+
+    pool.inputs = inputs;
+    pool.targets = targets;
+    pool.order = order;
+    threads = calloc(n_threads, sizeof(pthread_t));
+
+    printf("samples: %u, parameters: %u, batch: %u\n", n_samples, net.n_weights + net.n_bias, batch);
+
+    if(scaling){
+        //Same starting point and sample order for every thread count
+        printf("threads,seconds,samples_per_s,speedup\n");
+        for(t = 1; t <= n_threads; t = (t < n_threads && 2*t > n_threads) ? n_threads : 2*t){
+            init_model(&net, init, optimizer);
+            pool_start(&pool, &net, t, threads);
+            seconds = train_epoch(&pool, n_samples, batch);
+            pool_stop(&pool, threads);
+            if(t == 1) base = seconds;
+            printf("%u,%.3f,%.0f,%.2f\n", t, seconds, n_samples/seconds, base/seconds);
+        }
+        return 0;
+    }
+
+    init_model(&net, init, optimizer);
+    pool_start(&pool, &net, n_threads, threads);
+    for(e = 0; e < epochs; e++){
+        shuffle(order, n_samples, &state);
+        seconds = train_epoch(&pool, n_samples, batch);
+        printf("epoch %u: %.3f s, %.0f samples/s, accuracy %.4f\n", e + 1, seconds, n_samples/seconds,
+               accuracy(&net, inputs, targets, n_samples));
+    }
+    pool_stop(&pool, threads);
+
+    if(standardized){
+        ann_fold_standardization(&net, mean, std);
+        printf("standardization folded into layer 1, accuracy %.4f\n", accuracy(&net, raw, targets, n_samples));
+    }
+    write_blob(argv[4], &net, NULL);
+    write_floats(argv[4], "weights", net.weights, net.n_weights);
+    write_floats(argv[4], "bias", net.bias, net.n_bias);
+    return 0;
+}
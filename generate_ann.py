@@ -0,0 +1,320 @@
+import argparse
+import random
+import re
+import struct
+import zlib
+
+# Generates a header with a topology-specialized, fully unrolled forward pass for EmbeddedML.
+# The emitted <name>_run(input, output) computes the same outputs as run_ann for the given
+# topology, activation and weights, with constant bounds, inlined activations and const weights
+# that the linker keeps in flash. Every dot product is spelled out in the order of the library's
+# blocked kernels (four lane sums over k mod 4, paired, then the tail, then the bias), so the
+# outputs match run_ann bit for bit as long as both are built without FMA contraction.
+#
+# Without --weights, random initial weights are drawn and also written to weights.txt
+# (the format randomweights.py used to produce) so they can seed on-device training.
+# --blob also writes the model in the EmbeddedML binary format for ann_load_from_buffer.
+#
+# --activation takes one letter for every layer or one per layer, first hidden layer first, as
+# set_layer_actfunc; 'x' (softmax) is for the output layer. --model reads topology, activations,
+# weights, bias and input groups from a float model blob instead, e.g. one written by ann_train.
+#
+# --input-group normalizes the inputs to unit L2 norm in groups of that width before the first
+# layer, as ann_normalize_input does; the blob records it. --standardize folds a per-feature
+# (x - mean)/std into the first layer's weights and bias, so it costs nothing at inference.
+
+# Element-wise activations, the same arithmetic as activate_layer's cases; softmax is emitted per layer
+ACTIVATIONS = {
+    'r': ('relu', 'if(x < 0.0) return 0.0;\n'
+                  '    else if(x > 1.0) return 0.1*x+0.93;\n'
+                  '    return x;'),
+    'R': ('relu2', 'if(x < -1.0)     return 0.1*x-0.93;\n'
+                   '    else if(x > 1.0) return 0.1*x+0.93;\n'
+                   '    return x;'),
+    's': ('sigmoid', 'return 1.0f/(1.0f + expf(-x));'),
+    't': ('tanh', 'return tanhf(x);'),
+    'l': ('linear', 'return x;'),
+    'L': ('leaky_relu', 'return (x < 0.0) ? 0.01*x : x;'),
+}
+
+# ACT_* codes and ANN_MODEL_* constants from embeddedML.h
+ACTIVATION_CODES = {'r': 0, 'R': 1, 's': 2, 't': 3, 'l': 4, 'L': 5, 'S': 6, 'T': 7, 'x': 8}
+ANN_MAX_LAYERS = 8
+ANN_MODEL_MAGIC = 0x4D4C4D45
+ANN_MODEL_VERSION = 1
+ANN_MODEL_FLOAT = 0x0001
+ANN_MODEL_QUANT = 0x0002
+ANN_MODEL_PER_CHANNEL = 0x0004
+ANN_MODEL_TRAIN = 0x0008
+ANN_MODEL_NORM = 0x0010
+
+
+def read_floats(path):
+    with open(path) as f:
+        text = f.read()
+    # Drop array sizes such as "[108]" and anything before "=" of a C declaration
+    text = re.sub(r'\[[^\]]*\]', '', text)
+    text = text.split('=', 1)[-1]
+    return [float(v) for v in re.findall(r'[-+]?(?:\d+\.\d*|\.\d+|\d+)(?:[eE][-+]?\d+)?', text)]
+
+
+def write_random_weights(count, path='weights.txt'):
+    weights = [round(random.random(), 4) for i in range(count)]
+    with open(path, 'w+') as f:
+        f.write(f'float weights[{count}] = {{')
+        weights_string = [f'{weight:<08},' if (i+1)%5 != 0 else f'{weight:<08},\n                     ' for i, weight in enumerate(weights)]
+        csv_string = ' '.join(weights_string)
+        csv_string = csv_string.rstrip(',')
+        csv_string += '};'
+        f.write(csv_string)
+    return weights
+
+
+def literal(value):
+    # Shortest decimal that round-trips through float32
+    f32 = struct.unpack('f', struct.pack('f', value))[0]
+    for digits in range(6, 10):
+        text = f'{f32:.{digits}g}'
+        if struct.unpack('f', struct.pack('f', float(text)))[0] == f32:
+            break
+    if 'e' not in text and '.' not in text:
+        text += '.0'
+    return text + 'f'
+
+
+def layer_bias(bias, topology, layer):
+    # Biases are stored layer after layer, as in ANN.bias
+    offset = sum(topology[1:layer])
+    return bias[offset:offset + topology[layer]]
+
+
+def fold_standardization(topology, weights, bias, mean, std):
+    # Same arithmetic as ann_fold_standardization: w/std per input, bias -= sum(w/std*mean)
+    n_in, n_out = topology[0], topology[1]
+    weights, bias = list(weights), list(bias)
+    for i in range(n_out):
+        for k in range(n_in):
+            weights[n_in*i + k] /= std[k]
+            bias[i] -= weights[n_in*i + k]*mean[k]
+    return weights, bias
+
+
+def layer_activations(activation, n_layers):
+    # One letter for every layer, or one per layer as set_layer_actfunc
+    if len(activation) == 1:
+        return activation * (n_layers - 1)
+    if len(activation) != n_layers - 1:
+        raise ValueError(f"'{activation}' needs 1 or {n_layers - 1} activation letters")
+    return activation
+
+
+def check_activations(activations):
+    for l, a in enumerate(activations, 1):
+        if a in 'ST':
+            raise ValueError(f"layer {l}: table activation '{a}' is not generated, use '{a.lower()}' or run_ann")
+        if a not in ACTIVATIONS and a != 'x':
+            raise ValueError(f"layer {l}: unknown activation '{a}'")
+        if a == 'x' and l != len(activations):
+            raise ValueError(f'layer {l}: softmax is for the output layer only')
+
+
+def read_model(path):
+    # Float section of an ANN_MODEL_HEADER blob: topology, activation letters, weights, bias, input group
+    with open(path, 'rb') as f:
+        blob = f.read()
+    magic, version, flags, n_layers, n_weights, n_bias, size, codes, reserved, crc = \
+        struct.unpack_from('<IHHIIII7sBI', blob)
+    if magic != ANN_MODEL_MAGIC or version != ANN_MODEL_VERSION:
+        raise ValueError(f'{path}: not an EmbeddedML model')
+    if size > len(blob) or zlib.crc32(blob[36:size], zlib.crc32(blob[:32])) != crc:
+        raise ValueError(f'{path}: truncated or corrupt')
+    if not flags & ANN_MODEL_FLOAT:
+        raise ValueError(f'{path}: no float section')
+    letters = {code: letter for letter, code in ACTIVATION_CODES.items()}
+    off = 36
+    topology = list(struct.unpack_from(f'<{n_layers}I', blob, off))
+    off += 4*n_layers
+    weights = list(struct.unpack_from(f'<{n_weights}f', blob, off))
+    off += 4*n_weights
+    bias = list(struct.unpack_from(f'<{n_bias}f', blob, off))
+    off += 4*n_bias
+    input_group = 0
+    if flags & ANN_MODEL_NORM:
+        # Last word before the end, after the optional training and quantized sections
+        input_group = struct.unpack_from('<I', blob, size - 4)[0]
+    activation = ''.join(letters[c] for c in codes[:n_layers - 1])
+    return topology, activation, weights, bias, input_group
+
+
+def model_blob(topology, activation, weights, bias, input_group=0):
+    # ANN_MODEL_HEADER followed by the topology, the float section and the input groups
+    n_weights = sum(topology[l]*topology[l-1] for l in range(1, len(topology)))
+    payload = struct.pack(f'<{len(topology)}I', *topology)
+    payload += struct.pack(f'<{n_weights}f', *weights[:n_weights])
+    payload += struct.pack(f'<{len(bias)}f', *bias)
+    flags = ANN_MODEL_FLOAT
+    if input_group:
+        payload += struct.pack('<I', input_group)
+        flags |= ANN_MODEL_NORM
+    codes = bytes(ACTIVATION_CODES[a] for a in layer_activations(activation, len(topology))).ljust(ANN_MAX_LAYERS - 1, b'\0')
+    head = struct.pack('<IHHIIII7sB', ANN_MODEL_MAGIC, ANN_MODEL_VERSION, flags,
+                       len(topology), n_weights, len(bias), len(payload) + 36, codes, 0)
+    crc = zlib.crc32(payload, zlib.crc32(head))
+    return head + struct.pack('<I', crc) + payload
+
+
+# Lanes and their order as dot_lanes/dot_block in embeddedML.c
+ANN_LANES = 4
+
+
+def dot_expression(name, layer, row, src, n):
+    full = n - n % ANN_LANES
+    if full:
+        # Every lane accumulator starts from 0.0f, as in the kernels (it also turns -0 into +0)
+        lanes = []
+        for j in range(ANN_LANES):
+            terms = ' + '.join(f'{name}_w{layer}[{row}][{k}]*{src}[{k}]' for k in range(j, full, ANN_LANES))
+            lanes.append(f'(0.0f + {terms})')
+        total = f'(({lanes[0]} + {lanes[1]}) + ({lanes[2]} + {lanes[3]}))'
+    else:
+        total = '0.0f'
+    for k in range(full, n):
+        total += f' + {name}_w{layer}[{row}][{k}]*{src}[{k}]'
+    return f'({total}) + {name}_b{layer}[{row}]'
+
+
+def generate(name, topology, activation, weights, bias, input_group=0):
+    activations = layer_activations(activation, len(topology))
+    check_activations(activations)
+    lines = []
+    guard = f'{name.upper()}_ANN_H'
+    lines.append(f'/* Generated by generate_ann.py, do not edit */')
+    lines.append(f'/* Topology {"-".join(map(str, topology))}, activation \'{activation}\' */')
+    lines.append('')
+    lines.append(f'#ifndef {guard}')
+    lines.append(f'#define {guard}')
+    lines.append('')
+    if input_group or set(activations) & set('stx'):
+        lines.append('#include <math.h>')
+        lines.append('')
+
+    offset = 0
+    for l in range(1, len(topology)):
+        rows, cols = topology[l], topology[l-1]
+        lines.append(f'static const float {name}_w{l}[{rows}][{cols}] = {{')
+        for i in range(rows):
+            row = ', '.join(literal(w) for w in weights[offset + cols*i:offset + cols*(i+1)])
+            lines.append(f'    {{{row}}},')
+        lines.append('};')
+        b = layer_bias(bias, topology, l)
+        lines.append(f'static const float {name}_b{l}[{rows}] = {{{", ".join(literal(v) for v in b)}}};')
+        lines.append('')
+        offset += rows*cols
+
+    for a in sorted(set(activations) - {'x'}):
+        fn, body = ACTIVATIONS[a]
+        lines.append(f'static inline float {name}_{fn}(float x){{')
+        lines.append(f'    {body}')
+        lines.append('}')
+        lines.append('')
+
+    lines.append(f'static inline void {name}_run(const float *input, float *output){{')
+    if input_group:
+        lines.append(f'    float x[{topology[0]}];')
+    for l in range(1, len(topology) - 1):
+        lines.append(f'    float a{l}[{topology[l]}];')
+    if input_group:
+        # One unrolled L2 norm per group, as ann_normalize_input
+        for g in range(0, topology[0], input_group):
+            squares = ' + '.join(f'input[{g + j}]*input[{g + j}]' for j in range(input_group))
+            lines.append('')
+            lines.append(f'    float s{g} = {squares};')
+            lines.append(f'    s{g} = (s{g} > 0.0f) ? 1.0f/sqrtf(s{g}) : 0.0f;')
+            for j in range(input_group):
+                lines.append(f'    x[{g + j}] = input[{g + j}]*s{g};')
+    for l in range(1, len(topology)):
+        src = ('x' if input_group else 'input') if l == 1 else f'a{l-1}'
+        dst = 'output' if l == len(topology) - 1 else f'a{l}'
+        lines.append('')
+        a = activations[l-1]
+        for i in range(topology[l]):
+            dot = dot_expression(name, l, i, src, topology[l-1])
+            lines.append(f'    {dst}[{i}] = {dot};' if a == 'x' else f'    {dst}[{i}] = {name}_{ACTIVATIONS[a][0]}({dot});')
+    if activations[-1] == 'x':
+        # Softmax over the output row, the same steps as activate_layer
+        n = topology[-1]
+        lines.append('')
+        lines.append('    float m = output[0], g = 0.0f;')
+        lines.append(f'    for(int i = 1; i < {n}; i++) m = (output[i] > m) ? output[i] : m;')
+        lines.append(f'    for(int i = 0; i < {n}; i++){{')
+        lines.append('        output[i] = expf(output[i] - m);')
+        lines.append('        g += output[i];')
+        lines.append('    }')
+        lines.append('    g = 1.0f/g;')
+        lines.append(f'    for(int i = 0; i < {n}; i++) output[i] = output[i]*g;')
+    lines.append('}')
+    lines.append('')
+    lines.append('#endif')
+    lines.append('')
+    return '\n'.join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a specialized EmbeddedML forward pass')
+    parser.add_argument('--topology', default='6,9,6', help='comma separated layer widths')
+    parser.add_argument('--activation', default='R', help="one letter for all layers or one per layer: r, R, s, t, l, L, "
+                                                          "x (softmax, output layer only)")
+    parser.add_argument('--model', help='float model blob, e.g. from ann_train; replaces --topology, --activation, '
+                                        '--weights, --bias and --input-group')
+    parser.add_argument('--weights', help='float list, e.g. weights.txt (random if omitted)')
+    parser.add_argument('--bias', help='float list with one value per neuron (0.5 if omitted)')
+    parser.add_argument('--name', default='motion', help='prefix of the generated symbols')
+    parser.add_argument('--output', help='header to write (default <name>_ann.h)')
+    parser.add_argument('--blob', help='also write the model in the binary format read by ann_load_from_buffer')
+    parser.add_argument('--input-group', type=int, default=0, help='L2-normalize the inputs in groups of this width, e.g. 3')
+    parser.add_argument('--standardize', help='float list of topology[0] means then topology[0] standard deviations, folded into layer 1')
+    args = parser.parse_args()
+
+    if args.model:
+        try:
+            topology, args.activation, weights, bias, args.input_group = read_model(args.model)
+        except (ValueError, struct.error) as e:
+            parser.error(str(e))
+    else:
+        topology = [int(v) for v in args.topology.split(',')]
+        n_weights = sum(topology[l]*topology[l-1] for l in range(1, len(topology)))
+        n_bias = sum(topology[1:])
+
+        if args.weights:
+            weights = read_floats(args.weights)
+        else:
+            weights = write_random_weights(n_weights)
+        if len(weights) < n_weights:
+            # Missing trailing values are zero, as in a partially initialized C array
+            weights += [0.0] * (n_weights - len(weights))
+
+        bias = read_floats(args.bias) if args.bias else [0.5] * n_bias
+        if len(bias) != n_bias:
+            parser.error(f'{args.bias}: {len(bias)} biases, topology {args.topology} needs {n_bias}')
+    try:
+        check_activations(layer_activations(args.activation, len(topology)))
+    except ValueError as e:
+        parser.error(str(e))
+
+    if args.input_group and topology[0] % args.input_group:
+        parser.error(f'--input-group {args.input_group} does not divide the {topology[0]} inputs')
+    if args.standardize:
+        stats = read_floats(args.standardize)
+        if len(stats) != 2*topology[0]:
+            parser.error(f'--standardize needs {2*topology[0]} values, {len(stats)} given')
+        weights, bias = fold_standardization(topology, weights, bias, stats[:topology[0]], stats[topology[0]:])
+
+    with open(args.output or f'{args.name}_ann.h', 'w') as f:
+        f.write(generate(args.name, topology, args.activation, weights, bias, args.input_group))
+    if args.blob:
+        with open(args.blob, 'wb') as f:
+            f.write(model_blob(topology, args.activation, weights, bias, args.input_group))
+
+
+if __name__ == '__main__':
+    main()